@@ -25,6 +25,7 @@
 #include "file_dialog.h"
 // RISC core
 #include "emu.h"
+#include "emu_thread.h"
 
 struct AppSettings
 {
@@ -58,15 +59,29 @@ class App
     const char *glsl_version;
     ImVec4 window_bg_color;
 
-    // Emulator
+    // Emulator, run by emu_thread once the render loop starts. The GUI then
+    // only sends it commands and draws from `view`.
     Emulator emu;
+    EmuThread emu_thread{emu};
+    emu_view view;
+#ifdef __EMSCRIPTEN__
+    // WFI sleeps run on the UI thread, so keep each one well under a frame
+    static constexpr u32 WFI_SLEEP_USEC = 1000;
+#endif
+    // Emulation time per frame in the web build
+    static constexpr u32 FRAME_EMU_USEC = 10000;
+    // GUI copies of emulator settings, sent as commands when edited
+    std::string elf_file_path;
+    std::string bin_file_path;
+    bool debug_mode = false;
+    int clk_freq_sel = -1;
     ImGui::FileBrowser elfFileDialog;
     ImGui::FileBrowser linuxFileDialog;
 
     // Framebuffer texture
     GLuint fb_texture_id = 0;
-    static constexpr int FB_W = 850;
-    static constexpr int FB_H = 478;
+    static constexpr int FB_W = FB_WIDTH;
+    static constexpr int FB_H = FB_HEIGHT;
 
 public:
     App(/* args */);
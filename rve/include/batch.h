@@ -0,0 +1,82 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "types.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Batch runner: many independent machines in one process. Every instance is
+// an Emulator of its own (RAM, console, network link, terminal state) whose
+// UART output goes to its own file; the worker writes it out after each time
+// slice, so an instance holds no console thread or pipe, only its log file
+// descriptor. A pool of worker threads time-slices the instances in quanta of
+// `quantum` instructions: each worker runs the instances queued on it
+// round-robin and, once its queue is empty, steals from the other end of
+// another worker's queue. An instance ends on poweroff, an exit ecall (ELFs
+// only), an unimplemented instruction or `limit`.
+
+const u32 BATCH_QUANTUM_INS = 1000000;
+// Longest host sleep per WFI, so an idle guest only briefly holds its worker
+const u32 BATCH_WFI_SLEEP_USEC = 1000;
+
+class Emulator;
+class Jit;
+
+typedef struct {
+    std::string path;     // ELF, Linux image or snapshot
+    std::string log_path; // File the UART output goes to
+    Emulator *emu;        // nullptr until first scheduled
+    Jit *jit;
+    int log_fd;
+    bool is_elf;
+    u64 retired;          // Instructions retired so far
+    double seconds;       // Host time spent running it
+    const char *stop;     // Why it ended (nullptr while it runs)
+} batch_instance;
+
+class Batch
+{
+public:
+    // Settings, applied when run() starts
+    u32 threads = 0;                  // Worker threads (0 = one per host CPU)
+    u32 quantum = BATCH_QUANTUM_INS;  // Instructions per time slice
+    u64 limit = 0;                    // Instructions per instance (0 = no limit)
+    u32 mem_size = 0;                 // Guest RAM per instance (0 = default)
+    bool use_jit = false;
+    std::string out_dir = ".";
+
+    Batch();
+    ~Batch();
+
+    void add(const char *path);
+    // Run every instance to completion and print a summary on stderr. Returns
+    // the process exit status: 0 unless an instance faulted, could not be
+    // started or exited with a non-zero status.
+    int run();
+
+private:
+    typedef struct {
+        std::mutex lock;
+        std::deque<u32> queue; // Runnable instances (indices into inst)
+    } worker_queue;
+
+    std::vector<batch_instance> inst;
+    std::vector<worker_queue *> queues;
+    std::atomic<u32> remaining; // Instances not yet finished
+    std::mutex idle_lock;
+    std::condition_variable idle_cond;
+    std::atomic<u32> idle_workers;
+
+    void workerLoop(u32 id);
+    bool take(u32 id, u32 *index);
+    void push(u32 id, u32 index);
+    bool start(batch_instance &in);
+    bool slice(batch_instance &in);
+    void finish(batch_instance &in, const char *stop);
+};
+
+#endif
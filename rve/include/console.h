@@ -0,0 +1,109 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include "types.h"
+#include <atomic>
+#ifndef __EMSCRIPTEN__
+#include <thread>
+#endif
+
+// Host side of the UART. Once open(), a host I/O thread owns the file
+// descriptors: transmitted bytes are queued in a ring and written out in
+// batches, and input is read ahead into a second ring, so the emulation
+// thread never makes a syscall for console traffic. Once openLog(), output is
+// queued the same way but written out by the emulation thread's own drain()
+// calls, with no thread, pipe or input. Until either (and always on the web
+// build) bytes go straight to stdout / come from stdin.
+
+const u32 CONSOLE_RING_SIZE = 64 * 1024; // Bytes per direction (power of two)
+
+// Lock-free single-producer single-consumer byte ring
+class ConsoleRing
+{
+public:
+    ConsoleRing() : head(0), tail(0) {}
+
+    bool empty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+    u32 used() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+
+    // Producer side
+    bool push(u8 c)
+    {
+        u32 h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == CONSOLE_RING_SIZE)
+            return false;
+        buf[h & (CONSOLE_RING_SIZE - 1)] = c;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+    u32 pushSome(const u8 *src, u32 len);
+
+    // Consumer side
+    bool pop(u8 *c)
+    {
+        u32 t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire))
+            return false;
+        *c = buf[t & (CONSOLE_RING_SIZE - 1)];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+    // Contiguous readable span (up to the wrap point); release it with consume()
+    u32 peek(const u8 **data) const;
+    void consume(u32 len) { tail.store(tail.load(std::memory_order_relaxed) + len, std::memory_order_release); }
+
+private:
+    std::atomic<u32> head; // Next write position (producer)
+    std::atomic<u32> tail; // Next read position (consumer)
+    u8 buf[CONSOLE_RING_SIZE];
+};
+
+class Console
+{
+public:
+    Console();
+    ~Console();
+
+    // Hand `in_fd` (-1 for none) and `out_fd` to the I/O thread. `wake_fd` is
+    // written to whenever input arrives (-1 for none). No-op if already open.
+    bool open(int in_fd, int out_fd, int wake_fd = -1);
+    // Queue output for `out_fd` until drain(), with no input. No-op if
+    // already open.
+    bool openLog(int out_fd);
+    // Flush pending output and stop the I/O thread
+    void close();
+
+    // Emulation thread side
+    void put(u8 c);
+    bool get(u8 *c);
+    // Input is buffered and get() will succeed
+    bool inputReady() { return threaded && !rx.empty(); }
+    // Descriptor an idle host thread should wait on for input (-1 if the I/O
+    // thread signals the wake_fd instead)
+    int inputFd() { return threaded ? -1 : in_fd; }
+    // Block until everything put() so far has been written
+    void flush();
+    // openLog(): write out everything put() so far
+    void drain();
+
+private:
+    ConsoleRing tx;
+    ConsoleRing rx;
+    int in_fd;
+    int out_fd;
+    int wake_fd;
+    bool threaded;
+    bool logged; // openLog()
+#ifndef __EMSCRIPTEN__
+    int notify_fd[2];                // Wakes the I/O thread for output or shutdown
+    std::atomic<bool> tx_notified;   // A notify byte is pending for queued output
+    std::atomic<bool> stopping;
+    std::thread io_thread;
+
+    void notify();
+    void ioLoop();
+    void writeOut();
+#endif
+};
+
+#endif
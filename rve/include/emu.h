@@ -4,9 +4,15 @@
 #include <cstdint>
 #include <cstdlib>
 #include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifndef __EMSCRIPTEN__
+#include <termios.h>
+#endif
 #include "rv32.h"
 #include "loader.h"
 #include "disasm.h"
+#include "smp.h"
 
 using u32 = uint32_t;
 using uint16 = uint16_t;
@@ -29,7 +35,6 @@ typedef struct
     u32 csr;
     u32 rs;
     u32 rd;
-    u32 value;
 } FormatCSR;
 
 FormatCSR parse_FormatCSR(u32 word);
@@ -84,21 +89,83 @@ typedef struct
 
 FormatEmpty parse_FormatEmpty(u32 word);
 
+// Operand fields extracted once at decode time, one member per instruction format
+typedef union
+{
+    FormatB as_FormatB;
+    FormatCSR as_FormatCSR;
+    FormatI as_FormatI;
+    FormatJ as_FormatJ;
+    FormatR as_FormatR;
+    FormatS as_FormatS;
+    FormatU as_FormatU;
+    FormatEmpty as_FormatEmpty;
+} DecodedFormat;
+
+// Decode flags
+#define DECODE_FP_CHECK 0x2 // FP compute opcode: traps while mstatus.FS == Off
+#define DECODE_BLOCK_END 0x4 // SYSTEM / MISC-MEM opcode: ends an emulateBlock() run
+
+class Emulator;
+struct DecodedIns;
+typedef void (*ins_exec)(Emulator &emu, DecodedIns *d, ins_ret *ret);
+
+// Pre-decoded instruction: handler plus operands, cached per physical page
+struct DecodedIns
+{
+    ins_exec exec;     // Handler thunk, nullptr while the slot is not decoded
+    u32 ins_word;      // Raw instruction word
+    u16 flags;         // DECODE_* flags
+    u16 op;            // Dispatch opcode for emulateBlock() (0: call exec)
+#ifdef RV32_STATS
+    u16 entry;         // Decoder entry, counted in cpu.stats.ins
+#endif
+    DecodedFormat fmt; // Pre-parsed operand fields
+};
+
+// Instructions per decoded page
+const u32 DECODED_PAGE_INS = RV32_PAGE_SIZE / 4;
 
+// Maximum instructions per emulateBlock() call between device polls
+const u32 BLOCK_MAX_INS = 256;
+
+// Longest single host sleep for an idle WFI (microseconds)
+const u32 WFI_SLEEP_MAX_USEC = 100000;
+
+// Host wall-clock time in seconds, for run timings
+static inline double wallSeconds()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
 
 // Emulator
-#define def(name, fmt_t) \
-    void emu_##name(u32 ins_word, ins_ret *ret, fmt_t ins)
+#define def(name, fmt_t)                                        \
+    void emu_##name(u32 ins_word, ins_ret *ret, fmt_t ins);     \
+    static void exec_##name(Emulator &emu, DecodedIns *d, ins_ret *ret)
 
 
 class Emulator
 {
 public:
-    int MEM_SIZE = 1024 * 1024 * 128; // 128MiB
+    // Guest RAM size to use from the next initialize*() call on
+    // (RV32_MEM_SIZE_MIN..RV32_MEM_SIZE_MAX, whole pages)
+    u32 mem_size = RV32_MEM_SIZE_DEFAULT;
+
+    // Harts to run from the next initialize*() on (1..SMP_HARTS_MAX, see smp.h)
+    u32 hart_count = 1;
 
     uint8_t *memory;
+    u32 ram_size = 0;             // Bytes currently reserved at memory
+    bool ram_file_backed = false; // Some RAM is mapped from a file (see ramMapFile)
     RV32 cpu;
 
+    // Harts 1.. of a multi-hart machine (nullptr until one is started), and on
+    // those harts, hart 0's Emulator whose RAM they share
+    Smp *smp;
+    Emulator *boot;
+
     // Filenames
     std::string elf_file_path = "no elf selected";
     std::string dts_file_path = "no dts selected";
@@ -111,6 +178,35 @@ public:
     // Control
     bool ready_to_run = false;
 
+    // Idle: longest host sleep per WFI in microseconds (0 = busy-wait), and
+    // set whenever retire() slept (cleared by the caller)
+    u32 wfi_sleep_max = WFI_SLEEP_MAX_USEC;
+    bool idled = false;
+
+    // Exit ecall (a7 = 93): set when the guest asks to exit, with its status.
+    // With stop_on_exit the emulator also stops running.
+    bool stop_on_exit = false;
+    bool exited = false;
+    u32 exit_status = 0;
+
+    // Unimplemented instruction: exit the process, or with exit_on_fault
+    // cleared only stop this instance and set faulted
+    bool exit_on_fault = true;
+    bool faulted = false;
+
+    // Instructions hart 0 retired, across reboots (see retiredCount)
+    u64 retired = 0;
+    u32 retired_clock = 0;
+
+    // Host descriptors behind the guest UART from the next initialize*() on
+    // (console_in -1: no input). A terminal on console_in is put in raw mode.
+    int console_in = STDIN_FILENO;
+    int console_out = STDOUT_FILENO;
+    // Console I/O on a host thread with a wake pipe for input (Console::open).
+    // Cleared, output is queued for the caller to drain (Console::openLog) and
+    // the instance holds no thread or pipe.
+    bool console_thread = true;
+
     // Clock frequency
     int clk_freq_sel = -1; // Hertz
     // int clk_freq_sel = 10; // Hertz
@@ -118,18 +214,61 @@ public:
     float time_sum = 0;
     float sec_per_cycle = 1.0 / clk_freq_sel;
 
+    // Pre-decoded instruction cache, indexed by guest physical RAM page.
+    // Pages are allocated on first fetch; a page's entries are valid only while
+    // cpu.page_flags has PAGE_CODE set (cleared by stores and fence.i).
+    DecodedIns **icache;
+
+#ifndef __EMSCRIPTEN__
+    // Terminal settings to restore while console_in is in raw mode
+    struct termios term_saved;
+    bool term_captured = false;
+#endif
+
     Emulator(/* args */);
     ~Emulator();
 
-    void initialize();
+    bool initialize();
     void initializeBin(const char *path);
     void initializeElf(const char *path);
     void initializeElfDts(const char *elf_file, const char *dts_file);
+    void initializeSnapshot(const char *path);
+    void initializeProgram(const u32 *words, u32 count);
+    void initializeHart(Emulator &hart0, u32 id);
+    void hartsStart();
+
+    // Guest RAM: one mem_size mapping, kept until the size changes. Pages are
+    // zero until written; file-backed ranges are private copy-on-write, so
+    // instances started from the same file share its clean pages.
+    bool ramInit();
+    void ramFree();
+    void ramReset();
+    bool ramMapFile(int fd, u64 file_offset, u32 ram_offset, u32 len);
+    bool ramMapImage(const char *path, u32 limit);
+
+#ifndef __EMSCRIPTEN__
+    void terminalCapture();
+    void terminalRestore();
+#endif
     void emulate(); // formerly cpu_tick
+    void emulateBlock(u32 budget);
+    void retire(ins_ret *ret);
+    u64 retiredCount();
     ins_ret insSelect(u32 ins_word);
 
+    // Decoding
+    void decode(u32 ins_word, DecodedIns *d);
+    ins_ret execute(DecodedIns *d);
+    DecodedIns *icacheFetch(u32 phys_pc);
+    static void exec_illegal(Emulator &emu, DecodedIns *d, ins_ret *ret);
+
+#ifdef RV32_STATS
+    // Write every hart's counters (see rv32_stats) to `path`: JSON if it ends
+    // in ".json", else CSV rows of section,name,count. False on an I/O error.
+    bool statsWrite(const char *path);
+#endif
+
     // File utilities
-    u8 getMmapPtr(const char *path);
     u8 getFileSize(const char *path);
 
     // Instruction defintion
@@ -0,0 +1,111 @@
+#ifndef EMU_THREAD_H
+#define EMU_THREAD_H
+
+#include "types.h"
+#include "rv32.h"
+#include <atomic>
+#include <string>
+#ifndef __EMSCRIPTEN__
+#include <thread>
+#endif
+
+// Runs an Emulator for the GUI on a thread of its own, so the guest runs at
+// full speed whatever the frame rate. Once started, only the emulation thread
+// touches the Emulator: the GUI sends it commands through a single-producer,
+// single-consumer ring (no locks; the producer is the GUI thread) and reads a
+// copy of the CPU state the emulation thread publishes under a sequence
+// counter. Guest RAM is read directly for display.
+//
+// The web build has no threads: the frame calls service() instead.
+
+class Emulator;
+
+typedef enum {
+    EMU_CMD_TOGGLE,   // Start/stop
+    EMU_CMD_STEP,     // One instruction, while stopped
+    EMU_CMD_RESET,
+    EMU_CMD_LOAD_ELF, // path
+    EMU_CMD_LOAD_BIN, // path
+    EMU_CMD_KEY,      // value = keycode, flag = release
+    EMU_CMD_DEBUG,    // flag = debug mode
+    EMU_CMD_CLOCK,    // value = Hertz (-1 = unthrottled)
+} emu_cmd_type;
+
+typedef struct {
+    emu_cmd_type type;
+    s32 value;
+    bool flag;
+    char path[256];
+} emu_cmd;
+
+// Command ring entries (power of two)
+const u32 EMU_CMD_RING = 256;
+// Host sleep between command polls while the guest is stopped or throttled
+const u32 EMU_THREAD_IDLE_USEC = 1000;
+// Words in a bitmap of framebuffer pages
+const u32 EMU_FB_WORDS = (FB_PAGES + 63) / 64;
+
+// CPU state as of the end of a block
+typedef struct {
+    u32 xreg[32];
+    u32 pc;
+    u32 ins;           // Instruction word at pc (0 if it can't be fetched)
+    u32 clock;
+    u32 reservation_addr;
+    bool reservation_en;
+    bool running;
+    bool ready_to_run;
+    bool debug_mode;
+    u8 *memory;
+    u32 ram_size;
+} emu_view;
+
+class EmuThread
+{
+public:
+    EmuThread(Emulator &emu);
+    ~EmuThread();
+
+    // Start/stop the emulation thread; the GUI may only use push() and
+    // view() in between
+    void start();
+    void stop();
+
+    // Queue a command (GUI thread only); false if the ring is full
+    bool push(const emu_cmd &cmd);
+    bool push(emu_cmd_type type, s32 value = 0, bool flag = false, const char *path = nullptr);
+    // Latest published CPU state
+    void view(emu_view *out);
+    // Framebuffer pages stored to since the last call (bit i = page i of the
+    // window at FB_RAM_BASE); false if none
+    bool fbTake(u64 *bitmap);
+
+    // Run commands and up to `usec` of emulation (emulation thread, or the
+    // frame in the web build)
+    void service(u32 usec);
+
+private:
+    Emulator &emu;
+    emu_cmd ring[EMU_CMD_RING];
+    std::atomic<u32> head; // Next command to run (consumer)
+    std::atomic<u32> tail; // Next free entry (producer)
+
+    // Seqlock: odd while the emulation thread is writing `state`
+    std::atomic<u32> seq;
+    emu_view state;
+    // Dirty framebuffer pages published and not yet taken
+    std::atomic<u64> fb_dirty[EMU_FB_WORDS];
+
+    double next_tick; // Throttled clock: when the next instruction is due
+#ifndef __EMSCRIPTEN__
+    std::thread thread;
+#endif
+    std::atomic<bool> quit;
+    bool started;
+
+    void threadLoop();
+    void runCommand(const emu_cmd &cmd);
+    void publish();
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "emu.h"
+
+class Jit;
+
+// Dynamic binary translator: compiles guest basic blocks to host x86-64 code.
+// Only built for x86-64 hosts; the web build and other hosts interpret.
+#if defined(__x86_64__) && !defined(__EMSCRIPTEN__)
+#define RVE_JIT 1
+
+// Code cache and block limits
+const u32 JIT_CODE_SIZE     = 32 * 1024 * 1024; // Executable code cache (bytes)
+const u32 JIT_BLOCK_MAX_INS = 64;               // Guest instructions per block
+const u32 JIT_INS_MAX_CODE  = 160;              // Worst-case host bytes per guest instruction
+
+// Block return codes
+#define JIT_CONTINUE 0 // cpu.pc holds the next guest PC, keep dispatching
+#define JIT_EXIT     1 // Jit::exit_ret holds the result of the instruction at cpu.pc
+
+typedef u32 (*jit_block)(RV32 *cpu, Jit *jit, u32 end_clock);
+
+// Translated block for one guest instruction address
+typedef struct {
+    u32 vpc;         // Virtual PC the block was translated for
+    jit_block code;  // Host code, nullptr while untranslated
+} JitEntry;
+
+class Jit
+{
+public:
+    Emulator &emu;
+    RV32 &cpu;
+
+    // Result of the instruction a block exited on with JIT_EXIT
+    ins_ret exit_ret;
+    // page_flags entry of the page the running block was translated from
+    u8 *cur_flags;
+
+    Jit(Emulator &emu);
+    ~Jit();
+
+    bool init();
+    // Run translated code for about `budget` guest instructions, then poll
+    // devices and interrupts once (see Emulator::retire). Blocks run whole,
+    // so the run can go up to JIT_BLOCK_MAX_INS - 1 instructions past the
+    // budget; use Emulator::emulateBlock() where the count must be exact.
+    void run(u32 budget);
+
+private:
+    u8 *code_buf;
+    u32 code_used;
+
+    // Block entry points, indexed by guest physical RAM page. A page's entries
+    // are valid only while cpu.page_flags has PAGE_JIT set.
+    JitEntry **pages;
+    u32 page_count;
+
+    jit_block lookup(u32 vpc, u32 phys_pc);
+    jit_block compile(u32 vpc, u32 phys_pc);
+    void flush();
+};
+
+#endif
+
+#endif
@@ -22,6 +22,14 @@ struct ElfSection
     std::vector<uint8_t> sData;
 };
 
+struct ElfSymbol
+{
+    uint32_t addr;
+    uint32_t size;
+    uint8_t type; // STT_*
+    std::string name;
+};
+
 // Function to load a Linux image from the specified file path into memory.
 // Parameters:
 // - path: A pointer to a constant character array representing the file path of the Linux image.
@@ -39,6 +47,21 @@ int loadLinuxImage(const char *path, uint64_t path_len, uint8_t *data, uint64_t
 // https : // stackoverflow.com/questions/13908276/loading-elf-file-in-c-in-user-space
 int loadElf(const char *path, uint64_t path_len, uint8_t *data, uint64_t data_len);
 
+// Function to look up a symbol in the symbol table of a 32-bit ELF file.
+// Parameters:
+// - path: A pointer to a constant character array that specifies the file path of the ELF file.
+// - name: The symbol to look for (e.g. "tohost").
+// - addr: Where the symbol's value is stored when it is found.
+// Returns true if the symbol was found.
+bool elfSymbol(const char *path, const char *name, uint32_t *addr);
+
+// Function to read the named symbols in the symbol table of a 32-bit ELF file.
+// Parameters:
+// - path: A pointer to a constant character array that specifies the file path of the ELF file.
+// - syms: Receives the symbols, in symbol table order.
+// Returns false if the file is not a 32-bit ELF or has no symbol table.
+bool elfSymbols(const char *path, std::vector<ElfSymbol> &syms);
+
 // Function to load a binary file from the specified file path into the provided memory buffer.
 // Parameters:
 // - path: A pointer to a constant character array indicating the file path of the binary file.
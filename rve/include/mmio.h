@@ -0,0 +1,96 @@
+#ifndef MMIO_H
+#define MMIO_H
+
+#include "types.h"
+
+// MMIO device bus for the low (non-RAM) half of the physical address space.
+// Devices register a window with MmioBus::map() and are found through a table
+// indexed by 4 KiB page, so an access costs one lookup and one indirect call.
+
+// Device callbacks. `offset` is relative to the device base. The bus only
+// passes naturally aligned accesses of 1, 2 or 4 bytes that lie inside the
+// window; anything else is split into byte accesses first.
+typedef u32 (*mmio_read_fn)(void *opaque, u32 offset, u32 size);
+typedef void (*mmio_write_fn)(void *opaque, u32 offset, u32 val, u32 size);
+
+// Structure representing one registered device window.
+typedef struct {
+    const char *name;     // Device name (diagnostics only)
+    u32 base;             // First physical address
+    u32 size;             // Window length in bytes
+    void *opaque;         // Passed back to the callbacks
+    mmio_read_fn read;    // nullptr: reads return 0
+    mmio_write_fn write;  // nullptr: writes are ignored
+    u8 shadow;            // Device (index + 1) answering the rest of a shared page, 0 if none
+#ifdef RV32_STATS
+    u64 reads;            // Accesses passed to the callbacks
+    u64 writes;
+#endif
+} mmio_device;
+
+// Bus limits. The tables are fixed-size so a bus can be copied along with the
+// RV32 that owns it.
+const u32 MMIO_MAX_DEVICES = 32;
+const u32 MMIO_MAX_DIRS    = 16;                                    // 4 MiB regions holding devices
+#define MMIO_DIR_SHIFT  22
+#define MMIO_PAGE_SHIFT 12
+const u32 MMIO_DIR_COUNT = 1u << (31 - MMIO_DIR_SHIFT);             // Regions below 0x80000000
+const u32 MMIO_DIR_PAGES = 1u << (MMIO_DIR_SHIFT - MMIO_PAGE_SHIFT); // Pages per region
+
+// Callbacks for windows backed by a plain byte buffer (opaque is the buffer)
+u32 mmioReadBuffer(void *opaque, u32 offset, u32 size);
+void mmioWriteBuffer(void *opaque, u32 offset, u32 val, u32 size);
+
+class MmioBus
+{
+public:
+    MmioBus();
+
+    // Remove every device
+    void reset();
+    // Register a device window. A later window takes over the pages it
+    // covers; on a page it only partly covers, the previous owner still
+    // answers outside the new window.
+    bool map(const char *name, u32 base, u32 size, void *opaque,
+             mmio_read_fn read, mmio_write_fn write);
+
+    // Device whose window contains `addr` (< 0x80000000), or nullptr
+    mmio_device *find(u32 addr)
+    {
+        u8 dir = dirs[addr >> MMIO_DIR_SHIFT];
+        if (dir == 0)
+            return nullptr;
+        u8 idx = pages[dir - 1][(addr >> MMIO_PAGE_SHIFT) & (MMIO_DIR_PAGES - 1)];
+        while (idx != 0)
+        {
+            mmio_device *d = &devices[idx - 1];
+            if (addr - d->base < d->size)
+                return d;
+            idx = d->shadow;
+        }
+        return nullptr;
+    }
+
+    // Little-endian access of `size` (1, 2 or 4) bytes; unmapped reads return 0
+    u32 read(u32 addr, u32 size);
+    void write(u32 addr, u32 val, u32 size);
+
+    // Registered windows, in map() order
+    u32 deviceCount() const { return device_count; }
+    const mmio_device *device(u32 idx) const { return &devices[idx]; }
+
+#ifdef RV32_STATS
+    // Accesses no window claimed
+    u64 unmapped_reads;
+    u64 unmapped_writes;
+#endif
+
+private:
+    mmio_device devices[MMIO_MAX_DEVICES];
+    u32 device_count;
+    u8 dirs[MMIO_DIR_COUNT];                 // Region -> pages[] index + 1 (0 = no devices)
+    u8 pages[MMIO_MAX_DIRS][MMIO_DIR_PAGES]; // Page -> devices[] index + 1 (0 = unmapped)
+    u32 dir_count;
+};
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "types.h"
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Guest PC sampling profiler. Hart 0's device scheduler fires every `period`
+// retired instructions (give or take an eighth, so loops whose length divides
+// the period don't alias) and records the PC and privilege mode of the
+// instruction that just retired. Block runs already stop at scheduler
+// deadlines, so sampling costs one hash update per period.
+//
+// write() symbolizes the histogram against the function symbols of an ELF,
+// or the text symbols of a Linux System.map (kernel-mode samples only), and
+// writes two files:
+//   <prefix>.flat    samples per function, hottest first
+//   <prefix>.folded  collapsed stacks ("mode;function count") for flame graph
+//                    tools; the guest stack is not unwound
+// PCs no symbol covers are reported by address.
+
+class RV32;
+
+// Instructions between samples (prime)
+const u32 PROF_PERIOD_DEFAULT = 10007;
+
+typedef struct {
+    u32 addr;
+    u32 end;          // One past the last byte (0: up to the next symbol)
+    std::string name;
+} prof_symbol;
+
+class Profiler
+{
+public:
+    u32 period = PROF_PERIOD_DEFAULT;
+    std::string prefix = "rve-profile";
+
+    // Symbols for write(); false if the file could not be read
+    bool loadElfSymbols(const char *path);
+    bool loadSystemMap(const char *path);
+
+    // Start sampling `cpu` (after it is initialized)
+    void attach(RV32 &cpu);
+    // Record one sample (RV32::schedRun) and return the instructions until
+    // the next one
+    u32 sample(u32 pc, u32 priv);
+
+    // Write <prefix>.flat and <prefix>.folded; false on an I/O error
+    bool write();
+
+private:
+    std::unordered_map<u64, u64> hist; // priv << 32 | pc -> samples
+    u64 samples = 0;
+    std::vector<prof_symbol> symbols;  // Sorted by address
+    bool kernel_symbols = false;       // System.map: user-mode PCs stay unresolved
+    u32 rng = 0x9e3779b9;
+
+    void sortSymbols();
+    const prof_symbol *lookup(u32 pc, u32 priv);
+};
+
+#endif
@@ -11,6 +11,12 @@
 #include <sys/time.h>
 
 #include "types.h"
+#include "mmio.h"
+#include "console.h"
+#include "net.h"
+
+class Smp;
+class Profiler;
 
 using u32   = uint32_t;
 using uint16 = uint16_t;
@@ -92,8 +98,21 @@ const u32 CSR_NET_TX_BUF_SIZE_AND_SEND= 0x0c1; // Write = send N bytes from TX b
 const u32 CSR_NET_RX_BUF_ADDR         = 0x0c2; // RX buffer physical address (read-only)
 const u32 CSR_NET_RX_BUF_READY        = 0x0c3; // Write = signal RX buffer is ready
 
-// RAM size available to the CPU (must match Emulator::MEM_SIZE)
-static const int RV32_MEM_SIZE = 1024 * 1024 * 128; // 128 MiB
+// Guest RAM starts at physical 0x80000000. Its size is chosen at startup
+// (Emulator::mem_size, copied to RV32::mem_size by init) within these limits;
+// the top of the bit-31 window stays free so RAM end addresses fit in a u32.
+const u32 RV32_MEM_SIZE_MIN     = 16u << 20;            // 16 MiB
+const u32 RV32_MEM_SIZE_DEFAULT = 128u << 20;           // 128 MiB
+const u32 RV32_MEM_SIZE_MAX     = 0x80000000u - (1u << 20); // 2047 MiB
+const u32 RV32_PAGE_SIZE  = 4096;
+
+// Per-page RAM flags (RV32::page_flags). Any set flag routes stores to the page
+// through RV32::pageWritten().
+#define PAGE_CODE 0x1 // Page has pre-decoded instructions in Emulator::icache
+#define PAGE_JIT  0x2 // Page has translated blocks in the JIT code cache
+// Framebuffer page not stored to since RV32::fbDirty() last reported it; a
+// store clears it, so only the first store after a report is slowed down
+#define PAGE_FB_CLEAN 0x4
 
 // MMU mode constants
 #define MMU_MODE_OFF  0
@@ -104,8 +123,69 @@ static const int RV32_MEM_SIZE = 1024 * 1024 * 128; // 128 MiB
 #define MMU_ACCESS_READ  1
 #define MMU_ACCESS_WRITE 2
 
+// Software TLB (direct-mapped, separate instruction and data tables)
+const u32 RV32_TLB_SIZE = 256;
+#define TLB_INVALID 0xffffffffu
+// mstatus bits that change the result of a translation (MPRV | MPP | SUM | MXR)
+#define TLB_MSTATUS_MASK 0x000e1800u
+
+// Device event sources for the scheduler (at most one pending deadline each)
+#define SCHED_TIMER   0 // CLINT mtimecmp check
+#define SCHED_UART_TX 1 // UART THR drain / THRE interrupt
+#define SCHED_UART_RX 2 // Host stdin poll for UART input
+#define SCHED_NET_RX  3 // Host network poll for a received packet
+#define SCHED_PROF    4 // PC sample for the profiler (see profiler.h)
+#define SCHED_COUNT   5
+const u32 SCHED_POLL_INTERVAL = 1024;    // Instructions between host input polls
+const u32 SCHED_MAX_DELAY     = 1u << 30; // Furthest deadline (keeps clock comparisons signed-safe)
+
+#ifdef RV32_STATS
+// Decoder entries with an instruction counter (see Emulator::decode; the
+// entry past the last one counts illegal instructions)
+const u32 STATS_INS_MAX = 256;
+
+// Per-hart execution counters, cleared by reset() and written by
+// Emulator::statsWrite. Device accesses are counted by the MMIO bus.
+typedef struct {
+    u64 ins[STATS_INS_MAX]; // Instructions dispatched, by decoder entry
+    u64 branches[2];        // Conditional branches: [0] not taken, [1] taken
+    u64 exceptions[16];     // Exceptions raised, by cause
+    u64 interrupts[16];     // Interrupts taken, by cause
+    u64 page_walks;         // Sv32 page-table walks (TLB misses)
+} rv32_stats;
+#endif
+
+// CLINT windows (the registers are identical at both bases)
+#define CLINT_MMIO_BASE     0x02000000u // SiFive base used by ELF tests
+#define CLINT_DTB_MMIO_BASE 0x11000000u // Base in the default DTB
+#define CLINT_MMIO_SIZE     0x10000u
+
+// 16550 UART (byte registers)
+#define UART_MMIO_BASE 0x10000000u
+#define UART_MMIO_SIZE 0x8u
+
+// Network DMA buffers (TX follows msip in the DTB CLINT window)
+#define NET_TX_MMIO_BASE 0x11000004u
+#define NET_RX_MMIO_BASE 0x11001000u
+
+// SYSCON poweroff/reboot register
+#define SYSCON_MMIO_BASE 0x11100000u
+
+// Device Tree Blob and MTD (initrd / flash) windows
+#define DTB_MMIO_BASE 0x1020u
+#define DTB_MMIO_SIZE 0xfe0u
+#define MTD_MMIO_BASE 0x40000000u
+
+// Simple framebuffer in RAM (see the DTB framebuffer node), when RAM reaches it
+#define FB_RAM_BASE 0x84000000u
+const u32 FB_WIDTH  = 850; // 32-bit pixels
+const u32 FB_HEIGHT = 478;
+const u32 FB_BYTES  = FB_WIDTH * FB_HEIGHT * 4;
+const u32 FB_PAGES  = (FB_BYTES + RV32_PAGE_SIZE - 1) / RV32_PAGE_SIZE;
+
 // MMIO keyboard device (SDL key events → Linux input subsystem)
 #define KBD_MMIO_BASE 0x10001000u
+#define KBD_MMIO_SIZE 0x2u
 
 // RTC base address offset within its MMIO window (ds1742 compatible)
 #define RTC_MMIO_BASE 0x03000000u
@@ -227,6 +307,7 @@ public:
     // Program counter
     u32 pc;
     u8 *mem;
+    u32 mem_size; // RAM bytes at mem (a multiple of RV32_PAGE_SIZE)
     u8 *dtb;
     // MTD (initrd / flash) - optional
     u8 *mtd;
@@ -234,21 +315,52 @@ public:
     csr_state csr;
     clint_state clint;
     uart_state uart;
+    // Host end of the UART (created by init, kept across re-inits)
+    Console *console;
     // MMU state (Sv32)
     mmu_state mmu;
-    // Network device state
+    // Cached translations, valid for the privilege/mstatus context in tlb_ctx
+    tlb_entry itlb[RV32_TLB_SIZE];
+    tlb_entry dtlb[RV32_TLB_SIZE];
+    u32 tlb_ctx;
+    // Virtual page -> host pointer for RAM pages (loads/stores only). Device
+    // pages are never entered, so they always take the memGet*/memSet* path.
+    host_tlb_entry htlb[RV32_TLB_SIZE];
+    // Network device state, and its host connection (unconnected by default)
     net_state net;
+    net_link netlink;
+    // Device windows below 0x80000000 (see busInit for the built-in ones)
+    MmioBus bus;
     // RTC registers (ds1742 compatible)
     u32 rtc0, rtc1;
     // SYSCON (poweroff/reboot): set when 0x11100000 is written
     u32 syscon_cmd;
+    // Device event scheduler: min-heap of deadlines in guest instructions
+    sched_event sched_heap[SCHED_COUNT];
+    s32 sched_pos[SCHED_COUNT]; // Heap index of each source, -1 when idle
+    u32 sched_count;
+    u32 sched_next;             // Earliest deadline
+    // Measured instructions per microsecond (16.16 fixed point), used to turn
+    // an mtimecmp distance into an instruction deadline
+    u32 sched_rate;
+    u32 rate_clock;
+    u64 rate_usec;
     // Wall-clock reference for CLINT mtime (seconds and microseconds, stored as integers
     // to avoid float precision loss that would make mtime negative → UB on u32 cast)
     int64_t start_time_sec;
     int32_t start_time_usec;
 
+    // LR/SC reservation: the word lr.w reserved and the value it read. sc.w
+    // succeeds only if the word still holds that value, so a store from any
+    // hart that changed it breaks the reservation; other harts' sc.w and AMOs
+    // on the word clear it outright (see reservationBreak). Other harts read
+    // and clear it, so it is accessed with __atomic builtins.
     bool reservation_en;
     u32 reservation_addr;
+    u32 reservation_val;
+
+    // PAGE_* flags for each RAM page (mem_size / RV32_PAGE_SIZE entries)
+    u8 *page_flags;
 
     // MMIO keyboard ring buffer
     struct KbdEvent { u8 keycode; bool release; };
@@ -257,17 +369,48 @@ public:
     void kbdPush(u8 keycode, bool release);
 
     bool debug_single_step;
+    // Set by any device (non-RAM) access; ends an Emulator::emulateBlock() run
+    bool mmio_access;
+    // Set by the wfi instruction; Emulator::retire() idles the host if no
+    // enabled interrupt is pending
+    bool wfi;
+    // Pipe written by wake() to end an idle() sleep early (-1 until wakeInit())
+    int wake_fd[2];
+
+    // SMP (see smp.h): mhartid, the machine's harts (nullptr while there is
+    // only one) and the hart owning the devices (this on hart 0)
+    u32 hart_id;
+    Smp *smp;
+    RV32 *dev;
+    // PC sampling profiler (nullptr when off)
+    Profiler *prof;
+#ifdef RV32_STATS
+    rv32_stats stats;
+#endif
+    // Set by another hart that wrote this hart's mtimecmp (see timerReload)
+    bool timer_dirty;
+    // SCHED_* events (bit per id) raised by device accesses, waiting to be
+    // armed on this hart (see scheduleNow)
+    u32 sched_post;
 
     RV32();
     ~RV32();
 
-    bool init(u8 *memory, u8 *dtb, bool debug_mode = false,
+    bool init(u8 *memory, u32 mem_size, u8 *dtb, bool debug_mode = false,
               u8 *mtd = nullptr, u32 mtd_size = 0);
+    // Reset this RV32 as hart `id` of `boot`'s machine, sharing its RAM and devices
+    void initHart(RV32 &boot, u32 id);
+    void reset(u8 *memory, u32 mem_size, bool debug_mode);
     void dump();
     void tick();
 
-    // Noop
-    ins_ret insReturnNoop();
+    // Noop: falls through to the next instruction, no trap
+    ins_ret insReturnNoop()
+    {
+        ins_ret ret = {};
+        ret.pc_val = pc + 4;
+        return ret;
+    }
 
     // CSR Functions
     bool hasCsrAccessPrivilege(u32 addr);
@@ -283,12 +426,81 @@ public:
 
     // MMU Functions
     u32 mmuTranslate(ins_ret *ret, u32 vaddr, u32 mode);
+    u32 mmuWalk(ins_ret *ret, u32 vaddr, u32 mode, u32 priv, tlb_entry *e);
     void mmuUpdate(u32 satp);
+    void tlbFlush();
+    void tlbSync();
+
+    // Host TLB: host pointer for `size` bytes at virtual `addr`, or nullptr
+    // if the page is not cached or the access crosses into the next page
+    u8 *hostRead(u32 addr, u32 size)
+    {
+        host_tlb_entry *e = &htlb[(addr >> 12) & (RV32_TLB_SIZE - 1)];
+        if (e->tag_read != (addr & ~0xfffu) || (addr & 0xfffu) > 0x1000u - size)
+            return nullptr;
+        return (u8 *)(e->addend + addr);
+    }
+    u8 *hostWrite(u32 addr, u32 size)
+    {
+        host_tlb_entry *e = &htlb[(addr >> 12) & (RV32_TLB_SIZE - 1)];
+        if (e->tag_write != (addr & ~0xfffu) || (addr & 0xfffu) > 0x1000u - size)
+            return nullptr;
+        return (u8 *)(e->addend + addr);
+    }
+    void hostFill(u32 vaddr, u32 paddr, u32 mode);
+
+    // Virtual memory access (1, 2 or 4 bytes, little-endian host assumed)
+    u32 vmRead(ins_ret *ret, u32 vaddr, u32 size)
+    {
+        u8 *host = hostRead(vaddr, size);
+        if (host == nullptr)
+            return vmReadSlow(ret, vaddr, size);
+        if (size == 1)
+            return *host;
+        if (size == 2)
+        {
+            u16 v;
+            memcpy(&v, host, 2);
+            return v;
+        }
+        u32 v;
+        memcpy(&v, host, 4);
+        return v;
+    }
+    void vmWrite(ins_ret *ret, u32 vaddr, u32 val, u32 size)
+    {
+        u8 *host = hostWrite(vaddr, size);
+        if (host == nullptr)
+            return vmWriteSlow(ret, vaddr, val, size);
+        if (size == 1)
+            *host = (u8)val;
+        else if (size == 2)
+        {
+            u16 v = (u16)val;
+            memcpy(host, &v, 2);
+        }
+        else
+            memcpy(host, &val, 4);
+    }
+    u32 vmReadSlow(ins_ret *ret, u32 vaddr, u32 size);
+    void vmWriteSlow(ins_ret *ret, u32 vaddr, u32 val, u32 size);
 
     // RTC Functions
     u8  rtcRead(u32 offset);
     void rtcWrite(u32 offset, u8 data);
 
+    // Built-in MMIO devices (offsets are relative to the device base)
+    void busInit();
+    u32 busRead(u32 addr, u32 size);
+    void busWrite(u32 addr, u32 val, u32 size);
+    RV32 *clintHart(u32 slot);
+    u32 clintRead(u32 offset, u32 size);
+    void clintWrite(u32 offset, u32 val, u32 size);
+    u8 uartRead(u32 offset);
+    void uartWrite(u32 offset, u8 data);
+    u8 kbdRead(u32 offset);
+    void sysconWrite(u32 offset, u8 data);
+
     // Memory Functions
     // Getters
     u32 memGetByte(u32 addr);
@@ -298,9 +510,49 @@ public:
     void memSetByte(u32 addr, u32 val);
     void memSetHalfWord(u32 addr, u32 val);
     void memSetWord(u32 addr, u32 val);
+    void pageWritten(u32 phys);
+    void pageSetFlags(u32 phys, u8 flags);
+    void codeFlush();
+    u32 fbDirty(u64 *bitmap);
+    u32 *amoWord(u32 addr);
+    u32 loadReserved(u32 addr);
+    bool storeConditional(u32 addr, u32 val);
+    void reservationSet(u32 addr, u32 val);
+    void reservationBreak(u32 addr);
     // UART Functions
     void uartUpdateIir();
-    void uartTick();
+    void uartTick(bool poll_input);
+    // Network Functions
+    void netPoll();
+    void netCsrWrite(u32 address, u32 value);
+
+    // CLINT Functions
+    void clintSync();
+    void timerSchedule();
+    void timerReload();
+
+    // WFI idle
+    bool idle(u32 max_usec);
+    bool wakeInit();
+    void wake();
+
+    // Event Scheduler
+    void schedReset();
+    void schedule(u32 id, u32 delay);
+    void scheduleNow(u32 id);
+    void schedTake();
+    void unschedule(u32 id);
+    void schedFix(u32 i);
+    void schedRun();
+    bool schedDue() { return (s32)(clock - sched_next) >= 0; }
+    // `budget` clamped so a run of instructions stops at the next deadline
+    u32 schedBudget(u32 budget)
+    {
+        s32 left = (s32)(sched_next - clock);
+        if (left <= 0)
+            return 1;
+        return (u32)left < budget ? (u32)left : budget;
+    }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,103 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include "types.h"
+#include <atomic>
+#include <mutex>
+#ifndef __EMSCRIPTEN__
+#include <thread>
+#endif
+
+// Multi-hart machines. Hart 0 is the Emulator the front-end drives; it owns
+// guest RAM and the devices. Every other hart is an Emulator of its own with
+// its own registers, CSRs, CLINT msip/mtimecmp, TLBs and decode cache, sharing
+// hart 0's RAM and devices, and runs on its own host thread while hart 0's
+// Emulator is running. Device accesses and device events are serialized by
+// Smp::lock. Only hart 0 touches its event scheduler and clock: events that
+// other harts' device accesses raise are posted to it (RV32::scheduleNow), the
+// way writes to another hart's mtimecmp are (timer_dirty). RAM is accessed
+// without locks, AMOs use host atomics. LR, SC and AMOs on RAM words also hold
+// one of Smp::amo_lock, picked by word address, so a reservation check and the
+// store after it are one step for other harts (see RV32::storeConditional).
+//
+// The web build has no threads and always runs a single hart.
+
+const u32 SMP_HARTS_MAX = 8;
+// Locks LR/SC and AMOs are spread over (power of two)
+const u32 SMP_AMO_LOCKS = 64;
+
+class RV32;
+class Emulator;
+
+class Smp
+{
+public:
+    u32 count;                 // Harts in the machine
+    RV32 *cpu[SMP_HARTS_MAX];  // CPU of each hart; cpu[0] owns the devices
+    std::mutex lock;           // Held for every device access from any hart
+    std::mutex amo_lock[SMP_AMO_LOCKS]; // Held for LR/SC/AMOs, by word address
+
+    Smp(Emulator &boot);
+    ~Smp();
+
+    // Bring up harts 1..count-1 (at most SMP_HARTS_MAX) from hart 0's boot
+    // state and start their threads. Hart 0 must be fully initialized.
+    void start(u32 count);
+    // Stop and join the other harts' threads (they keep their state)
+    void stop();
+
+private:
+    Emulator &boot;
+    Emulator *hart[SMP_HARTS_MAX]; // Secondary harts (hart[0] unused)
+#ifndef __EMSCRIPTEN__
+    std::thread thread[SMP_HARTS_MAX];
+#endif
+    std::atomic<bool> quit;
+    bool started;
+
+    void hartLoop(Emulator *emu);
+};
+
+// Holds Smp::lock for its scope on a multi-hart machine (no-op for nullptr)
+class SmpGuard
+{
+public:
+    SmpGuard(Smp *smp) : smp(smp)
+    {
+        if (smp != nullptr)
+            smp->lock.lock();
+    }
+    ~SmpGuard()
+    {
+        if (smp != nullptr)
+            smp->lock.unlock();
+    }
+
+private:
+    Smp *smp;
+};
+
+// Holds the Smp::amo_lock for RAM word `addr` for its scope on a multi-hart
+// machine (no-op for nullptr)
+class AmoGuard
+{
+public:
+    AmoGuard(Smp *smp, u32 addr) : lock(nullptr)
+    {
+        if (smp != nullptr)
+        {
+            lock = &smp->amo_lock[(addr >> 2) & (SMP_AMO_LOCKS - 1)];
+            lock->lock();
+        }
+    }
+    ~AmoGuard()
+    {
+        if (lock != nullptr)
+            lock->unlock();
+    }
+
+private:
+    std::mutex *lock;
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "types.h"
+#include "rv32.h"
+
+// Machine snapshot file (little-endian host layout, same build only):
+//
+//   snapshot_header
+//   snapshot_state
+//   u32 page index[page_count]   guest RAM page numbers, ascending
+//   (padding to a page boundary)
+//   page data[page_count]        4 KiB each, at data_offset + i * 4096
+//
+// Only non-zero RAM pages are stored; every page missing from the index is
+// zero. Page data is page aligned so the file can be mapped straight into
+// guest RAM.
+
+#define SNAPSHOT_MAGIC   "RVESNAP"
+const u32 SNAPSHOT_VERSION  = 2;
+const u32 SNAPSHOT_PATH_MAX = 256;
+
+// Structure representing the fixed-size file header.
+typedef struct {
+    char magic[8];                     // SNAPSHOT_MAGIC, NUL padded
+    u32 version;                       // SNAPSHOT_VERSION
+    u32 header_size;                   // sizeof(snapshot_header)
+    u32 state_size;                    // sizeof(snapshot_state)
+    u32 mem_size;                      // Guest RAM bytes
+    u32 page_count;                    // Pages stored in the file
+    u32 index_offset;                  // File offset of the page index
+    u64 data_offset;                   // File offset of the first page (page aligned)
+    char image_path[SNAPSHOT_PATH_MAX]; // Boot image, used by a SYSCON reboot
+} snapshot_header;
+
+// Structure representing the saved machine state besides RAM.
+typedef struct {
+    u32 clock;
+    u32 pc;
+    u32 xreg[32];
+    u64 freg[32];
+    csr_state csr;
+    clint_state clint;
+    u64 mtime;            // CLINT mtime when saved; guest time resumes from here
+    uart_state uart;
+    mmu_state mmu;
+    u32 net_rx_ready;
+    u8 net_tx[4096];
+    u8 net_rx[4096];
+    u32 rtc0, rtc1;
+    u32 syscon_cmd;
+    u32 reservation_en;
+    u32 reservation_addr;
+    u32 reservation_val;
+    u32 wfi;
+    u32 kbd_head, kbd_tail;
+    u8 kbd_keycode[64];
+    u8 kbd_release[64];
+} snapshot_state;
+
+class Emulator;
+
+// Write the machine state and non-zero RAM of `emu` to `path` (replaced
+// atomically). Call between instructions, i.e. outside emulate*/Jit::run.
+bool snapshotSave(Emulator &emu, const char *path);
+// Guest RAM size recorded in a snapshot (0 if it cannot be read)
+u32 snapshotMemSize(const char *path);
+// Load a snapshot into an initialized emulator, which resumes from it
+bool snapshotLoad(Emulator &emu, const char *path);
+
+#endif
@@ -15,6 +15,15 @@ using s32 = int32_t;
 using s16 = int16_t;
 using s8  = int8_t;
 
+// Execution statistics (rv32_stats, MmioBus device counters) are only compiled
+// in with -DRV32_STATS (make STATS=1); otherwise STATS_INC() expands to
+// nothing and its argument is never evaluated
+#ifdef RV32_STATS
+#define STATS_INC(counter) ((counter)++)
+#else
+#define STATS_INC(counter) ((void)0)
+#endif
+
 // Clocking options
 enum CLK_SPEED
 {
@@ -36,12 +45,9 @@ typedef struct {
 } Trap;
 
 // Structure representing the result of an instruction execution.
+// Register and CSR results are committed by the handler itself.
 typedef struct {
-    u32 write_reg; // Register identifier where the result is written.
-    u32 write_val; // Value to write into the specified register.
     u32 pc_val;    // Program counter value after instruction execution.
-    u32 csr_write; // CSR (Control and Status Register) index to write into.
-    u32 csr_val;   // Value to write into the specified CSR.
     Trap trap;      // Contains any trap that occurred during execution.
 } ins_ret;
 
@@ -62,6 +68,7 @@ typedef struct {
 // Structure representing the CLINT (Core Local Interrupter) state.
 typedef struct {
     bool msip;          // Machine software interrupt pending flag.
+    bool mtip;          // Machine timer interrupt pending flag (mtime reached mtimecmp).
     u32 mtimecmp_lo;   // Lower 32 bits of machine timer compare value.
     u32 mtimecmp_hi;   // Upper 32 bits of machine timer compare value.
     u32 mtime_lo;      // Lower 32 bits of machine timer current count.
@@ -74,6 +81,26 @@ typedef struct {
     u32 ppn;   // Root page-table physical page number
 } mmu_state;
 
+// Structure representing one software TLB entry (Sv32 translation cache).
+typedef struct {
+    u32 vpn;   // Virtual page number tag (TLB_INVALID when empty)
+    u32 ppn;   // Physical page number
+    u32 perm;  // Permitted accesses, one bit per MMU_ACCESS_* type
+} tlb_entry;
+
+// Structure representing one host TLB entry (guest virtual page -> host RAM).
+typedef struct {
+    u32 tag_read;      // Virtual page address valid for loads (TLB_INVALID when empty)
+    u32 tag_write;     // Virtual page address valid for stores (TLB_INVALID when empty)
+    uintptr_t addend;  // Host address of the page minus its virtual page address
+} host_tlb_entry;
+
+// Structure representing one pending device event (see RV32::schedule).
+typedef struct {
+    u32 deadline;  // cpu.clock value the event is due at
+    u32 id;        // SCHED_* event source
+} sched_event;
+
 // Structure representing the network device state.
 typedef struct {
     u32 rx_ready;   // Set by guest to signal it is ready to receive
@@ -14,7 +14,7 @@ static void HelpMarker(const char *desc)
 
 static void showHelp()
 {
-    printf("./rve [parameters]\n\t-e [elf binary]\n\t-m [ram amount]\n\t-f [running image]\n\t-k [kernel command line]\n\t-b [dtb file, or 'disable']\n\t-c instruction count\n\t-s single step with full processor state\n\t-t time division base\n\t-l lock time base to instruction count\n\t-p disable sleep when wfi\n\t-d fail out immediately on all faults\n");
+    printf("./rve [parameters]\n\t-e [elf binary]\n\t-m [ram in MiB]\n\t-f [running image]\n\t-k [kernel command line]\n\t-b [dtb file, or 'disable']\n\t-c instruction count\n\t-s single step with full processor state\n\t-t time division base\n\t-l lock time base to instruction count\n\t-p disable sleep when wfi\n\t-d fail out immediately on all faults\n");
 }
 
 App::App(/* args */)
@@ -148,6 +148,9 @@ int App::initializeEmu(int argc, char *argv[])
     // Start emulator
     emu = Emulator();
     emu.initialize();
+#ifdef __EMSCRIPTEN__
+    emu.wfi_sleep_max = WFI_SLEEP_USEC;
+#endif
 
     int i;
     int show_help = 0;
@@ -177,6 +180,10 @@ int App::initializeEmu(int argc, char *argv[])
                 case 'e':
                     elf_file_name = (++i < argc) ? argv[i] : 0;
                     break;
+                case 'm':
+                    if (++i < argc)
+                        emu.mem_size = (u32)strtoul(argv[i], nullptr, 0) << 20;
+                    break;
                 case 's':
                     param_continue = 1;
                     emu.debugMode = true;
@@ -237,6 +244,10 @@ int App::initializeEmu(int argc, char *argv[])
     }
 #endif
 
+    elf_file_path = emu.elf_file_path;
+    bin_file_path = emu.bin_file_path;
+    debug_mode = emu.debugMode;
+    clk_freq_sel = emu.clk_freq_sel;
     return 0;
 }
 
@@ -434,7 +445,7 @@ void App::handleEvents()
             {
                 u8 lk = sdl_to_linux_key[sc];
                 if (lk)
-                    emu.cpu.kbdPush(lk, window_event.type == SDL_KEYUP);
+                    emu_thread.push(EMU_CMD_KEY, lk, window_event.type == SDL_KEYUP);
             }
         }
     }
@@ -480,6 +491,8 @@ void App::drawUI()
 
 void App::renderLoop()
 {
+    // From here on the emulator belongs to the emulation thread
+    emu_thread.start();
 #ifdef __EMSCRIPTEN__
     ImGuiIO &io = ImGui::GetIO();
     (void)io;
@@ -490,8 +503,11 @@ void App::renderLoop()
     while (running)
 #endif
     {
+#ifdef __EMSCRIPTEN__
         stepEmu();
+#endif
         handleEvents();
+        emu_thread.view(&view);
         beginRender();
         drawUI();
         endRender();
@@ -499,6 +515,8 @@ void App::renderLoop()
 #ifdef __EMSCRIPTEN__
     while (0); };
     emscripten_set_main_loop(MainLoopForEmscripten, 0, true);
+#else
+    emu_thread.stop();
 #endif
 }
 
@@ -567,12 +585,35 @@ void App::createTerminal()
 
     ImGui::Begin("Framebuffer");
 
-    // Upload emulated framebuffer (physical 0x84000000 = host mem + 64MB) to GPU
-    glBindTexture(GL_TEXTURE_2D, fb_texture_id);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, FB_W, FB_H,
-                    GL_RGBA, GL_UNSIGNED_BYTE,
-                    emu.memory + 0x04000000u);
-    glBindTexture(GL_TEXTURE_2D, 0);
+    // Upload emulated framebuffer (physical FB_RAM_BASE) to GPU, if RAM reaches
+    // it: only the rows under pages the guest stored to since the last frame
+    u32 fb_offset = FB_RAM_BASE - 0x80000000u;
+    u64 dirty[EMU_FB_WORDS];
+    if (view.memory != nullptr && (u64)fb_offset + FB_BYTES <= view.ram_size &&
+        emu_thread.fbTake(dirty))
+    {
+        const u32 row_bytes = FB_W * 4;
+        glBindTexture(GL_TEXTURE_2D, fb_texture_id);
+        for (u32 i = 0; i < FB_PAGES;)
+        {
+            if ((dirty[i / 64] >> (i % 64) & 1) == 0)
+            {
+                i++;
+                continue;
+            }
+            // Run of dirty pages i..j-1 and the rows it touches
+            u32 j = i + 1;
+            while (j < FB_PAGES && (dirty[j / 64] >> (j % 64) & 1) != 0)
+                j++;
+            u32 y0 = i * RV32_PAGE_SIZE / row_bytes;
+            u32 y1 = std::min<u32>(FB_H, (j * RV32_PAGE_SIZE + row_bytes - 1) / row_bytes);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y0, FB_W, y1 - y0,
+                            GL_RGBA, GL_UNSIGNED_BYTE,
+                            view.memory + fb_offset + y0 * row_bytes);
+            i = j;
+        }
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
 
     ImGui::Image((ImTextureID)(intptr_t)fb_texture_id, ImVec2(FB_W, FB_H));
 
@@ -595,13 +636,13 @@ void App::createCpuState()
     elfFileDialog.Display();
     if (elfFileDialog.HasSelected())
     {
-        emu.elf_file_path = elfFileDialog.GetSelected().string();
+        elf_file_path = elfFileDialog.GetSelected().string();
         elfFileDialog.ClearSelected();
     }
     linuxFileDialog.Display();
     if (linuxFileDialog.HasSelected())
     {
-        emu.bin_file_path = linuxFileDialog.GetSelected().string();
+        bin_file_path = linuxFileDialog.GetSelected().string();
         linuxFileDialog.ClearSelected();
     }
 
@@ -611,7 +652,8 @@ void App::createCpuState()
         if (ImGui::BeginMenu("Settings"))
         {
             // Menu Items
-            ImGui::MenuItem("Debug-Mode", NULL, &emu.debugMode);
+            if (ImGui::MenuItem("Debug-Mode", NULL, &debug_mode))
+                emu_thread.push(EMU_CMD_DEBUG, 0, debug_mode);
 
             ImGui::EndMenu();
         }
@@ -621,7 +663,8 @@ void App::createCpuState()
         }
         if (ImGui::BeginMenu("Clock"))
         {
-            ImGui::InputInt("Clock Freq.", &emu.clk_freq_sel, 1);
+            if (ImGui::InputInt("Clock Freq.", &clk_freq_sel, 1))
+                emu_thread.push(EMU_CMD_CLOCK, clk_freq_sel);
             ImGui::EndMenu();
         }
         ImGui::EndMenuBar();
@@ -639,10 +682,10 @@ void App::createCpuState()
             ImGui::SameLine();
             if (ImGui::Button("2.Load ELF"))
             {
-                emu.initializeElf(emu.elf_file_path.c_str());
+                emu_thread.push(EMU_CMD_LOAD_ELF, 0, false, elf_file_path.c_str());
             }
             ImGui::SameLine();
-            ImGui::Text("%s", emu.elf_file_path.c_str());
+            ImGui::Text("%s", elf_file_path.c_str());
         }
         { // Linux Loading
             if (ImGui::Button("1.Select IMG"))
@@ -653,46 +696,27 @@ void App::createCpuState()
             ImGui::SameLine();
             if (ImGui::Button("2.Load IMG"))
             {
-                emu.initializeBin(emu.bin_file_path.c_str());
+                emu_thread.push(EMU_CMD_LOAD_BIN, 0, false, bin_file_path.c_str());
             }
             ImGui::SameLine();
-            ImGui::Text("%s", emu.bin_file_path.c_str());
+            ImGui::Text("%s", bin_file_path.c_str());
         }
     }
     // Start/Stop/Step/Reset
     ImGui::SeparatorText("Commands");
     if (ImGui::Button("Start/Stop"))
     {
-        if (emu.ready_to_run)
-        {
-            emu.running = !emu.running;
-        }
-        else
-        {
-            printf("Not ready to execute. Memory maybe corrupted\n");
-        }
+        emu_thread.push(EMU_CMD_TOGGLE);
     }
     ImGui::SameLine();
     if (ImGui::Button("Step"))
     {
-        if (!emu.running && emu.ready_to_run)
-        {
-            emu.emulate();
-        }
-        else {
-            if (!emu.ready_to_run) {
-                printf("Not ready to execute. Memory maybe corrupted\n");
-            } else {
-                printf("Cannot step while running. Please stop the emulator first.\n");
-            }
-        }
+        emu_thread.push(EMU_CMD_STEP);
     }
     ImGui::SameLine();
     if (ImGui::Button("Reset"))
     {
-        emu.running = false;
-        emu.ready_to_run = false;
-        emu.initialize();
+        emu_thread.push(EMU_CMD_RESET);
     }
 
     // Registers & Control Signals
@@ -703,7 +727,7 @@ void App::createCpuState()
         {
             ImGui::TableNextColumn();
 
-            ImGui::Text("%s: 0x%04X", rv_regs[i], emu.cpu.xreg[i]);
+            ImGui::Text("%s: 0x%04X", rv_regs[i], view.xreg[i]);
         }
         ImGui::EndTable();
         HelpMarker("CPU Registers x0-31");
@@ -713,24 +737,25 @@ void App::createCpuState()
     {
         {
             ImGui::TableNextColumn();
-            ImGui::Text("PC: 0x%04X", emu.cpu.pc);
+            ImGui::Text("PC: 0x%04X", view.pc);
             ImGui::TableNextColumn();
-            ImGui::Text("Clock: 0x%04X", emu.cpu.clock);
+            ImGui::Text("Clock: 0x%04X", view.clock);
             ImGui::TableNextColumn();
-            ImGui::Text("DebugMode: %s", emu.debugMode ? "Enabled" : "Disabled");
+            ImGui::Text("DebugMode: %s", view.debug_mode ? "Enabled" : "Disabled");
             ImGui::TableNextColumn();
-            ImGui::Text("Rsrv en: 0x%04X", emu.cpu.reservation_en);
+            ImGui::Text("Rsrv en: 0x%04X", view.reservation_en);
             ImGui::TableNextColumn();
-            ImGui::Text("Rsrv addr: 0x%04X", emu.cpu.reservation_addr);
+            ImGui::Text("Rsrv addr: 0x%04X", view.reservation_addr);
             ImGui::TableNextColumn();
-            ImGui::Text("Running: %s", emu.running ? "Running" : "Halted");
+            ImGui::Text("Running: %s", view.running ? "Running" : "Halted");
         }
         ImGui::EndTable();
     }
 
     // RAM
     ImGui::SeparatorText("RAM");
-    mem_editor.DrawContents(emu.memory, emu.MEM_SIZE, 0x80000000);
+    if (view.memory != nullptr)
+        mem_editor.DrawContents(view.memory, view.ram_size, 0x80000000);
 
     ImGui::End();
 }
@@ -756,7 +781,7 @@ void App::createDisasm()
     ImGui::BeginTabBar("Tool Tabs");
     if (ImGui::BeginTabItem("Disassembler"))
     {
-        if (prev_pc != emu.cpu.pc)
+        if (prev_pc != view.pc)
         {
             // Remove the oldest element by shifting elements down
             for (size_t i = 0; i < buffer_size - 1; ++i)
@@ -766,8 +791,8 @@ void App::createDisasm()
             }
 
             // Append the new data at the end
-            disasm_inst(buf[buffer_size - 1], sizeof(buf[buffer_size - 1]), rv32, emu.cpu.pc, emu.cpu.memGetWord(emu.cpu.pc));
-            prev_pc = emu.cpu.pc;
+            disasm_inst(buf[buffer_size - 1], sizeof(buf[buffer_size - 1]), rv32, view.pc, view.ins);
+            prev_pc = view.pc;
             pc[buffer_size - 1] = prev_pc;
         }
 
@@ -789,42 +814,8 @@ void App::createDisasm()
     ImGui::End();
 }
 
+// Web build: no emulation thread, so each frame runs a slice of the guest
 void App::stepEmu()
 {
-    if (emu.running)
-    {
-        ImGuiIO &io = ImGui::GetIO();
-        (void)io;
-
-        if (emu.clk_freq_sel != -1)
-        {
-            emu.time_sum += 1.0 / io.Framerate;
-            if (emu.time_sum >= emu.sec_per_cycle)
-            {
-                emu.time_sum = 0;
-                emu.emulate();
-                emu.sec_per_cycle = 1.0 / std::max(1, emu.clk_freq_sel);
-            }
-        }
-        else
-        {
-            // Run as many instructions as possible within a ~10ms budget per frame,
-            // the GUI alive.  Time is sampled every 1024 instructions to avoid the
-            // overhead of a syscall on every step.
-            struct timeval t0, t1;
-            gettimeofday(&t0, NULL);
-            int count = 0;
-            while (emu.running)
-            {
-                emu.emulate();
-                if ((++count & 0x3FF) == 0)
-                {
-                    gettimeofday(&t1, NULL);
-                    long us = (long)(t1.tv_sec  - t0.tv_sec)  * 1000000L
-                            + (long)(t1.tv_usec - t0.tv_usec);
-                    if (us >= 10000L) break;
-                }
-            }
-        }
-    }
-}
\ No newline at end of file
+    emu_thread.service(FRAME_EMU_USEC);
+}
@@ -0,0 +1,300 @@
+#include "batch.h"
+#include "emu.h"
+#include "jit.h"
+#include "snapshot.h"
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+#include <cinttypes>
+#include <thread>
+
+Batch::Batch()
+{
+    remaining = 0;
+    idle_workers = 0;
+}
+
+Batch::~Batch()
+{
+    for (batch_instance &in : inst)
+    {
+#ifdef RVE_JIT
+        delete in.jit;
+#endif
+        delete in.emu;
+        if (in.log_fd != -1)
+            close(in.log_fd);
+    }
+    for (worker_queue *q : queues)
+        delete q;
+}
+
+void Batch::add(const char *path)
+{
+    batch_instance in;
+    in.path = path;
+    in.emu = nullptr;
+    in.jit = nullptr;
+    in.log_fd = -1;
+    in.is_elf = false;
+    in.retired = 0;
+    in.seconds = 0;
+    in.stop = nullptr;
+    inst.push_back(in);
+}
+
+int Batch::run()
+{
+    if (inst.empty())
+        return 0;
+    u32 n = threads != 0 ? threads : std::thread::hardware_concurrency();
+    if (n == 0)
+        n = 1;
+    if (n > inst.size())
+        n = (u32)inst.size();
+    if (quantum == 0)
+        quantum = BATCH_QUANTUM_INS;
+
+    // <out_dir>/<index>-<file name>.log keeps same-named images apart
+    for (u32 i = 0; i < inst.size(); i++)
+    {
+        const char *name = strrchr(inst[i].path.c_str(), '/');
+        name = name ? name + 1 : inst[i].path.c_str();
+        char prefix[16];
+        snprintf(prefix, sizeof(prefix), "%03u-", i);
+        inst[i].log_path = out_dir + "/" + prefix + name + ".log";
+    }
+
+    // Deal the instances out round-robin; stealing evens out the rest
+    for (u32 i = 0; i < n; i++)
+        queues.push_back(new worker_queue);
+    for (u32 i = 0; i < inst.size(); i++)
+        queues[i % n]->queue.push_back(i);
+    remaining = (u32)inst.size();
+    fprintf(stderr, "INFO: batch: %u instances on %u threads\n", (u32)inst.size(), n);
+
+    double t0 = wallSeconds();
+    std::vector<std::thread> pool;
+    for (u32 i = 0; i < n; i++)
+        pool.push_back(std::thread(&Batch::workerLoop, this, i));
+    for (std::thread &t : pool)
+        t.join();
+    double secs = wallSeconds() - t0;
+
+    int status = 0;
+    u64 total = 0;
+    for (batch_instance &in : inst)
+    {
+        bool ok = strcmp(in.stop, "fault") != 0 && strcmp(in.stop, "error") != 0 &&
+                  (strcmp(in.stop, "exit") != 0 || in.emu->exit_status == 0);
+        if (!ok)
+            status = 1;
+        total += in.retired;
+        if (strcmp(in.stop, "exit") == 0)
+            fprintf(stderr, "INFO: batch: %s: exit (status %u), %" PRIu64 " instructions, %.2f s -> %s\n",
+                    in.path.c_str(), in.emu->exit_status, in.retired, in.seconds, in.log_path.c_str());
+        else
+            fprintf(stderr, "INFO: batch: %s: %s, %" PRIu64 " instructions, %.2f s -> %s\n",
+                    in.path.c_str(), in.stop, in.retired, in.seconds, in.log_path.c_str());
+    }
+    fprintf(stderr, "INFO: batch: %" PRIu64 " instructions in %.2f s (%.2f MIPS)\n",
+            total, secs, secs > 0 ? total / secs / 1e6 : 0);
+    return status;
+}
+
+///////////////////////////////////////
+// Scheduling
+///////////////////////////////////////
+void Batch::workerLoop(u32 id)
+{
+    u32 index;
+    while (remaining.load(std::memory_order_acquire) != 0)
+    {
+        if (!take(id, &index))
+        {
+            // Everything left is running on other workers; wait for a queue
+            // to fill up or the last instance to finish
+            std::unique_lock<std::mutex> guard(idle_lock);
+            idle_workers++;
+            idle_cond.wait_for(guard, std::chrono::milliseconds(10));
+            idle_workers--;
+            continue;
+        }
+
+        batch_instance &in = inst[index];
+        if (in.emu == nullptr && !start(in))
+            continue;
+        if (slice(in))
+            push(id, index);
+    }
+    idle_cond.notify_all();
+}
+
+// Next instance for worker `id`: the front of its own queue, else the back of
+// the first other queue with work in it
+bool Batch::take(u32 id, u32 *index)
+{
+    u32 n = (u32)queues.size();
+    {
+        worker_queue *q = queues[id];
+        std::lock_guard<std::mutex> guard(q->lock);
+        if (!q->queue.empty())
+        {
+            *index = q->queue.front();
+            q->queue.pop_front();
+            return true;
+        }
+    }
+    for (u32 i = 1; i < n; i++)
+    {
+        worker_queue *q = queues[(id + i) % n];
+        std::lock_guard<std::mutex> guard(q->lock);
+        if (!q->queue.empty())
+        {
+            *index = q->queue.back();
+            q->queue.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void Batch::push(u32 id, u32 index)
+{
+    worker_queue *q = queues[id];
+    bool shareable;
+    {
+        std::lock_guard<std::mutex> guard(q->lock);
+        q->queue.push_back(index);
+        shareable = q->queue.size() > 1;
+    }
+    if (shareable && idle_workers.load(std::memory_order_relaxed) != 0)
+        idle_cond.notify_one();
+}
+
+///////////////////////////////////////
+// Instances
+///////////////////////////////////////
+// Create and boot an instance on first use, so images load in parallel
+bool Batch::start(batch_instance &in)
+{
+    in.log_fd = open(in.log_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (in.log_fd < 0)
+    {
+        perror(in.log_path.c_str());
+        in.emu = new Emulator();
+        finish(in, "error");
+        return false;
+    }
+
+    char magic[8] = {0};
+    int fd = open(in.path.c_str(), O_RDONLY);
+    if (fd >= 0)
+    {
+        if (read(fd, magic, sizeof(magic)) < 0)
+            magic[0] = 0;
+        close(fd);
+    }
+    in.is_elf = memcmp(magic, "\x7f" "ELF", 4) == 0;
+
+    Emulator *emu = new Emulator();
+    in.emu = emu;
+    emu->console_in = -1;
+    emu->console_out = in.log_fd;
+    emu->console_thread = false;
+    emu->exit_on_fault = false;
+    emu->wfi_sleep_max = BATCH_WFI_SLEEP_USEC;
+    if (mem_size != 0)
+        emu->mem_size = mem_size;
+
+    if (memcmp(magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0)
+        emu->initializeSnapshot(in.path.c_str());
+    else if (in.is_elf)
+        emu->initializeElf(in.path.c_str());
+    else
+        emu->initializeBin(in.path.c_str());
+    if (!emu->ready_to_run)
+    {
+        fprintf(stderr, "ERRO: batch: failed to load %s\n", in.path.c_str());
+        finish(in, "error");
+        return false;
+    }
+    // Linux guest processes make the same exit call
+    emu->stop_on_exit = in.is_elf;
+    emu->running = true;
+
+#ifdef RVE_JIT
+    if (use_jit)
+    {
+        in.jit = new Jit(*emu);
+        if (!in.jit->init())
+        {
+            delete in.jit;
+            in.jit = nullptr;
+        }
+    }
+#endif
+    return true;
+}
+
+// Run one time slice; returns false once the instance has ended. A guest
+// that went idle gives up the rest of its slice.
+bool Batch::slice(batch_instance &in)
+{
+    Emulator &emu = *in.emu;
+    double t0 = wallSeconds();
+    u64 start = emu.retiredCount();
+    emu.idled = false;
+    while (emu.running && in.retired - start < quantum && !emu.idled)
+    {
+        u64 budget = BLOCK_MAX_INS;
+        if (limit != 0 && limit - in.retired < budget)
+            budget = limit - in.retired;
+        if (budget == 0)
+            break;
+#ifdef RVE_JIT
+        if (in.jit != nullptr)
+            in.jit->run((u32)budget);
+        else
+#endif
+            emu.emulateBlock((u32)budget);
+        in.retired = emu.retiredCount();
+    }
+    emu.cpu.console->drain();
+    in.seconds += wallSeconds() - t0;
+
+    if (emu.faulted)
+        finish(in, "fault");
+    else if (emu.stop_on_exit && emu.exited)
+        finish(in, "exit");
+    else if (!emu.running)
+        finish(in, "poweroff");
+    else if (limit != 0 && in.retired >= limit)
+        finish(in, "limit");
+    return in.stop == nullptr;
+}
+
+// Release an instance's machine once it has ended, keeping its results
+void Batch::finish(batch_instance &in, const char *stop)
+{
+    in.stop = stop;
+    Emulator *emu = in.emu;
+    emu->running = false;
+    if (emu->cpu.console != nullptr)
+        emu->cpu.console->close();
+#ifdef RVE_JIT
+    delete in.jit;
+    in.jit = nullptr;
+#endif
+    // Keep the Emulator for its exit status, but hand back its RAM
+    emu->ramFree();
+    if (in.log_fd != -1)
+    {
+        close(in.log_fd);
+        in.log_fd = -1;
+    }
+    if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        idle_cond.notify_all();
+}
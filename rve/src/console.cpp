@@ -0,0 +1,299 @@
+#include "console.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#ifndef __EMSCRIPTEN__
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#endif
+
+///////////////////////////////////////
+// Ring Functions
+///////////////////////////////////////
+u32 ConsoleRing::pushSome(const u8 *src, u32 len)
+{
+    u32 h = head.load(std::memory_order_relaxed);
+    u32 space = CONSOLE_RING_SIZE - (h - tail.load(std::memory_order_acquire));
+    if (len > space)
+        len = space;
+    for (u32 i = 0; i < len; i++)
+        buf[(h + i) & (CONSOLE_RING_SIZE - 1)] = src[i];
+    head.store(h + len, std::memory_order_release);
+    return len;
+}
+
+u32 ConsoleRing::peek(const u8 **data) const
+{
+    u32 t = tail.load(std::memory_order_relaxed);
+    u32 len = head.load(std::memory_order_acquire) - t;
+    u32 to_wrap = CONSOLE_RING_SIZE - (t & (CONSOLE_RING_SIZE - 1));
+    *data = &buf[t & (CONSOLE_RING_SIZE - 1)];
+    return len < to_wrap ? len : to_wrap;
+}
+
+///////////////////////////////////////
+// Console Functions
+///////////////////////////////////////
+Console::Console()
+{
+    in_fd = STDIN_FILENO;
+    out_fd = STDOUT_FILENO;
+    wake_fd = -1;
+    threaded = false;
+    logged = false;
+#ifndef __EMSCRIPTEN__
+    notify_fd[0] = -1;
+    notify_fd[1] = -1;
+    tx_notified = false;
+    stopping = false;
+#endif
+}
+
+Console::~Console()
+{
+    close();
+}
+
+bool Console::open(int in, int out, int wake)
+{
+#ifndef __EMSCRIPTEN__
+    if (threaded || logged)
+        return true;
+    if (pipe(notify_fd) != 0)
+    {
+        perror("console: pipe");
+        return false;
+    }
+    fcntl(notify_fd[0], F_SETFL, fcntl(notify_fd[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(notify_fd[1], F_SETFL, fcntl(notify_fd[1], F_GETFL, 0) | O_NONBLOCK);
+
+    fflush(stdout);
+    in_fd = in;
+    out_fd = out;
+    wake_fd = wake;
+    tx_notified = false;
+    stopping = false;
+    io_thread = std::thread(&Console::ioLoop, this);
+    threaded = true;
+    return true;
+#else
+    (void)in;
+    (void)out;
+    (void)wake;
+    return false;
+#endif
+}
+
+bool Console::openLog(int out)
+{
+#ifndef __EMSCRIPTEN__
+    if (threaded || logged)
+        return true;
+    fflush(stdout);
+    in_fd = -1;
+    out_fd = out;
+    logged = true;
+    return true;
+#else
+    (void)out;
+    return false;
+#endif
+}
+
+void Console::close()
+{
+#ifndef __EMSCRIPTEN__
+    if (logged)
+    {
+        writeOut();
+        logged = false;
+        return;
+    }
+    if (!threaded)
+        return;
+    stopping = true;
+    notify();
+    io_thread.join();
+    ::close(notify_fd[0]);
+    ::close(notify_fd[1]);
+    notify_fd[0] = -1;
+    notify_fd[1] = -1;
+    threaded = false;
+#endif
+}
+
+void Console::put(u8 c)
+{
+#ifndef __EMSCRIPTEN__
+    if (logged)
+    {
+        // A full ring is written out here rather than dropped
+        if (!tx.push(c))
+        {
+            writeOut();
+            tx.push(c);
+        }
+        return;
+    }
+#endif
+    if (!threaded)
+    {
+        printf("%c", (char)c);
+        fflush(stdout);
+        return;
+    }
+#ifndef __EMSCRIPTEN__
+    // Output is never dropped: a full ring waits for the I/O thread
+    while (!tx.push(c))
+    {
+        notify();
+        std::this_thread::yield();
+    }
+    if (!tx_notified.exchange(true))
+        notify();
+#endif
+}
+
+bool Console::get(u8 *c)
+{
+    if (threaded)
+        return rx.pop(c);
+    if (logged)
+        return false;
+#ifndef __EMSCRIPTEN__
+    int byteswaiting = 0;
+    ioctl(in_fd, FIONREAD, &byteswaiting);
+    if (byteswaiting > 0)
+    {
+        char ch;
+        if (read(in_fd, &ch, 1) == 1)
+        {
+            *c = (u8)ch;
+            return true;
+        }
+    }
+#endif
+    return false;
+}
+
+void Console::flush()
+{
+#ifndef __EMSCRIPTEN__
+    if (logged)
+        writeOut();
+    while (threaded && !tx.empty())
+    {
+        notify();
+        std::this_thread::yield();
+    }
+#endif
+}
+
+void Console::drain()
+{
+#ifndef __EMSCRIPTEN__
+    if (logged)
+        writeOut();
+#endif
+}
+
+#ifndef __EMSCRIPTEN__
+// Write one byte to a non-blocking wakeup pipe. A full pipe already has a
+// wakeup pending, so the error is ignored.
+static void signalFd(int fd)
+{
+    char b = 0;
+    if (write(fd, &b, 1) < 0)
+        return;
+}
+
+void Console::notify()
+{
+    signalFd(notify_fd[1]);
+}
+
+// Write out everything queued. The ring is released only once written, so an
+// empty ring means the output reached out_fd.
+void Console::writeOut()
+{
+    const u8 *data;
+    u32 len;
+    while ((len = tx.peek(&data)) != 0)
+    {
+        ssize_t n = write(out_fd, data, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+            {
+                struct pollfd p = {out_fd, POLLOUT, 0};
+                poll(&p, 1, -1);
+                continue;
+            }
+            // Output is gone (closed pipe); discard so producers never block
+            tx.consume(len);
+            continue;
+        }
+        tx.consume((u32)n);
+    }
+}
+
+void Console::ioLoop()
+{
+    bool in_open = in_fd >= 0;
+    while (true)
+    {
+        struct pollfd fds[2];
+        nfds_t nfds = 1;
+        fds[0].fd = notify_fd[0];
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        // Stop reading input while the ring is full; the guest drains it
+        bool watch_in = in_open && rx.used() < CONSOLE_RING_SIZE;
+        if (watch_in)
+        {
+            fds[1].fd = in_fd;
+            fds[1].events = POLLIN;
+            fds[1].revents = 0;
+            nfds = 2;
+        }
+        // Poll with a timeout while input is throttled so reading resumes
+        if (poll(fds, nfds, watch_in || !in_open ? -1 : 10) < 0 && errno != EINTR)
+            break;
+
+        if (fds[0].revents & POLLIN)
+        {
+            char buf[64];
+            while (read(notify_fd[0], buf, sizeof(buf)) > 0)
+                ;
+        }
+
+        // Output: clear the flag first so a put() racing with the drain
+        // notifies again
+        tx_notified = false;
+        writeOut();
+
+        // Input
+        if (watch_in && (fds[1].revents & (POLLIN | POLLHUP | POLLERR)))
+        {
+            u8 buf[4096];
+            u32 space = CONSOLE_RING_SIZE - rx.used();
+            ssize_t n = read(in_fd, buf, space < sizeof(buf) ? space : sizeof(buf));
+            if (n > 0)
+            {
+                rx.pushSome(buf, (u32)n);
+                if (wake_fd != -1)
+                    signalFd(wake_fd);
+            }
+            else if (n == 0 || (errno != EINTR && errno != EAGAIN))
+                in_open = false; // EOF or error: stop watching input
+        }
+
+        if (stopping)
+            break;
+    }
+    writeOut();
+}
+#endif
@@ -1,9 +1,14 @@
 #include "emu.h"
 #include "net.h"
+#include "snapshot.h"
 #include "default64mbdtc.h"
 #include <sys/time.h>
 #include <cfenv>
 #include <cmath>
+#include <algorithm>
+#include <cinttypes>
+#include <map>
+#include <vector>
 #ifdef __EMSCRIPTEN__
 // WebAssembly has no hardware FP exception reporting; define missing fenv constants as 0.
 #ifndef FE_INEXACT
@@ -23,32 +28,49 @@
 #endif
 #endif
 #ifndef __EMSCRIPTEN__
-#include <termios.h>
 #include <signal.h>
 #include <unistd.h>
 
-static struct termios orig_term;
-static bool term_captured = false;
+// The instance whose console holds the terminal in raw mode, restored at
+// exit() too (there is only one controlling terminal per process)
+static Emulator *term_owner = nullptr;
 
-static void resetKeyboardInput()
+static void terminalRestoreAtExit()
 {
-    if (term_captured)
-    {
-        tcsetattr(STDIN_FILENO, TCSANOW, &orig_term);
-        term_captured = false;
-    }
+    if (term_owner != nullptr)
+        term_owner->terminalRestore();
 }
 
-static void captureKeyboardInput()
+// Put the terminal behind console_in into raw mode so every keystroke
+// reaches the guest immediately
+void Emulator::terminalCapture()
 {
-    if (term_captured) return;
-    atexit(resetKeyboardInput);
+    if (term_captured || term_owner != nullptr || !isatty(console_in))
+        return;
+    static bool registered = false;
+    if (!registered)
+    {
+        atexit(terminalRestoreAtExit);
+        registered = true;
+    }
     struct termios term;
-    tcgetattr(STDIN_FILENO, &term);
-    orig_term = term;
+    if (tcgetattr(console_in, &term) != 0)
+        return;
+    term_saved = term;
     term.c_lflag &= ~(ICANON | ECHO);
-    tcsetattr(STDIN_FILENO, TCSANOW, &term);
+    tcsetattr(console_in, TCSANOW, &term);
     term_captured = true;
+    term_owner = this;
+}
+
+void Emulator::terminalRestore()
+{
+    if (!term_captured)
+        return;
+    tcsetattr(console_in, TCSANOW, &term_saved);
+    term_captured = false;
+    if (term_owner == this)
+        term_owner = nullptr;
 }
 #endif
 
@@ -130,15 +152,34 @@ static inline double freg_read_d(RV32 &cpu, u32 rs)
 }
 
 // Load 64-bit double from memory (two consecutive 32-bit words, little-endian).
-// addr must already be a translated physical address.
-static u64 mem_get_double(RV32 &cpu, u32 addr)
+// Only vaddr is translated; the second word is read from the next physical word.
+static u64 mem_get_double(RV32 &cpu, ins_ret *ret, u32 vaddr)
 {
+    u8 *host = cpu.hostRead(vaddr, 8);
+    if (host != nullptr)
+    {
+        u64 val;
+        memcpy(&val, host, 8);
+        return val;
+    }
+    u32 addr = cpu.mmuTranslate(ret, vaddr, MMU_ACCESS_READ);
+    if (ret->trap.en) return 0;
+    cpu.hostFill(vaddr, addr, MMU_ACCESS_READ);
     return (u64)cpu.memGetWord(addr) | ((u64)cpu.memGetWord(addr + 4) << 32);
 }
 
 // Store 64-bit double to memory as two 32-bit words (little-endian).
-static void mem_set_double(RV32 &cpu, u32 addr, u64 val)
+static void mem_set_double(RV32 &cpu, ins_ret *ret, u32 vaddr, u64 val)
 {
+    u8 *host = cpu.hostWrite(vaddr, 8);
+    if (host != nullptr)
+    {
+        memcpy(host, &val, 8);
+        return;
+    }
+    u32 addr = cpu.mmuTranslate(ret, vaddr, MMU_ACCESS_WRITE);
+    if (ret->trap.en) return;
+    cpu.hostFill(vaddr, addr, MMU_ACCESS_WRITE);
     cpu.memSetWord(addr,     (u32)(val & 0xFFFFFFFFu));
     cpu.memSetWord(addr + 4, (u32)(val >> 32));
 }
@@ -297,191 +338,326 @@ FormatEmpty parse_FormatEmpty(u32 word)
 const u32 ZERO = 0;
 const u32 ONE = 1;
 
-#define imp(name, fmt_t, code) \
-    void Emulator::emu_##name(u32 ins_word, ins_ret *ret, fmt_t ins) { code }
-
-#define run(name, data, insf)                     \
-    case data:                                    \
-    {                                             \
-        if (debugMode)                            \
-            ins_p(name)                           \
-                emu_##name(ins_word, &ret, insf); \
-        return ret;                               \
+// Defines the handler and the thunk the decoded-instruction cache dispatches to
+#define imp(name, fmt_t, code)                                                \
+    void Emulator::emu_##name(u32 ins_word, ins_ret *ret, fmt_t ins) { code } \
+    void Emulator::exec_##name(Emulator &emu, DecodedIns *d, ins_ret *ret)    \
+    {                                                                         \
+        u32 ins_word = d->ins_word;                                           \
+        if (emu.debugMode)                                                    \
+            ins_p(name)                                                       \
+        emu.emu_##name(ins_word, ret, d->fmt.as_##fmt_t);                     \
     }
 
+// Handlers commit architectural state in place: rd (x0 stays zero) and CSRs
+// are written as they go, so anything that can trap comes first. Only the
+// next PC and traps travel back in ins_ret.
 #define WR_RD(code)                         \
     {                                       \
-        ret->write_reg = ins.rd;            \
-        ret->write_val = AS_UNSIGNED(code); \
+        u32 rd_val = AS_UNSIGNED(code);     \
+        if (ins.rd != 0)                    \
+            cpu.xreg[ins.rd] = rd_val;      \
     }
 #define WR_PC(code)         \
     {                       \
         ret->pc_val = code; \
     }
-#define WR_CSR(code)              \
-    {                             \
-        ret->csr_write = ins.csr; \
-        ret->csr_val = code;      \
+#define WR_CSR(code)                          \
+    {                                         \
+        cpu.setCsr(ins.csr, code, ret);       \
+        if (ret->trap.en)                     \
+            return;                           \
+    }
+// Zicsr: read the CSR (checking access) into `value`; the other SYSTEM
+// instructions never read one
+#define RD_CSR()                                  \
+    u32 value = cpu.getCsr(ins.csr, ret);         \
+    if (ret->trap.en)                             \
+        return;
+
+// AMOs on RAM words are single host atomics, so they stay atomic against the
+// other harts, and break the other harts' reservations on the word under the
+// same AmoGuard as sc.w; `atomic` uses `word` (u32 *) and `sec` (rs2) and
+// returns the old value. Words outside RAM (MMIO) use a plain read-modify-write
+// computing `update` from `tmp` (the old value) and `sec`.
+#define AMO_W(atomic, update)                                                  \
+    {                                                                          \
+        u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1], MMU_ACCESS_WRITE); \
+        if (ret->trap.en)                                                      \
+            return;                                                            \
+        u32 sec = cpu.xreg[ins.rs2];                                           \
+        u32 tmp;                                                               \
+        u32 *word = cpu.amoWord(addr);                                         \
+        if (word != nullptr)                                                   \
+        {                                                                      \
+            AmoGuard guard(cpu.smp, addr);                                     \
+            tmp = atomic;                                                      \
+            cpu.reservationBreak(addr);                                        \
+        }                                                                      \
+        else                                                                   \
+        {                                                                      \
+            tmp = cpu.memGetWord(addr);                                        \
+            cpu.memSetWord(addr, update);                                      \
+        }                                                                      \
+        WR_RD(tmp)                                                             \
+    }
+
+enum
+{
+    AMO_MIN,
+    AMO_MAX,
+    AMO_MINU,
+    AMO_MAXU
+};
+
+// amomin/amomax[u] have no host instruction: compare-and-swap until the word
+// did not change under us. Returns the old value.
+static u32 amoMinMax(u32 *word, u32 sec, int op)
+{
+    u32 old = __atomic_load_n(word, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        bool take;
+        switch (op)
+        {
+        case AMO_MIN: take = (int32_t)sec < (int32_t)old; break;
+        case AMO_MAX: take = (int32_t)sec > (int32_t)old; break;
+        case AMO_MINU: take = sec < old; break;
+        default: take = sec > old; break;
+        }
+        if (!take)
+        {
+            // Still a write as far as ordering is concerned
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            return old;
+        }
+        if (__atomic_compare_exchange_n(word, &old, sec, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return old;
     }
+}
 
-imp(add, FormatR, { // rv32i
-    WR_RD(AS_SIGNED(cpu.xreg[ins.rs1]) + AS_SIGNED(cpu.xreg[ins.rs2]));
-}) imp(addi, FormatI, { // rv32i
-    WR_RD(AS_SIGNED(cpu.xreg[ins.rs1]) + AS_SIGNED(ins.imm));
-}) imp(amoswap_w, FormatR, { // rv32a
-    u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1], MMU_ACCESS_WRITE);
-    if (ret->trap.en) return;
-    u32 tmp = cpu.memGetWord(addr);
-    cpu.memSetWord(addr, cpu.xreg[ins.rs2]);
-    WR_RD(tmp)
+// Integer instructions emulateBlock() runs inline, writing rd itself (see the
+// dispatch loop there). Each list also generates the handlers that emulate()
+// and the JIT call, so both paths share one definition of the semantics.
+
+// R-type: a = rs1, b = rs2
+#define OPS_R(X)                                                          \
+    X(add, a + b)                                                         \
+    X(sub, a - b)                                                         \
+    X(sll, a << (b & 31))                                                 \
+    X(slt, (u32)((int32_t)a < (int32_t)b))                                \
+    X(sltu, (u32)(a < b))                                                 \
+    X(xor, a ^ b)                                                         \
+    X(srl, a >> (b & 31))                                                 \
+    X(sra, (u32)((int32_t)a >> (b & 31)))                                 \
+    X(or, a | b)                                                          \
+    X(and, a & b)                                                         \
+    X(mul, a * b)                                                         \
+    X(mulh, (u32)(((int64_t)(int32_t)a * (int64_t)(int32_t)b) >> 32))     \
+    X(mulhsu, (u32)(((int64_t)(int32_t)a * (int64_t)(uint64_t)b) >> 32))  \
+    X(mulhu, (u32)(((uint64_t)a * (uint64_t)b) >> 32))                    \
+    X(div, divSigned(a, b))                                               \
+    X(divu, b == 0 ? 0xFFFFFFFF : a / b)                                  \
+    X(rem, remSigned(a, b))                                               \
+    X(remu, b == 0 ? a : a % b)
+
+// Shift immediates, R-type with the shift amount in the rs2 field: a = rs1,
+// b = shamt
+#define OPS_SHIFT(X)                  \
+    X(slli, a << b)                   \
+    X(srli, a >> b)                   \
+    X(srai, (u32)((int32_t)a >> b))
+
+// I-type: a = rs1, b = imm
+#define OPS_I(X)                                \
+    X(addi, a + b)                              \
+    X(slti, (u32)((int32_t)a < (int32_t)b))     \
+    X(sltiu, (u32)(a < b))                      \
+    X(xori, a ^ b)                              \
+    X(ori, a | b)                               \
+    X(andi, a & b)
+
+// Branches, taken when the condition holds: a = rs1, b = rs2
+#define OPS_B(X)                          \
+    X(beq, a == b)                        \
+    X(bne, a != b)                        \
+    X(blt, (int32_t)a < (int32_t)b)       \
+    X(bge, (int32_t)a >= (int32_t)b)      \
+    X(bltu, a < b)                        \
+    X(bgeu, a >= b)
+
+// Loads: access size, bits to sign-extend from (0 = zero-extend)
+#define OPS_LOAD(X) \
+    X(lb, 1, 8)     \
+    X(lh, 2, 16)    \
+    X(lw, 4, 0)     \
+    X(lbu, 1, 0)    \
+    X(lhu, 2, 0)
+
+// Stores: access size
+#define OPS_STORE(X) \
+    X(sb, 1)         \
+    X(sh, 2)         \
+    X(sw, 4)
+
+// Branch hint for trap checks: traps leave the block through a cold path
+#if defined(__GNUC__)
+#define UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define UNLIKELY(x) (x)
+#endif
+
+// Dispatch opcodes: DecodedIns::op. OP_CALL runs the handler through
+// execute(); the rest are run inline by emulateBlock().
+#define OP_ENUM(name, ...) OP_##name,
+enum
+{
+    OP_CALL,
+    OPS_R(OP_ENUM) OPS_SHIFT(OP_ENUM) OPS_I(OP_ENUM) OPS_B(OP_ENUM)
+    OPS_LOAD(OP_ENUM) OPS_STORE(OP_ENUM)
+    OP_lui,
+    OP_auipc,
+    OP_jal,
+    OP_jalr,
+    OP_COUNT
+};
+
+static inline u32 divSigned(u32 dividend, u32 divisor)
+{
+    if (divisor == 0)
+        return 0xFFFFFFFF;
+    if (dividend == 0x80000000 && divisor == 0xFFFFFFFF)
+        return dividend;
+    return (u32)((int32_t)dividend / (int32_t)divisor);
+}
+
+static inline u32 remSigned(u32 dividend, u32 divisor)
+{
+    if (divisor == 0)
+        return dividend;
+    if (dividend == 0x80000000 && divisor == 0xFFFFFFFF)
+        return 0;
+    return (u32)((int32_t)dividend % (int32_t)divisor);
+}
+
+static inline u32 loadExtend(u32 val, u32 bits)
+{
+    return bits != 0 ? signExtend(val, bits) : val;
+}
+
+#define IMP_R(name, expr)              \
+    imp(name, FormatR, {               \
+        u32 a = cpu.xreg[ins.rs1];     \
+        u32 b = cpu.xreg[ins.rs2];     \
+        u32 val = expr;                \
+        WR_RD(val)                     \
+    })
+#define IMP_SHIFT(name, expr)          \
+    imp(name, FormatR, {               \
+        u32 a = cpu.xreg[ins.rs1];     \
+        u32 b = ins.rs2;               \
+        u32 val = expr;                \
+        WR_RD(val)                     \
+    })
+#define IMP_I(name, expr)              \
+    imp(name, FormatI, {               \
+        u32 a = cpu.xreg[ins.rs1];     \
+        u32 b = ins.imm;               \
+        u32 val = expr;                \
+        WR_RD(val)                     \
+    })
+#define IMP_B(name, cond)                      \
+    imp(name, FormatB, {                       \
+        u32 a = cpu.xreg[ins.rs1];             \
+        u32 b = cpu.xreg[ins.rs2];             \
+        bool taken = (cond);                   \
+        STATS_INC(cpu.stats.branches[taken]);  \
+        if (taken)                             \
+            WR_PC(cpu.pc + ins.imm)            \
+    })
+#define IMP_LOAD(name, size, bits)                                       \
+    imp(name, FormatI, {                                                 \
+        u32 tmp = cpu.vmRead(ret, cpu.xreg[ins.rs1] + ins.imm, size);    \
+        if (ret->trap.en)                                                \
+            return;                                                      \
+        tmp = loadExtend(tmp, bits);                                     \
+        WR_RD(tmp)                                                       \
+    })
+#define IMP_STORE(name, size)                                                   \
+    imp(name, FormatS, {                                                        \
+        cpu.vmWrite(ret, cpu.xreg[ins.rs1] + ins.imm, cpu.xreg[ins.rs2], size); \
+    })
+
+OPS_R(IMP_R)
+OPS_SHIFT(IMP_SHIFT)
+OPS_I(IMP_I)
+OPS_B(IMP_B)
+OPS_LOAD(IMP_LOAD)
+OPS_STORE(IMP_STORE)
+
+imp(amoswap_w, FormatR, { // rv32a
+    AMO_W(__atomic_exchange_n(word, sec, __ATOMIC_SEQ_CST), sec)
 }) imp(amoadd_w, FormatR, { // rv32a
-    u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1], MMU_ACCESS_WRITE);
-    if (ret->trap.en) return;
-    u32 tmp = cpu.memGetWord(addr);
-    cpu.memSetWord(addr, cpu.xreg[ins.rs2] + tmp);
-    WR_RD(tmp)
+    AMO_W(__atomic_fetch_add(word, sec, __ATOMIC_SEQ_CST), sec + tmp)
 }) imp(amoxor_w, FormatR, { // rv32a
-    u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1], MMU_ACCESS_WRITE);
-    if (ret->trap.en) return;
-    u32 tmp = cpu.memGetWord(addr);
-    cpu.memSetWord(addr, cpu.xreg[ins.rs2] ^ tmp);
-    WR_RD(tmp)
+    AMO_W(__atomic_fetch_xor(word, sec, __ATOMIC_SEQ_CST), sec ^ tmp)
 }) imp(amoand_w, FormatR, { // rv32a
-    u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1], MMU_ACCESS_WRITE);
-    if (ret->trap.en) return;
-    u32 tmp = cpu.memGetWord(addr);
-    cpu.memSetWord(addr, cpu.xreg[ins.rs2] & tmp);
-    WR_RD(tmp)
+    AMO_W(__atomic_fetch_and(word, sec, __ATOMIC_SEQ_CST), sec & tmp)
 }) imp(amoor_w, FormatR, { // rv32a
-    u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1], MMU_ACCESS_WRITE);
-    if (ret->trap.en) return;
-    u32 tmp = cpu.memGetWord(addr);
-    cpu.memSetWord(addr, cpu.xreg[ins.rs2] | tmp);
-    WR_RD(tmp)
+    AMO_W(__atomic_fetch_or(word, sec, __ATOMIC_SEQ_CST), sec | tmp)
 }) imp(amomin_w, FormatR, { // rv32a
-    u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1], MMU_ACCESS_WRITE);
-    if (ret->trap.en) return;
-    u32 tmp = cpu.memGetWord(addr);
-    u32 sec = cpu.xreg[ins.rs2];
-    cpu.memSetWord(addr, AS_SIGNED(sec) < AS_SIGNED(tmp) ? sec : tmp);
-    WR_RD(tmp)
+    AMO_W(amoMinMax(word, sec, AMO_MIN), AS_SIGNED(sec) < AS_SIGNED(tmp) ? sec : tmp)
 }) imp(amomax_w, FormatR, { // rv32a
-    u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1], MMU_ACCESS_WRITE);
-    if (ret->trap.en) return;
-    u32 tmp = cpu.memGetWord(addr);
-    u32 sec = cpu.xreg[ins.rs2];
-    cpu.memSetWord(addr, AS_SIGNED(sec) > AS_SIGNED(tmp) ? sec : tmp);
-    WR_RD(tmp)
+    AMO_W(amoMinMax(word, sec, AMO_MAX), AS_SIGNED(sec) > AS_SIGNED(tmp) ? sec : tmp)
 }) imp(amominu_w, FormatR, { // rv32a
-    u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1], MMU_ACCESS_WRITE);
-    if (ret->trap.en) return;
-    u32 tmp = cpu.memGetWord(addr);
-    u32 sec = cpu.xreg[ins.rs2];
-    cpu.memSetWord(addr, sec < tmp ? sec : tmp);
-    WR_RD(tmp)
+    AMO_W(amoMinMax(word, sec, AMO_MINU), sec < tmp ? sec : tmp)
 }) imp(amomaxu_w, FormatR, { // rv32a
-    u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1], MMU_ACCESS_WRITE);
-    if (ret->trap.en) return;
-    u32 tmp = cpu.memGetWord(addr);
-    u32 sec = cpu.xreg[ins.rs2];
-    cpu.memSetWord(addr, sec > tmp ? sec : tmp);
-    WR_RD(tmp)
-}) imp(and, FormatR, {                                                                                                                                                                           // rv32i
-                      WR_RD(cpu.xreg[ins.rs1] & cpu.xreg[ins.rs2])}) imp(andi, FormatI, {                                                                                                        // rv32i
-                                                                                         WR_RD(cpu.xreg[ins.rs1] & ins.imm)}) imp(auipc, FormatU, {                                              // rv32i
-                                                                                                                                                   WR_RD(cpu.pc + ins.imm)}) imp(beq, FormatB, { // rv32i
-    if (cpu.xreg[ins.rs1] == cpu.xreg[ins.rs2])
-    {
-        WR_PC(cpu.pc + ins.imm);
-    }
-}) imp(bge, FormatB, { // rv32i
-    if (AS_SIGNED(cpu.xreg[ins.rs1]) >= AS_SIGNED(cpu.xreg[ins.rs2]))
-    {
-        WR_PC(cpu.pc + ins.imm);
-    }
-}) imp(bgeu, FormatB, { // rv32i
-    if (AS_UNSIGNED(cpu.xreg[ins.rs1]) >= AS_UNSIGNED(cpu.xreg[ins.rs2]))
-    {
-        WR_PC(cpu.pc + ins.imm);
-    }
-}) imp(blt, FormatB, { // rv32i
-    if (AS_SIGNED(cpu.xreg[ins.rs1]) < AS_SIGNED(cpu.xreg[ins.rs2]))
-    {
-        WR_PC(cpu.pc + ins.imm);
-    }
-}) imp(bltu, FormatB, { // rv32i
-    if (AS_UNSIGNED(cpu.xreg[ins.rs1]) < AS_UNSIGNED(cpu.xreg[ins.rs2]))
-    {
-        WR_PC(cpu.pc + ins.imm);
-    }
-}) imp(bne, FormatB, { // rv32i
-    if (cpu.xreg[ins.rs1] != cpu.xreg[ins.rs2])
-    {
-        WR_PC(cpu.pc + ins.imm);
-    }
+    AMO_W(amoMinMax(word, sec, AMO_MAXU), sec > tmp ? sec : tmp)
+}) imp(auipc, FormatU, { // rv32i
+    WR_RD(cpu.pc + ins.imm)
 }) imp(csrrc, FormatCSR, { // system
+    RD_CSR()
     u32 rs = cpu.xreg[ins.rs];
     if (rs != 0)
     {
-        WR_CSR(ins.value & ~rs);
+        WR_CSR(value & ~rs);
     }
-    WR_RD(ins.value)
+    WR_RD(value)
 }) imp(csrrci, FormatCSR, { // system
+    RD_CSR()
     if (ins.rs != 0)
     {
-        WR_CSR(ins.value & (~ins.rs));
+        WR_CSR(value & (~ins.rs));
     }
-    WR_RD(ins.value)
+    WR_RD(value)
 }) imp(csrrs, FormatCSR, { // system
+    RD_CSR()
     u32 rs = cpu.xreg[ins.rs];
     if (rs != 0)
     {
-        WR_CSR(ins.value | rs);
+        WR_CSR(value | rs);
     }
-    WR_RD(ins.value)
+    WR_RD(value)
 }) imp(csrrsi, FormatCSR, { // system
+    RD_CSR()
     if (ins.rs != 0)
     {
-        WR_CSR(ins.value | ins.rs);
+        WR_CSR(value | ins.rs);
     }
-    WR_RD(ins.value)
+    WR_RD(value)
 }) imp(csrrw, FormatCSR, { // system
+    // With rd = x0 the CSR is only written, not read
+    u32 value = ins.rd != 0 ? cpu.getCsr(ins.csr, ret) : 0;
+    if (ret->trap.en)
+        return;
     WR_CSR(cpu.xreg[ins.rs]);
-    WR_RD(ins.value)
+    WR_RD(value)
 }) imp(csrrwi, FormatCSR, { // system
+    u32 value = ins.rd != 0 ? cpu.getCsr(ins.csr, ret) : 0;
+    if (ret->trap.en)
+        return;
     WR_CSR(ins.rs);
-    WR_RD(ins.value)
-}) imp(div, FormatR, { // rv32m
-    u32 dividend = cpu.xreg[ins.rs1];
-    u32 divisor = cpu.xreg[ins.rs2];
-    u32 result;
-    if (divisor == 0)
-    {
-        result = 0xFFFFFFFF;
-    }
-    else if (dividend == 0x80000000 && divisor == 0xFFFFFFFF)
-    {
-        result = dividend;
-    }
-    else
-    {
-        int32_t tmp = AS_SIGNED(dividend) / AS_SIGNED(divisor);
-        result = AS_UNSIGNED(tmp);
-    }
-    WR_RD(result)
-}) imp(divu, FormatR, { // rv32m
-    u32 dividend = cpu.xreg[ins.rs1];
-    u32 divisor = cpu.xreg[ins.rs2];
-    u32 result;
-    if (divisor == 0)
-    {
-        result = 0xFFFFFFFF;
-    }
-    else
-    {
-        result = dividend / divisor;
-    }
-    WR_RD(result)
+    WR_RD(value)
 }) imp(ebreak, FormatEmpty, {
                                 // system
                                 // unnecessary?
@@ -491,8 +667,13 @@ imp(add, FormatR, { // rv32i
         // EXIT CALL
         u32 status = cpu.xreg[10] >> 1;
         u32 x10 = cpu.xreg[10];
+        exited = true;
+        exit_status = status;
+        if (stop_on_exit)
+            running = false;
 
         #ifndef __EMSCRIPTEN__
+        cpu.console->flush();
         printf("\nECALL EXIT = x10[%x] %d (0x%x)\n", x10, status, status);
         // exit(status);
         // running = false;
@@ -520,48 +701,23 @@ imp(add, FormatR, { // rv32i
 }) imp(fence, FormatEmpty, {
                                // rv32i
                                // skip
-                           }) imp(fence_i, FormatEmpty, {
-                                                            // rv32i
-                                                            // skip
-                                                        }) imp(jal, FormatJ, { // rv32i
+                           }) imp(fence_i, FormatEmpty, { // rv32i
+    // Drop all pre-decoded instructions
+    cpu.codeFlush();
+}) imp(jal, FormatJ, { // rv32i
     WR_RD(cpu.pc + 4);
     WR_PC(cpu.pc + ins.imm);
 }) imp(jalr, FormatI, { // rv32i
-    WR_RD(cpu.pc + 4);
+    // Target first: rd may be rs1
     WR_PC(cpu.xreg[ins.rs1] + ins.imm);
-}) imp(lb, FormatI, { // rv32i
-    u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1] + ins.imm, MMU_ACCESS_READ);
-    if (ret->trap.en) return;
-    u32 tmp = signExtend(cpu.memGetByte(addr), 8);
-    WR_RD(tmp)
-}) imp(lbu, FormatI, { // rv32i
-    u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1] + ins.imm, MMU_ACCESS_READ);
-    if (ret->trap.en) return;
-    u32 tmp = cpu.memGetByte(addr);
-    WR_RD(tmp)
-}) imp(lh, FormatI, { // rv32i
-    u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1] + ins.imm, MMU_ACCESS_READ);
-    if (ret->trap.en) return;
-    u32 tmp = signExtend(cpu.memGetHalfWord(addr), 16);
-    WR_RD(tmp)
-}) imp(lhu, FormatI, { // rv32i
-    u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1] + ins.imm, MMU_ACCESS_READ);
-    if (ret->trap.en) return;
-    u32 tmp = cpu.memGetHalfWord(addr);
-    WR_RD(tmp)
+    WR_RD(cpu.pc + 4);
 }) imp(lr_w, FormatR, { // rv32a
     u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1], MMU_ACCESS_READ);
     if (ret->trap.en) return;
-    u32 tmp = cpu.memGetWord(addr);
-    cpu.reservation_en = true;
-    cpu.reservation_addr = addr;
-    WR_RD(tmp)
-}) imp(lui, FormatU, {                                    // rv32i
-                      WR_RD(ins.imm)}) imp(lw, FormatI, { // rv32i
-    u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1] + ins.imm, MMU_ACCESS_READ);
-    if (ret->trap.en) return;
-    u32 tmp = cpu.memGetWord(addr);
+    u32 tmp = cpu.loadReserved(addr);
     WR_RD(tmp)
+}) imp(lui, FormatU, { // rv32i
+    WR_RD(ins.imm)
 }) imp(mret, FormatEmpty, { // system
     u32 newpc = cpu.getCsr(CSR_MEPC, ret);
     if (!ret->trap.en)
@@ -573,64 +729,14 @@ imp(add, FormatR, { // rv32i
         u32 new_status = (status & ~0x21888) | (mprv << 17) | (mpie << 3) | (1 << 7);
         cpu.writeCsrRaw(CSR_MSTATUS, new_status);
         cpu.csr.privilege = mpp;
+        cpu.tlbSync();
         WR_PC(newpc)
     }
-}) imp(mul, FormatR, { // rv32m
-    u32 tmp = AS_SIGNED(cpu.xreg[ins.rs1]) * AS_SIGNED(cpu.xreg[ins.rs2]);
-    WR_RD(tmp)
-}) imp(mulh, FormatR, { // rv32m
-    u32 tmp = ((int64_t)AS_SIGNED(cpu.xreg[ins.rs1]) * (int64_t)AS_SIGNED(cpu.xreg[ins.rs2])) >> 32;
-    WR_RD(tmp)
-}) imp(mulhsu, FormatR, { // rv32m
-    u32 tmp = ((int64_t)AS_SIGNED(cpu.xreg[ins.rs1]) * (uint64_t)AS_UNSIGNED(cpu.xreg[ins.rs2])) >> 32;
-    WR_RD(tmp)
-}) imp(mulhu, FormatR, { // rv32m
-    u32 tmp = ((uint64_t)AS_UNSIGNED(cpu.xreg[ins.rs1]) * (uint64_t)AS_UNSIGNED(cpu.xreg[ins.rs2])) >> 32;
-    WR_RD(tmp)
-}) imp(or, FormatR, {                                                                                                                           // rv32i
-                     WR_RD(cpu.xreg[ins.rs1] | cpu.xreg[ins.rs2])}) imp(ori, FormatI, {                                                         // rv32i
-                                                                                       WR_RD(cpu.xreg[ins.rs1] | ins.imm)}) imp(rem, FormatR, { // rv32m
-    u32 dividend = cpu.xreg[ins.rs1];
-    u32 divisor = cpu.xreg[ins.rs2];
-    u32 result;
-    if (divisor == 0)
-    {
-        result = dividend;
-    }
-    else if (dividend == 0x80000000 && divisor == 0xFFFFFFFF)
-    {
-        result = 0;
-    }
-    else
-    {
-        int32_t tmp = AS_SIGNED(dividend) % AS_SIGNED(divisor);
-        result = AS_UNSIGNED(tmp);
-    }
-    WR_RD(result)
-}) imp(remu, FormatR, { // rv32m
-    u32 dividend = cpu.xreg[ins.rs1];
-    u32 divisor = cpu.xreg[ins.rs2];
-    u32 result;
-    if (divisor == 0)
-    {
-        result = dividend;
-    }
-    else
-    {
-        result = dividend % divisor;
-    }
-    WR_RD(result)
-}) imp(sb, FormatS, { // rv32i
-    u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1] + ins.imm, MMU_ACCESS_WRITE);
-    if (ret->trap.en) return;
-    cpu.memSetByte(addr, cpu.xreg[ins.rs2]);
 }) imp(sc_w, FormatR, { // rv32a
     u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1], MMU_ACCESS_WRITE);
     if (ret->trap.en) return;
-    if (cpu.reservation_en && cpu.reservation_addr == addr)
+    if (cpu.storeConditional(addr, cpu.xreg[ins.rs2]))
     {
-        cpu.memSetWord(addr, cpu.xreg[ins.rs2]);
-        cpu.reservation_en = false;
         WR_RD(ZERO)
     }
     else
@@ -639,59 +745,8 @@ imp(add, FormatR, { // rv32i
     }
 }) imp(sfence_vma, FormatEmpty, {
                                     // system
-                                    // skip
-                                }) imp(sh, FormatS, { // rv32i
-    u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1] + ins.imm, MMU_ACCESS_WRITE);
-    if (ret->trap.en) return;
-    cpu.memSetHalfWord(addr, cpu.xreg[ins.rs2]);
-}) imp(sll, FormatR, {                                                                     // rv32i
-                      WR_RD(cpu.xreg[ins.rs1] << cpu.xreg[ins.rs2])}) imp(slli, FormatR, { // rv32i
-    u32 shamt = (ins_word >> 20) & 0x1F;
-    WR_RD(cpu.xreg[ins.rs1] << shamt)
-}) imp(slt, FormatR, { // rv32i
-    if (AS_SIGNED(cpu.xreg[ins.rs1]) < AS_SIGNED(cpu.xreg[ins.rs2]))
-    {
-        WR_RD(ONE)
-    }
-    else
-    {
-        WR_RD(ZERO)
-    }
-}) imp(slti, FormatI, { // rv32i
-    if (AS_SIGNED(cpu.xreg[ins.rs1]) < AS_SIGNED(ins.imm))
-    {
-        WR_RD(ONE)
-    }
-    else
-    {
-        WR_RD(ZERO)
-    }
-}) imp(sltiu, FormatI, { // rv32i
-    if (AS_UNSIGNED(cpu.xreg[ins.rs1]) < AS_UNSIGNED(ins.imm))
-    {
-        WR_RD(ONE)
-    }
-    else
-    {
-        WR_RD(ZERO)
-    }
-}) imp(sltu, FormatR, { // rv32i
-    if (AS_UNSIGNED(cpu.xreg[ins.rs1]) < AS_UNSIGNED(cpu.xreg[ins.rs2]))
-    {
-        WR_RD(ONE)
-    }
-    else
-    {
-        WR_RD(ZERO)
-    }
-}) imp(sra, FormatR, { // rv32i
-    u32 msr = cpu.xreg[ins.rs1] & 0x80000000;
-    WR_RD(msr ? ~(~cpu.xreg[ins.rs1] >> cpu.xreg[ins.rs2]) : cpu.xreg[ins.rs1] >> cpu.xreg[ins.rs2])
-}) imp(srai, FormatR, { // rv32i
-    u32 msr = cpu.xreg[ins.rs1] & 0x80000000;
-    u32 shamt = (ins_word >> 20) & 0x1F;
-    WR_RD(msr ? ~(~cpu.xreg[ins.rs1] >> shamt) : cpu.xreg[ins.rs1] >> shamt)
-}) imp(sret, FormatEmpty, { // system
+                                    cpu.tlbFlush();
+                                }) imp(sret, FormatEmpty, { // system
     u32 newpc = cpu.getCsr(CSR_SEPC, ret);
     if (!ret->trap.en)
     {
@@ -702,27 +757,17 @@ imp(add, FormatR, { // rv32i
         u32 new_status = (status & ~0x20122) | (mprv << 17) | (spie << 1) | (1 << 5);
         cpu.writeCsrRaw(CSR_SSTATUS, new_status);
         cpu.csr.privilege = spp;
+        cpu.tlbSync();
         WR_PC(newpc)
     }
-}) imp(srl, FormatR, {                                                                     // rv32i
-                      WR_RD(cpu.xreg[ins.rs1] >> cpu.xreg[ins.rs2])}) imp(srli, FormatR, { // rv32i
-    u32 shamt = (ins_word >> 20) & 0x1F;
-    WR_RD(cpu.xreg[ins.rs1] >> shamt)
-}) imp(sub, FormatR, { // rv32i
-    WR_RD(AS_SIGNED(cpu.xreg[ins.rs1]) - AS_SIGNED(cpu.xreg[ins.rs2]));
-}) imp(sw, FormatS, { // rv32i
-    u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1] + ins.imm, MMU_ACCESS_WRITE);
-    if (ret->trap.en) return;
-    cpu.memSetWord(addr, cpu.xreg[ins.rs2]);
 }) imp(uret, FormatEmpty, {
                               // system
                               // unnecessary?
                           }) imp(wfi, FormatEmpty, {
                                                        // system
-                                                       // no-op is valid here, so skip
-                                                   }) imp(xor, FormatR, {                                                                   // rv32i
-                                                                         WR_RD(cpu.xreg[ins.rs1] ^ cpu.xreg[ins.rs2])}) imp(xori, FormatI, {// rv32i
-                                                                                                                                            WR_RD(cpu.xreg[ins.rs1] ^ ins.imm)})
+                                                       // idles in Emulator::retire()
+                                                       cpu.wfi = true;
+                                                   })
 
 ////////////////////////////////////////////////////////////////
 // RV32F / RV32D Instruction Implementations
@@ -731,27 +776,23 @@ imp(add, FormatR, { // rv32i
 // ---- FP Loads / Stores ----
 imp(flw, FormatI, { // rv32f
     FP_CHECK_FS()
-    u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1] + ins.imm, MMU_ACCESS_READ);
+    u32 tmp = cpu.vmRead(ret, cpu.xreg[ins.rs1] + ins.imm, 4);
     if (ret->trap.en) return;
-    cpu.freg[ins.rd] = 0xFFFFFFFF00000000ULL | (u64)cpu.memGetWord(addr);
+    cpu.freg[ins.rd] = 0xFFFFFFFF00000000ULL | (u64)tmp;
 })
 imp(fld, FormatI, { // rv32d
     FP_CHECK_FS()
-    u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1] + ins.imm, MMU_ACCESS_READ);
+    u64 tmp = mem_get_double(cpu, ret, cpu.xreg[ins.rs1] + ins.imm);
     if (ret->trap.en) return;
-    cpu.freg[ins.rd] = mem_get_double(cpu, addr);
+    cpu.freg[ins.rd] = tmp;
 })
 imp(fsw, FormatS, { // rv32f
     FP_CHECK_FS()
-    u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1] + ins.imm, MMU_ACCESS_WRITE);
-    if (ret->trap.en) return;
-    cpu.memSetWord(addr, (u32)(cpu.freg[ins.rs2] & 0xFFFFFFFFu));
+    cpu.vmWrite(ret, cpu.xreg[ins.rs1] + ins.imm, (u32)(cpu.freg[ins.rs2] & 0xFFFFFFFFu), 4);
 })
 imp(fsd, FormatS, { // rv32d
     FP_CHECK_FS()
-    u32 addr = cpu.mmuTranslate(ret, cpu.xreg[ins.rs1] + ins.imm, MMU_ACCESS_WRITE);
-    if (ret->trap.en) return;
-    mem_set_double(cpu, addr, cpu.freg[ins.rs2]);
+    mem_set_double(cpu, ret, cpu.xreg[ins.rs1] + ins.imm, cpu.freg[ins.rs2]);
 })
 
 // ---- FP Arithmetic — Single ----
@@ -1159,329 +1200,925 @@ imp(fcvt_d_s, FormatR, { // rv32d: single → double (always exact)
     }
 })
 
-    ins_ret Emulator::insSelect(u32 ins_word)
+// Decoder table: mask and value selecting each handler, its operand format
+// and dispatch opcode, in priority order (the first match wins)
+typedef void (*ins_parse)(u32 word, DecodedFormat *fmt);
+
+typedef struct {
+    u32 mask;
+    u32 match;
+    ins_exec exec;
+    ins_parse parse;
+    u16 op;
+    const char *name; // Handler name (statistics)
+} decode_entry;
+
+#define PARSE_INTO(fmt_t)                                             \
+    static void parseInto_##fmt_t(u32 word, DecodedFormat *fmt)       \
+    {                                                                 \
+        fmt->as_##fmt_t = parse_##fmt_t(word);                        \
+    }
+PARSE_INTO(FormatB)
+PARSE_INTO(FormatCSR)
+PARSE_INTO(FormatI)
+PARSE_INTO(FormatJ)
+PARSE_INTO(FormatR)
+PARSE_INTO(FormatS)
+PARSE_INTO(FormatU)
+PARSE_INTO(FormatEmpty)
+
+// INS: run through execute(); FAST: run inline by emulateBlock()
+#define INS(name, mask, match, fmt_t) {mask, match, &Emulator::exec_##name, parseInto_##fmt_t, OP_CALL, #name}
+#define FAST(name, mask, match, fmt_t) {mask, match, &Emulator::exec_##name, parseInto_##fmt_t, OP_##name, #name}
+
+static const decode_entry decode_list[] = {
+    FAST(auipc, 0x0000007f, 0x00000017, FormatU),
+    FAST(jal, 0x0000007f, 0x0000006f, FormatJ),
+    FAST(lui, 0x0000007f, 0x00000037, FormatU),
+    FAST(addi, 0x0000707f, 0x00000013, FormatI),
+    FAST(andi, 0x0000707f, 0x00007013, FormatI),
+    FAST(beq, 0x0000707f, 0x00000063, FormatB),
+    FAST(bge, 0x0000707f, 0x00005063, FormatB),
+    FAST(bgeu, 0x0000707f, 0x00007063, FormatB),
+    FAST(blt, 0x0000707f, 0x00004063, FormatB),
+    FAST(bltu, 0x0000707f, 0x00006063, FormatB),
+    FAST(bne, 0x0000707f, 0x00001063, FormatB),
+    INS(csrrc, 0x0000707f, 0x00003073, FormatCSR),
+    INS(csrrci, 0x0000707f, 0x00007073, FormatCSR),
+    INS(csrrs, 0x0000707f, 0x00002073, FormatCSR),
+    INS(csrrsi, 0x0000707f, 0x00006073, FormatCSR),
+    INS(csrrw, 0x0000707f, 0x00001073, FormatCSR),
+    INS(csrrwi, 0x0000707f, 0x00005073, FormatCSR),
+    INS(fence, 0x0000707f, 0x0000000f, FormatEmpty),
+    INS(fence_i, 0x0000707f, 0x0000100f, FormatEmpty),
+    FAST(jalr, 0x0000707f, 0x00000067, FormatI),
+    FAST(lb, 0x0000707f, 0x00000003, FormatI),
+    FAST(lbu, 0x0000707f, 0x00004003, FormatI),
+    FAST(lh, 0x0000707f, 0x00001003, FormatI),
+    FAST(lhu, 0x0000707f, 0x00005003, FormatI),
+    FAST(lw, 0x0000707f, 0x00002003, FormatI),
+    INS(flw, 0x0000707f, 0x00002007, FormatI), // rv32f
+    INS(fld, 0x0000707f, 0x00003007, FormatI), // rv32d
+    FAST(ori, 0x0000707f, 0x00006013, FormatI),
+    FAST(sb, 0x0000707f, 0x00000023, FormatS),
+    FAST(sh, 0x0000707f, 0x00001023, FormatS),
+    INS(fsw, 0x0000707f, 0x00002027, FormatS), // rv32f
+    INS(fsd, 0x0000707f, 0x00003027, FormatS), // rv32d
+    FAST(slti, 0x0000707f, 0x00002013, FormatI),
+    FAST(sltiu, 0x0000707f, 0x00003013, FormatI),
+    FAST(sw, 0x0000707f, 0x00002023, FormatS),
+    FAST(xori, 0x0000707f, 0x00004013, FormatI),
+    INS(amoswap_w, 0xf800707f, 0x0800202f, FormatR),
+    INS(amoadd_w, 0xf800707f, 0x0000202f, FormatR),
+    INS(amoxor_w, 0xf800707f, 0x2000202f, FormatR),
+    INS(amoand_w, 0xf800707f, 0x6000202f, FormatR),
+    INS(amoor_w, 0xf800707f, 0x4000202f, FormatR),
+    INS(amomin_w, 0xf800707f, 0x8000202f, FormatR),
+    INS(amomax_w, 0xf800707f, 0xa000202f, FormatR),
+    INS(amominu_w, 0xf800707f, 0xc000202f, FormatR),
+    INS(amomaxu_w, 0xf800707f, 0xe000202f, FormatR),
+    INS(sc_w, 0xf800707f, 0x1800202f, FormatR),
+    INS(lr_w, 0xf9f0707f, 0x1000202f, FormatR),
+    FAST(slli, 0xfc00707f, 0x00001013, FormatR),
+    FAST(srai, 0xfc00707f, 0x40005013, FormatR),
+    FAST(srli, 0xfc00707f, 0x00005013, FormatR),
+    FAST(add, 0xfe00707f, 0x00000033, FormatR),
+    FAST(and, 0xfe00707f, 0x00007033, FormatR),
+    FAST(div, 0xfe00707f, 0x02004033, FormatR),
+    FAST(divu, 0xfe00707f, 0x02005033, FormatR),
+    FAST(mul, 0xfe00707f, 0x02000033, FormatR),
+    FAST(mulh, 0xfe00707f, 0x02001033, FormatR),
+    FAST(mulhsu, 0xfe00707f, 0x02002033, FormatR),
+    FAST(mulhu, 0xfe00707f, 0x02003033, FormatR),
+    FAST(or, 0xfe00707f, 0x00006033, FormatR),
+    FAST(rem, 0xfe00707f, 0x02006033, FormatR),
+    FAST(remu, 0xfe00707f, 0x02007033, FormatR),
+    FAST(sll, 0xfe00707f, 0x00001033, FormatR),
+    FAST(slt, 0xfe00707f, 0x00002033, FormatR),
+    FAST(sltu, 0xfe00707f, 0x00003033, FormatR),
+    FAST(sra, 0xfe00707f, 0x40005033, FormatR),
+    FAST(srl, 0xfe00707f, 0x00005033, FormatR),
+    FAST(sub, 0xfe00707f, 0x40000033, FormatR),
+    FAST(xor, 0xfe00707f, 0x00004033, FormatR),
+    INS(sfence_vma, 0xfe007fff, 0x12000073, FormatEmpty),
+    // RV32F / RV32D
+    // R4-type fused: match opcode + fmt bits[26:25] (00=S, 01=D)
+    INS(fmadd_s, 0x0600007f, 0x00000043, FormatR),
+    INS(fmsub_s, 0x0600007f, 0x00000047, FormatR),
+    INS(fnmsub_s, 0x0600007f, 0x0000004b, FormatR),
+    INS(fnmadd_s, 0x0600007f, 0x0000004f, FormatR),
+    INS(fmadd_d, 0x0600007f, 0x02000043, FormatR),
+    INS(fmsub_d, 0x0600007f, 0x02000047, FormatR),
+    INS(fnmsub_d, 0x0600007f, 0x0200004b, FormatR),
+    INS(fnmadd_d, 0x0600007f, 0x0200004f, FormatR),
+    // fmv.x.w, fclass — match funct7 + rs2 + funct3
+    INS(fmv_x_w, 0xfff0707f, 0xe0000053, FormatR),
+    INS(fclass_s, 0xfff0707f, 0xe0001053, FormatR),
+    INS(fclass_d, 0xfff0707f, 0xe2001053, FormatR),
+    // fsqrt, fcvt, fmv.w.x — match funct7 + rs2 (no funct3)
+    INS(fsqrt_s, 0xfff0007f, 0x58000053, FormatR),
+    INS(fsqrt_d, 0xfff0007f, 0x5a000053, FormatR),
+    INS(fcvt_w_s, 0xfff0007f, 0xc0000053, FormatR),
+    INS(fcvt_wu_s, 0xfff0007f, 0xc0100053, FormatR),
+    INS(fcvt_s_w, 0xfff0007f, 0xd0000053, FormatR),
+    INS(fcvt_s_wu, 0xfff0007f, 0xd0100053, FormatR),
+    INS(fmv_w_x, 0xfff0007f, 0xf0000053, FormatR),
+    INS(fcvt_s_d, 0xfff0007f, 0x40100053, FormatR),
+    INS(fcvt_d_s, 0xfff0007f, 0x42000053, FormatR),
+    INS(fcvt_w_d, 0xfff0007f, 0xc2000053, FormatR),
+    INS(fcvt_wu_d, 0xfff0007f, 0xc2100053, FormatR),
+    INS(fcvt_d_w, 0xfff0007f, 0xd2000053, FormatR),
+    INS(fcvt_d_wu, 0xfff0007f, 0xd2100053, FormatR),
+    // fsgnj, fmin/max, feq/flt/fle — match funct7 + funct3
+    INS(fsgnj_s, 0xfe00707f, 0x20000053, FormatR),
+    INS(fsgnjn_s, 0xfe00707f, 0x20001053, FormatR),
+    INS(fsgnjx_s, 0xfe00707f, 0x20002053, FormatR),
+    INS(fmin_s, 0xfe00707f, 0x28000053, FormatR),
+    INS(fmax_s, 0xfe00707f, 0x28001053, FormatR),
+    INS(feq_s, 0xfe00707f, 0xa0002053, FormatR),
+    INS(flt_s, 0xfe00707f, 0xa0001053, FormatR),
+    INS(fle_s, 0xfe00707f, 0xa0000053, FormatR),
+    INS(fsgnj_d, 0xfe00707f, 0x22000053, FormatR),
+    INS(fsgnjn_d, 0xfe00707f, 0x22001053, FormatR),
+    INS(fsgnjx_d, 0xfe00707f, 0x22002053, FormatR),
+    INS(fmin_d, 0xfe00707f, 0x2a000053, FormatR),
+    INS(fmax_d, 0xfe00707f, 0x2a001053, FormatR),
+    INS(feq_d, 0xfe00707f, 0xa2002053, FormatR),
+    INS(flt_d, 0xfe00707f, 0xa2001053, FormatR),
+    INS(fle_d, 0xfe00707f, 0xa2000053, FormatR),
+    // fadd/fsub/fmul/fdiv — match funct7 only
+    INS(fadd_s, 0xfe00007f, 0x00000053, FormatR),
+    INS(fsub_s, 0xfe00007f, 0x08000053, FormatR),
+    INS(fmul_s, 0xfe00007f, 0x10000053, FormatR),
+    INS(fdiv_s, 0xfe00007f, 0x18000053, FormatR),
+    INS(fadd_d, 0xfe00007f, 0x02000053, FormatR),
+    INS(fsub_d, 0xfe00007f, 0x0a000053, FormatR),
+    INS(fmul_d, 0xfe00007f, 0x12000053, FormatR),
+    INS(fdiv_d, 0xfe00007f, 0x1a000053, FormatR),
+    INS(ebreak, 0xffffffff, 0x00100073, FormatEmpty),
+    INS(ecall, 0xffffffff, 0x00000073, FormatEmpty),
+    INS(mret, 0xffffffff, 0x30200073, FormatEmpty),
+    INS(sret, 0xffffffff, 0x10200073, FormatEmpty),
+    INS(uret, 0xffffffff, 0x00200073, FormatEmpty),
+    INS(wfi, 0xffffffff, 0x10500073, FormatEmpty),
+};
+
+const u32 DECODE_ENTRIES = sizeof(decode_list) / sizeof(decode_list[0]);
+#ifdef RV32_STATS
+static_assert(DECODE_ENTRIES < STATS_INS_MAX, "STATS_INS_MAX too small for decode_list");
+#endif
+// Word bits the lookup tables index on: opcode, funct3 and funct7
+const u32 DECODE_KEY_MASK = 0xfe00707f;
+// Ends a candidate run
+const u16 DECODE_NONE = 0xffff;
+
+// Two-level lookup built from decode_list: opcode bits [6:2] select a table of
+// 1024 slots indexed by funct3 | funct7 << 3, and a slot is the offset of a
+// DECODE_NONE terminated run of candidate entries in `chains`. Nearly every
+// slot has one candidate; only words that also decode rs2 or the whole word
+// (SYSTEM, the FP conversions) have a few to tell apart.
+struct DecodeTables
 {
-    u32 ins_masked;
-    ins_ret ret = cpu.insReturnNoop();
+    std::vector<u16> chains;
+    std::vector<u16> slots[32]; // Empty for opcodes nothing uses
+
+    DecodeTables()
+    {
+        std::map<std::vector<u16>, u16> runs;
+        runs[std::vector<u16>()] = 0;
+        chains.push_back(DECODE_NONE);
 
-    FormatR ins_FormatR = parse_FormatR(ins_word);
-    FormatI ins_FormatI = parse_FormatI(ins_word);
-    FormatS ins_FormatS = parse_FormatS(ins_word);
-    FormatU ins_FormatU = parse_FormatU(ins_word);
-    FormatJ ins_FormatJ = parse_FormatJ(ins_word);
-    FormatB ins_FormatB = parse_FormatB(ins_word);
-    FormatCSR ins_FormatCSR = parse_FormatCSR(ins_word);
-    FormatEmpty ins_FormatEmpty = parse_FormatEmpty(ins_word);
-
-    if ((ins_word & 0x00000073) == 0x00000073)
-    {
-        // could be CSR instruction
-        ins_FormatCSR.value = cpu.getCsr(ins_FormatCSR.csr, &ret);
-    }
-
-    ins_masked = ins_word & 0x0000007f;
-    switch (ins_masked)
-    {
-        run(auipc, 0x00000017, ins_FormatU)
-        run(jal, 0x0000006f, ins_FormatJ)
-        run(lui, 0x00000037, ins_FormatU)
-    }
-    ins_masked = ins_word & 0x0000707f;
-    switch (ins_masked)
-    {
-        run(addi, 0x00000013, ins_FormatI)
-        run(andi, 0x00007013, ins_FormatI)
-        run(beq, 0x00000063, ins_FormatB)
-        run(bge, 0x00005063, ins_FormatB)
-        run(bgeu, 0x00007063, ins_FormatB)
-        run(blt, 0x00004063, ins_FormatB)
-        run(bltu, 0x00006063, ins_FormatB)
-        run(bne, 0x00001063, ins_FormatB)
-        run(csrrc, 0x00003073, ins_FormatCSR)
-        run(csrrci, 0x00007073, ins_FormatCSR)
-        run(csrrs, 0x00002073, ins_FormatCSR)
-        run(csrrsi, 0x00006073, ins_FormatCSR)
-        run(csrrw, 0x00001073, ins_FormatCSR)
-        run(csrrwi, 0x00005073, ins_FormatCSR)
-        run(fence, 0x0000000f, ins_FormatEmpty)
-        run(fence_i, 0x0000100f, ins_FormatEmpty)
-        run(jalr, 0x00000067, ins_FormatI)
-        run(lb, 0x00000003, ins_FormatI)
-        run(lbu, 0x00004003, ins_FormatI)
-        run(lh, 0x00001003, ins_FormatI)
-        run(lhu, 0x00005003, ins_FormatI)
-        run(lw, 0x00002003, ins_FormatI)
-        run(flw, 0x00002007, ins_FormatI) // rv32f
-        run(fld, 0x00003007, ins_FormatI) // rv32d
-        run(ori, 0x00006013, ins_FormatI)
-        run(sb, 0x00000023, ins_FormatS)
-        run(sh, 0x00001023, ins_FormatS)
-        run(fsw, 0x00002027, ins_FormatS) // rv32f
-        run(fsd, 0x00003027, ins_FormatS) // rv32d
-        run(slti, 0x00002013, ins_FormatI)
-        run(sltiu, 0x00003013, ins_FormatI)
-        run(sw, 0x00002023, ins_FormatS)
-        run(xori, 0x00004013, ins_FormatI)
-    }
-    ins_masked = ins_word & 0xf800707f;
-    switch (ins_masked)
-    {
-        run(amoswap_w, 0x0800202f, ins_FormatR)
-        run(amoadd_w, 0x0000202f, ins_FormatR)
-        run(amoxor_w, 0x2000202f, ins_FormatR)
-        run(amoand_w, 0x6000202f, ins_FormatR)
-        run(amoor_w, 0x4000202f, ins_FormatR)
-        run(amomin_w, 0x8000202f, ins_FormatR)
-        run(amomax_w, 0xa000202f, ins_FormatR)
-        run(amominu_w, 0xc000202f, ins_FormatR)
-        run(amomaxu_w, 0xe000202f, ins_FormatR)
-        run(sc_w, 0x1800202f, ins_FormatR)
-    }
-    ins_masked = ins_word & 0xf9f0707f;
-    switch (ins_masked)
-    {
-        run(lr_w, 0x1000202f, ins_FormatR)
-    }
-    ins_masked = ins_word & 0xfc00707f;
-    switch (ins_masked)
-    {
-        run(slli, 0x00001013, ins_FormatR)
-        run(srai, 0x40005013, ins_FormatR)
-        run(srli, 0x00005013, ins_FormatR)
-    }
-    ins_masked = ins_word & 0xfe00707f;
-    switch (ins_masked)
-    {
-        run(add, 0x00000033, ins_FormatR)
-        run(and, 0x00007033, ins_FormatR)
-        run(div, 0x02004033, ins_FormatR)
-        run(divu, 0x02005033, ins_FormatR)
-        run(mul, 0x02000033, ins_FormatR)
-        run(mulh, 0x02001033, ins_FormatR)
-        run(mulhsu, 0x02002033, ins_FormatR)
-        run(mulhu, 0x02003033, ins_FormatR)
-        run(or, 0x00006033, ins_FormatR)
-        run(rem, 0x02006033, ins_FormatR)
-        run(remu, 0x02007033, ins_FormatR)
-        run(sll, 0x00001033, ins_FormatR)
-        run(slt, 0x00002033, ins_FormatR)
-        run(sltu, 0x00003033, ins_FormatR)
-        run(sra, 0x40005033, ins_FormatR)
-        run(srl, 0x00005033, ins_FormatR)
-        run(sub, 0x40000033, ins_FormatR)
-        run(xor, 0x00004033, ins_FormatR)
-    }
-    ins_masked = ins_word & 0xfe007fff;
-    switch (ins_masked)
-    {
-        run(sfence_vma, 0x12000073, ins_FormatEmpty)
-    }
-    // ---- RV32F / RV32D new switch blocks ----
-    // All FP compute instructions trap if mstatus.FS == Off
-    {
-        u32 op7 = ins_word & 0x7f;
-        if (op7 == 0x43 || op7 == 0x47 || op7 == 0x4b || op7 == 0x4f || op7 == 0x53)
+        for (u32 op = 0; op < 32; op++)
         {
-            if (((cpu.csr.data[CSR_MSTATUS] >> 13) & 3) == 0)
+            u32 opcode = op << 2 | 3;
+            bool used = false;
+            for (u32 i = 0; i < DECODE_ENTRIES; i++)
+                used |= (decode_list[i].match & 0x7f) == opcode;
+            if (!used)
+                continue;
+
+            slots[op].resize(1024);
+            for (u32 key = 0; key < 1024; key++)
             {
-                ret.trap.en    = true;
-                ret.trap.type  = trap_IllegalInstruction;
-                ret.trap.value = ins_word;
-                return ret;
+                u32 word = opcode | (key & 7) << 12 | (key >> 3) << 25;
+                std::vector<u16> run;
+                for (u32 i = 0; i < DECODE_ENTRIES; i++)
+                {
+                    if (((word ^ decode_list[i].match) & decode_list[i].mask & DECODE_KEY_MASK) == 0)
+                        run.push_back((u16)i);
+                }
+                auto it = runs.find(run);
+                if (it == runs.end())
+                {
+                    it = runs.insert(std::make_pair(run, (u16)chains.size())).first;
+                    chains.insert(chains.end(), run.begin(), run.end());
+                    chains.push_back(DECODE_NONE);
+                }
+                slots[op][key] = it->second;
             }
         }
     }
+};
 
-    // R4-type fused: match opcode + fmt bits[26:25] (00=S, 01=D)
-    ins_masked = ins_word & 0x0600007f;
-    switch (ins_masked)
-    {
-        run(fmadd_s,  0x00000043, ins_FormatR)
-        run(fmsub_s,  0x00000047, ins_FormatR)
-        run(fnmsub_s, 0x0000004b, ins_FormatR)
-        run(fnmadd_s, 0x0000004f, ins_FormatR)
-        run(fmadd_d,  0x02000043, ins_FormatR)
-        run(fmsub_d,  0x02000047, ins_FormatR)
-        run(fnmsub_d, 0x0200004b, ins_FormatR)
-        run(fnmadd_d, 0x0200004f, ins_FormatR)
+// Select the handler for an instruction word and extract its operands.
+// Runs once per instruction slot; the result is cached in Emulator::icache.
+void Emulator::decode(u32 ins_word, DecodedIns *d)
+{
+    static const DecodeTables tables;
+
+    d->ins_word = ins_word;
+    d->flags = 0;
+    d->exec = &Emulator::exec_illegal;
+    d->op = OP_CALL;
+#ifdef RV32_STATS
+    d->entry = DECODE_ENTRIES;
+#endif
+
+    u32 op7 = ins_word & 0x7f;
+    if (op7 == 0x73)
+    {
+        // SYSTEM: CSR access, ecall, xret, wfi, sfence.vma
+        d->flags |= DECODE_BLOCK_END;
     }
-    // fmv.x.w, fclass — match funct7 + rs2 + funct3
-    ins_masked = ins_word & 0xfff0707f;
-    switch (ins_masked)
+    else if (op7 == 0x0f)
     {
-        run(fmv_x_w,  0xe0000053, ins_FormatR)
-        run(fclass_s, 0xe0001053, ins_FormatR)
-        run(fclass_d, 0xe2001053, ins_FormatR)
+        // fence / fence.i
+        d->flags |= DECODE_BLOCK_END;
     }
-    // fsqrt, fcvt, fmv.w.x — match funct7 + rs2 (no funct3)
-    ins_masked = ins_word & 0xfff0007f;
-    switch (ins_masked)
-    {
-        run(fsqrt_s,   0x58000053, ins_FormatR)
-        run(fsqrt_d,   0x5a000053, ins_FormatR)
-        run(fcvt_w_s,  0xc0000053, ins_FormatR)
-        run(fcvt_wu_s, 0xc0100053, ins_FormatR)
-        run(fcvt_s_w,  0xd0000053, ins_FormatR)
-        run(fcvt_s_wu, 0xd0100053, ins_FormatR)
-        run(fmv_w_x,   0xf0000053, ins_FormatR)
-        run(fcvt_s_d,  0x40100053, ins_FormatR)
-        run(fcvt_d_s,  0x42000053, ins_FormatR)
-        run(fcvt_w_d,  0xc2000053, ins_FormatR)
-        run(fcvt_wu_d, 0xc2100053, ins_FormatR)
-        run(fcvt_d_w,  0xd2000053, ins_FormatR)
-        run(fcvt_d_wu, 0xd2100053, ins_FormatR)
+    else if (op7 == 0x43 || op7 == 0x47 || op7 == 0x4b || op7 == 0x4f || op7 == 0x53)
+    {
+        // All FP compute instructions trap if mstatus.FS == Off
+        d->flags |= DECODE_FP_CHECK;
     }
-    // fsgnj, fmin/max, feq/flt/fle — match funct7 + funct3
-    ins_masked = ins_word & 0xfe00707f;
-    switch (ins_masked)
-    {
-        run(fsgnj_s,  0x20000053, ins_FormatR)
-        run(fsgnjn_s, 0x20001053, ins_FormatR)
-        run(fsgnjx_s, 0x20002053, ins_FormatR)
-        run(fmin_s,   0x28000053, ins_FormatR)
-        run(fmax_s,   0x28001053, ins_FormatR)
-        run(feq_s,    0xa0002053, ins_FormatR)
-        run(flt_s,    0xa0001053, ins_FormatR)
-        run(fle_s,    0xa0000053, ins_FormatR)
-        run(fsgnj_d,  0x22000053, ins_FormatR)
-        run(fsgnjn_d, 0x22001053, ins_FormatR)
-        run(fsgnjx_d, 0x22002053, ins_FormatR)
-        run(fmin_d,   0x2a000053, ins_FormatR)
-        run(fmax_d,   0x2a001053, ins_FormatR)
-        run(feq_d,    0xa2002053, ins_FormatR)
-        run(flt_d,    0xa2001053, ins_FormatR)
-        run(fle_d,    0xa2000053, ins_FormatR)
+
+    const std::vector<u16> &slots = tables.slots[op7 >> 2];
+    if ((ins_word & 3) != 3 || slots.empty())
+        return;
+    const u16 *c = &tables.chains[slots[((ins_word >> 12) & 7) | (ins_word >> 25) << 3]];
+    for (; *c != DECODE_NONE; c++)
+    {
+        const decode_entry &e = decode_list[*c];
+        if ((ins_word & e.mask) == e.match)
+        {
+            d->exec = e.exec;
+            d->op = e.op;
+#ifdef RV32_STATS
+            d->entry = *c;
+#endif
+            e.parse(ins_word, &d->fmt);
+            return;
+        }
     }
-    // fadd/fsub/fmul/fdiv — match funct7 only
-    ins_masked = ins_word & 0xfe00007f;
-    switch (ins_masked)
-    {
-        run(fadd_s, 0x00000053, ins_FormatR)
-        run(fsub_s, 0x08000053, ins_FormatR)
-        run(fmul_s, 0x10000053, ins_FormatR)
-        run(fdiv_s, 0x18000053, ins_FormatR)
-        run(fadd_d, 0x02000053, ins_FormatR)
-        run(fsub_d, 0x0a000053, ins_FormatR)
-        run(fmul_d, 0x12000053, ins_FormatR)
-        run(fdiv_d, 0x1a000053, ins_FormatR)
-    }
-
-    ins_masked = ins_word & 0xffffffff;
-    switch (ins_masked)
-    {
-        run(ebreak, 0x00100073, ins_FormatEmpty)
-        run(ecall, 0x00000073, ins_FormatEmpty)
-        run(mret, 0x30200073, ins_FormatEmpty)
-        run(sret, 0x10200073, ins_FormatEmpty)
-        run(uret, 0x00200073, ins_FormatEmpty)
-        run(wfi, 0x10500073, ins_FormatEmpty)
-    }
-
-    print_inst(cpu.pc, ins_word);
-    printf("Invalid instruction: %08x\n", ins_word);
-    exit(EXIT_FAILURE);
-    ret.trap.en = true;
-    ret.trap.type = trap_IllegalInstruction;
-    ret.trap.value = ins_word;
+}
+
+void Emulator::exec_illegal(Emulator &emu, DecodedIns *d, ins_ret *ret)
+{
+    emu.cpu.console->flush();
+    print_inst(emu.cpu.pc, d->ins_word);
+    printf("Invalid instruction: %08x\n", d->ins_word);
+    if (emu.exit_on_fault)
+        exit(EXIT_FAILURE);
+    emu.faulted = true;
+    emu.running = false;
+    ret->trap.en = true;
+    ret->trap.type = trap_IllegalInstruction;
+    ret->trap.value = d->ins_word;
+}
+
+// Run a decoded instruction against the current CPU state
+ins_ret Emulator::execute(DecodedIns *d)
+{
+    ins_ret ret = cpu.insReturnNoop();
+
+    if (UNLIKELY((d->flags & DECODE_FP_CHECK) && ((cpu.csr.data[CSR_MSTATUS] >> 13) & 3) == 0))
+    {
+        ret.trap.en    = true;
+        ret.trap.type  = trap_IllegalInstruction;
+        ret.trap.value = d->ins_word;
+        return ret;
+    }
+
+    d->exec(*this, d, &ret);
     return ret;
 }
 
+ins_ret Emulator::insSelect(u32 ins_word)
+{
+    DecodedIns d;
+    decode(ins_word, &d);
+    STATS_INC(cpu.stats.ins[d.entry]);
+    return execute(&d);
+}
+
+// Look up the decoded instruction at a physical PC, decoding on a miss.
+// Returns nullptr for fetches outside RAM, which are not cached.
+DecodedIns *Emulator::icacheFetch(u32 phys_pc)
+{
+    u32 phys = phys_pc & 0x7FFFFFFFu;
+    if ((phys_pc & 0x80000000u) == 0 || phys >= ram_size)
+        return nullptr;
+
+    u32 page = phys >> 12;
+    DecodedIns *entries = icache[page];
+    if ((cpu.page_flags[page] & PAGE_CODE) == 0)
+    {
+        // First fetch from this page, or it was written since it was decoded
+        if (entries == nullptr)
+            entries = icache[page] = (DecodedIns *)malloc(DECODED_PAGE_INS * sizeof(DecodedIns));
+        memset(entries, 0, DECODED_PAGE_INS * sizeof(DecodedIns));
+        cpu.pageSetFlags(phys, PAGE_CODE);
+    }
+
+    DecodedIns *d = &entries[(phys >> 2) & (DECODED_PAGE_INS - 1)];
+    if (d->exec == nullptr)
+        decode(cpu.memGetWord(phys_pc), d);
+    return d;
+}
+
+
 ////////////////////////////////////////////////////////////////
 // Emulator Functions
 ////////////////////////////////////////////////////////////////
 Emulator::Emulator(/* args */)
 {
+    memory = nullptr;
+    icache = nullptr;
+    smp = nullptr;
+    boot = nullptr;
 }
 
 Emulator::~Emulator()
 {
+    delete smp;
+#ifndef __EMSCRIPTEN__
+    terminalRestore();
+#endif
+    ramFree();
 }
 
-u8 Emulator::getFileSize(const char *path)
+///////////////////////////////////////
+// Guest RAM
+///////////////////////////////////////
+// Reserve mem_size bytes of guest RAM (no-op if already that size). Anonymous
+// pages cost host memory only once the guest touches them.
+bool Emulator::ramInit()
+{
+    if (memory != nullptr && ram_size == mem_size)
+        return true;
+    if (mem_size < RV32_MEM_SIZE_MIN || mem_size > RV32_MEM_SIZE_MAX ||
+        mem_size % RV32_PAGE_SIZE != 0)
+    {
+        fprintf(stderr, "ERRO: RAM size %u MiB is outside %u..%u MiB\n",
+                mem_size >> 20, RV32_MEM_SIZE_MIN >> 20, RV32_MEM_SIZE_MAX >> 20);
+        return false;
+    }
+    ramFree();
+
+#ifndef __EMSCRIPTEN__
+    void *p = mmap(nullptr, mem_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        perror("ERRO: guest RAM");
+        return false;
+    }
+    memory = (uint8_t *)p;
+#else
+    memory = (uint8_t *)calloc(1, mem_size);
+    if (memory == nullptr)
+        return false;
+#endif
+    ram_size = mem_size;
+    ram_file_backed = false;
+    icache = (DecodedIns **)calloc(ram_size / RV32_PAGE_SIZE, sizeof(DecodedIns *));
+    return true;
+}
+
+// Release guest RAM and the decoded pages indexed by it
+void Emulator::ramFree()
+{
+    if (icache != nullptr)
+    {
+        for (u32 i = 0; i < ram_size / RV32_PAGE_SIZE; i++)
+            free(icache[i]);
+        free(icache);
+        icache = nullptr;
+    }
+    // Other harts only borrow hart 0's RAM
+    if (memory != nullptr && boot == nullptr)
+    {
+#ifndef __EMSCRIPTEN__
+        munmap(memory, ram_size);
+#else
+        free(memory);
+#endif
+    }
+    memory = nullptr;
+    ram_size = 0;
+}
+
+// Zero all of RAM and hand its pages back to the host (same address, so host
+// pointers into RAM stay valid). Plain anonymous RAM is released with
+// madvise; file mappings are replaced with fresh anonymous pages.
+void Emulator::ramReset()
 {
+#ifndef __EMSCRIPTEN__
+#ifdef __linux__
+    // Private anonymous pages read back as zero after MADV_DONTNEED
+    if (!ram_file_backed && madvise(memory, ram_size, MADV_DONTNEED) == 0)
+        return;
+#endif
+    void *p = mmap(memory, ram_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    if (p != MAP_FAILED)
+    {
+        ram_file_backed = false;
+        return;
+    }
+    perror("WARN: guest RAM reset");
+#endif
+    memset(memory, 0, ram_size);
+}
+
+// Map `len` bytes of `fd` at `file_offset` copy-on-write over RAM at
+// `ram_offset`. Offsets must be host page aligned; bytes of the last page past
+// the end of the file read as zero. Returns false if the caller should copy
+// the data in instead.
+bool Emulator::ramMapFile(int fd, u64 file_offset, u32 ram_offset, u32 len)
+{
+#ifndef __EMSCRIPTEN__
+    u64 host_page = (u64)sysconf(_SC_PAGESIZE);
+    if (len == 0 || (file_offset | ram_offset) % host_page != 0 ||
+        (u64)ram_offset + len > (u64)ram_size)
+        return false;
+    void *p = mmap(memory + ram_offset, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_FIXED, fd, (off_t)file_offset);
+    if (p != MAP_FAILED)
+    {
+        ram_file_backed = true;
+        return true;
+    }
+    // MAP_FIXED failures can leave the range unmapped; put zero pages back
+    mmap(memory + ram_offset, len, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+#else
+    (void)fd;
+    (void)file_offset;
+    (void)ram_offset;
+    (void)len;
+#endif
+    return false;
+}
+
+// Map a raw boot image of at most `limit` bytes at the start of RAM
+bool Emulator::ramMapImage(const char *path, u32 limit)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
     struct stat st;
-    stat(path, &st);
-    return st.st_size;
+    bool ok = fstat(fd, &st) == 0 && st.st_size > 0 && (u64)st.st_size <= limit &&
+              ramMapFile(fd, 0, 0, (u32)st.st_size);
+    close(fd);
+    if (ok)
+        printf("INFO: Mapped Linux image: %ld bytes\n", (long)st.st_size);
+    return ok;
 }
 
-u8 Emulator::getMmapPtr(const char *path)
+u8 Emulator::getFileSize(const char *path)
 {
-    // TODO: implement mmap-based file loading
-    (void)path;
-    return 0;
+    struct stat st;
+    stat(path, &st);
+    return st.st_size;
 }
 
-void Emulator::initialize()
+bool Emulator::initialize()
 {
     printf("INFO: Emulator started\n");
 #ifndef __EMSCRIPTEN__
-    captureKeyboardInput();
+    terminalCapture();
+#endif
+    // The other harts stay stopped until hartsStart()
+    if (smp != nullptr)
+        smp->stop();
+    cpu.smp = nullptr;
+    ready_to_run = false;
+    faulted = false;
+    if (!ramInit())
+        return false;
+    ramReset();
+    // Decoded pages are stale after a reset; free them rather than keep them
+    for (u32 i = 0; i < ram_size / RV32_PAGE_SIZE; i++)
+    {
+        free(icache[i]);
+        icache[i] = nullptr;
+    }
+    // A reboot keeps counting from where the last run left off
+    retiredCount();
+    cpu.init(memory, ram_size, NULL, debugMode);
+    retired_clock = cpu.clock;
+#ifndef __EMSCRIPTEN__
+    // UART console I/O moves to a host thread from here on, or without
+    // console_thread to a queue the caller drains
+    bool console_ok;
+    if (console_thread)
+        console_ok = cpu.wakeInit() && cpu.console->open(console_in, console_out, cpu.wake_fd[1]);
+    else
+        console_ok = cpu.console->openLog(console_out);
+    if (!console_ok)
+    {
+        printf("ERRO: cannot open the console\n");
+        return false;
+    }
 #endif
-    cpu = RV32();
-    memory = (uint8_t *)malloc(MEM_SIZE);
-    cpu.init(memory, NULL, debugMode);
+    return true;
 }
 
 void Emulator::initializeElf(const char *path)
 {
-    initialize();
+    if (!initialize())
+        return;
     // Load ELF image
-    if (loadElf(path, strlen(path) + 1, memory, MEM_SIZE) != 0)
+    if (loadElf(path, strlen(path) + 1, memory, ram_size) != 0)
         return;
 
-    cpu.init(memory, NULL, debugMode);
+    cpu.init(memory, ram_size, NULL, debugMode);
+    hartsStart();
     elf_file_path = path;
     ready_to_run = true;
 }
 
 void Emulator::initializeElfDts(const char *elf_file, const char *dts_file)
 {
-    initialize();
+    if (!initialize())
+        return;
     // Load ELF image
-    if (loadElf(elf_file, strlen(elf_file) + 1, memory, MEM_SIZE) != 0)
+    if (loadElf(elf_file, strlen(elf_file) + 1, memory, ram_size) != 0)
         return;
 
     // cpu.init(memory, dts, debugMode);
+    hartsStart();
     elf_file_path = elf_file;
     ready_to_run = true;
 }
 
+///////////////////////////////////////
+// Device Tree
+///////////////////////////////////////
+// Flattened device tree tokens
+#define FDT_BEGIN_NODE 0x1
+#define FDT_END_NODE   0x2
+#define FDT_PROP       0x3
+#define FDT_NOP        0x4
+#define FDT_END        0x9
+
+static u32 fdtGet(const u8 *p)
+{
+    return ((u32)p[0] << 24) | ((u32)p[1] << 16) | ((u32)p[2] << 8) | p[3];
+}
+
+static void fdtSet(u8 *p, u32 v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// Offset of the token following the one at `pos`
+static u32 fdtSkip(const u8 *base, u32 pos)
+{
+    u32 token = fdtGet(base + pos);
+    if (token == FDT_BEGIN_NODE)
+        return pos + 4 + (((u32)strlen((const char *)base + pos + 4) + 4) & ~3u);
+    if (token == FDT_PROP)
+        return pos + 12 + ((fdtGet(base + pos + 4) + 3) & ~3u);
+    return pos + 4;
+}
+
+// Offset just past the end of the node starting at `node`
+static u32 fdtNodeEnd(const u8 *base, u32 node)
+{
+    int depth = 0;
+    u32 pos = node;
+    do
+    {
+        u32 token = fdtGet(base + pos);
+        if (token == FDT_BEGIN_NODE)
+            depth++;
+        else if (token == FDT_END_NODE)
+            depth--;
+        else if (token == FDT_END)
+            break;
+        pos = fdtSkip(base, pos);
+    } while (depth > 0);
+    return pos;
+}
+
+// First node named `name` in [pos, end), or 0
+static u32 fdtFind(const u8 *base, u32 pos, u32 end, const char *name)
+{
+    while (pos < end)
+    {
+        u32 token = fdtGet(base + pos);
+        if (token == FDT_END)
+            break;
+        if (token == FDT_BEGIN_NODE && strcmp((const char *)base + pos + 4, name) == 0)
+            return pos;
+        pos = fdtSkip(base, pos);
+    }
+    return 0;
+}
+
+// Property `name` of the node at `node` (not of its children): offset of its
+// FDT_PROP token, or 0
+static u32 fdtProp(const u8 *base, const char *strings, u32 node, const char *name)
+{
+    u32 pos = fdtSkip(base, node);
+    for (;;)
+    {
+        u32 token = fdtGet(base + pos);
+        if (token == FDT_PROP && strcmp(strings + fdtGet(base + pos + 8), name) == 0)
+            return pos;
+        if (token != FDT_PROP && token != FDT_NOP)
+            return 0;
+        pos = fdtSkip(base, pos);
+    }
+}
+
+static const char *fdtStrings(const std::vector<u8> &dtb)
+{
+    return (const char *)dtb.data() + fdtGet(dtb.data() + 12);
+}
+
+// Insert `len` bytes at `pos` and move the header offsets behind them
+static void fdtInsert(std::vector<u8> &dtb, u32 pos, const u8 *data, u32 len)
+{
+    dtb.insert(dtb.begin() + pos, data, data + len);
+    u8 *base = dtb.data();
+    u32 off_struct = fdtGet(base + 8);
+    u32 off_strings = fdtGet(base + 12);
+    fdtSet(base + 4, fdtGet(base + 4) + len); // totalsize
+    if (pos <= off_struct)
+        fdtSet(base + 8, off_struct + len);
+    else if (pos < off_strings)
+        fdtSet(base + 36, fdtGet(base + 36) + len); // size_dt_struct
+    if (pos < off_strings)
+        fdtSet(base + 12, off_strings + len);
+}
+
+// Phandles of hart h's cpu node and its interrupt controller (the default DTB
+// uses 1 and 2 for hart 0)
+#define DTB_CPU_PHANDLE(h)  ((h) == 0 ? 1u : 0x100u + 2u * (h))
+#define DTB_INTC_PHANDLE(h) ((h) == 0 ? 2u : 0x101u + 2u * (h))
+
+// Declare harts 1..harts-1 next to cpu@0: a copy of its node per hart, a
+// cpu-map core for each and their timer/software interrupts on the CLINT
+static void dtbAddHarts(std::vector<u8> &dtb, u32 harts)
+{
+    // The DTB window's msip slots for harts > 0 overlap the network TX
+    // buffer; point the kernel at the SiFive window instead
+    const char *strings = fdtStrings(dtb);
+    u32 clint = fdtFind(dtb.data(), fdtGet(dtb.data() + 8), fdtGet(dtb.data() + 12), "clint@11000000");
+    if (clint == 0)
+        return;
+    u32 reg = fdtProp(dtb.data(), strings, clint, "reg");
+    if (reg != 0 && fdtGet(dtb.data() + reg + 4) == 16)
+        fdtSet(dtb.data() + reg + 12 + 4, CLINT_MMIO_BASE);
+    u32 irqs = fdtProp(dtb.data(), strings, clint, "interrupts-extended");
+    if (irqs != 0)
+    {
+        u32 len = fdtGet(dtb.data() + irqs + 4);
+        std::vector<u8> cells((harts - 1) * 16);
+        for (u32 h = 1; h < harts; h++)
+        {
+            u8 *c = &cells[(h - 1) * 16];
+            fdtSet(c, DTB_INTC_PHANDLE(h));
+            fdtSet(c + 4, 3); // Machine software interrupt
+            fdtSet(c + 8, DTB_INTC_PHANDLE(h));
+            fdtSet(c + 12, 7); // Machine timer interrupt
+        }
+        fdtSet(dtb.data() + irqs + 4, len + (u32)cells.size());
+        fdtInsert(dtb, irqs + 12 + len, cells.data(), (u32)cells.size());
+    }
+
+    // Copies are inserted right after the original in reverse, so they end up
+    // in hart order. Node names keep their length ("cpu@N", "coreN").
+    u32 core = fdtFind(dtb.data(), fdtGet(dtb.data() + 8), fdtGet(dtb.data() + 12), "core0");
+    if (core != 0)
+    {
+        u32 core_end = fdtNodeEnd(dtb.data(), core);
+        std::vector<u8> node(dtb.begin() + core, dtb.begin() + core_end);
+        for (u32 h = harts - 1; h >= 1; h--)
+        {
+            std::vector<u8> copy = node;
+            copy[8] = (u8)('0' + h);
+            strings = fdtStrings(dtb);
+            u32 cpu = fdtProp(copy.data(), strings, 0, "cpu");
+            if (cpu != 0)
+                fdtSet(&copy[cpu + 12], DTB_CPU_PHANDLE(h));
+            fdtInsert(dtb, core_end, copy.data(), (u32)copy.size());
+        }
+    }
+
+    u32 cpu0 = fdtFind(dtb.data(), fdtGet(dtb.data() + 8), fdtGet(dtb.data() + 12), "cpu@0");
+    if (cpu0 != 0)
+    {
+        u32 cpu0_end = fdtNodeEnd(dtb.data(), cpu0);
+        std::vector<u8> node(dtb.begin() + cpu0, dtb.begin() + cpu0_end);
+        for (u32 h = harts - 1; h >= 1; h--)
+        {
+            std::vector<u8> copy = node;
+            copy[8] = (u8)('0' + h);
+            strings = fdtStrings(dtb);
+            u32 prop = fdtProp(copy.data(), strings, 0, "reg");
+            if (prop != 0)
+                fdtSet(&copy[prop + 12], h);
+            prop = fdtProp(copy.data(), strings, 0, "phandle");
+            if (prop != 0)
+                fdtSet(&copy[prop + 12], DTB_CPU_PHANDLE(h));
+            u32 intc = fdtFind(copy.data(), fdtSkip(copy.data(), 0), (u32)copy.size(), "interrupt-controller");
+            prop = intc ? fdtProp(copy.data(), strings, intc, "phandle") : 0;
+            if (prop != 0)
+                fdtSet(&copy[prop + 12], DTB_INTC_PHANDLE(h));
+            fdtInsert(dtb, cpu0_end, copy.data(), (u32)copy.size());
+        }
+    }
+}
+
+// Copy the default DTB, sized for `usable` bytes of RAM at 0x80000000 and
+// `harts` harts. The framebuffer is reserved when it lies inside that RAM and
+// dropped otherwise.
+static std::vector<u8> dtbBuild(u32 usable, u32 harts)
+{
+    std::vector<u8> dtb(default64mbdtb, default64mbdtb + sizeof(default64mbdtb));
+    if (harts > 1)
+        dtbAddHarts(dtb, harts);
+
+    u8 *base = dtb.data();
+    u32 off_struct = fdtGet(base + 8);
+    u32 off_strings = fdtGet(base + 12);
+    const char *strings = (const char *)base + off_strings;
+
+    // reg = <addr_hi addr_lo size_hi size_lo> (#address/#size-cells = 2)
+    u32 memory = fdtFind(base, off_struct, off_strings, "memory@80000000");
+    u32 reg = memory ? fdtProp(base, strings, memory, "reg") : 0;
+    if (reg != 0 && fdtGet(base + reg + 4) == 16)
+    {
+        fdtSet(base + reg + 12 + 8, 0);
+        fdtSet(base + reg + 12 + 12, usable);
+    }
+
+    u32 fb = fdtFind(base, off_struct, off_strings, "framebuffer@84000000");
+    reg = fb ? fdtProp(base, strings, fb, "reg") : 0;
+    if (reg == 0 || fdtGet(base + reg + 4) != 16)
+        return dtb;
+    u32 fb_addr = fdtGet(base + reg + 12 + 4);
+    u32 fb_size = fdtGet(base + reg + 12 + 12);
+    if (fb_addr >= 0x80000000u && (u64)fb_addr - 0x80000000u + fb_size <= usable)
+    {
+        // Keep the kernel's allocator off the framebuffer: add a /memreserve/
+        // entry in front of the map's terminator
+        u8 entry[16] = {0};
+        fdtSet(entry + 4, fb_addr);
+        fdtSet(entry + 12, fb_size);
+        fdtInsert(dtb, fdtGet(base + 16), entry, sizeof(entry));
+    }
+    else
+    {
+        u32 fb_end = fdtNodeEnd(base, fb);
+        for (u32 i = fb; i < fb_end; i += 4)
+            fdtSet(base + i, FDT_NOP);
+    }
+    return dtb;
+}
+
+// Whether `image` is a Linux kernel built without CONFIG_SMP: its banner
+// ("Linux version ... #1 SMP ...") names SMP only in SMP kernels. Such a
+// kernel does not park the other harts, which then run it alongside hart 0.
+// Images without a banner are left to handle the harts themselves.
+static bool linuxUniprocessor(const u8 *image, u32 size)
+{
+    const char banner[] = "Linux version ";
+    const u8 *p = (const u8 *)memmem(image, size, banner, sizeof(banner) - 1);
+    if (p == nullptr)
+        return false;
+    const u8 *end = (const u8 *)memchr(p, '\n', size - (u32)(p - image));
+    if (end == nullptr)
+        return false;
+    return memmem(p, (size_t)(end - p), " SMP ", 5) == nullptr;
+}
+
 void Emulator::initializeBin(const char *path)
 {
-    initialize();
-    // Zero memory for a clean boot
-    memset(memory, 0, MEM_SIZE);
+    if (!initialize())
+        return;
 
-    // Load Linux kernel binary at memory[0] (maps to CPU VA 0x80000000)
-    if (loadLinuxImage(path, strlen(path) + 1, memory, MEM_SIZE) != 0)
+    // The DTB goes in the last page(s) of RAM, out of the kernel's view. The
+    // RAM size it describes only decides whether it gets a 16-byte
+    // framebuffer reservation, so size it once up front.
+    u32 harts = hart_count < 1 ? 1 : hart_count > SMP_HARTS_MAX ? SMP_HARTS_MAX : hart_count;
+    u32 dtb_room = (u32)dtbBuild(ram_size, harts).size() + 16;
+    u32 usable = (ram_size - dtb_room) & ~(RV32_PAGE_SIZE - 1);
+
+    // Load Linux kernel binary at memory[0] (maps to CPU VA 0x80000000),
+    // mapped copy-on-write from the file when possible
+    if (!ramMapImage(path, usable) &&
+        loadLinuxImage(path, strlen(path) + 1, memory, usable) != 0)
+        return;
+    if (harts > 1 && linuxUniprocessor(memory, usable))
+    {
+        printf("ERRO: %s is a uniprocessor kernel; run it without --smp\n", path);
         return;
+    }
 
-    // Place default DTB at end of RAM
-    uint32_t dtb_size   = (uint32_t)sizeof(default64mbdtb);
-    uint32_t dtb_offset = (uint32_t)MEM_SIZE - dtb_size;
-    memcpy(memory + dtb_offset, default64mbdtb, dtb_size);
-
-    // Patch DTB memory-size field (offset 0x13c contains magic 0x00c0ff03)
-    // uint32_t *dtb_u32 = (uint32_t *)(memory + dtb_offset);
-    // if (dtb_u32[0x13c / 4] == 0x00c0ff03u)
-    // {
-    //     uint32_t v = dtb_offset; // usable RAM = offset of DTB from base
-    //     dtb_u32[0x13c / 4] = (v >> 24) |
-    //                           (((v >> 16) & 0xff) << 8) |
-    //                           (((v >>  8) & 0xff) << 16) |
-    //                           ((v & 0xff) << 24);
-    // }
+    std::vector<u8> dtb = dtbBuild(usable, harts);
+    u32 dtb_offset = (ram_size - (u32)dtb.size()) & ~7u;
+    memcpy(memory + dtb_offset, dtb.data(), dtb.size());
 
     // Re-init CPU for Linux boot
-    cpu.init(memory, NULL, debugMode);
+    cpu.init(memory, ram_size, NULL, debugMode);
     cpu.xreg[10] = 0;                        // hart ID
     cpu.xreg[11] = 0x80000000u + dtb_offset; // DTB virtual address
+    hartsStart();
 
     bin_file_path = path;
     ready_to_run = true;
 }
 
+// Load a raw program at the start of RAM (0x80000000), without a device
+// tree; for built-in microbenchmarks
+void Emulator::initializeProgram(const u32 *words, u32 count)
+{
+    if (!initialize())
+        return;
+    if ((u64)count * 4 > ram_size)
+    {
+        printf("ERRO: program does not fit in RAM\n");
+        return;
+    }
+    memcpy(memory, words, count * 4);
+    cpu.init(memory, ram_size, NULL, debugMode);
+    ready_to_run = true;
+}
+
+void Emulator::initializeSnapshot(const char *path)
+{
+    // The snapshot decides the RAM size
+    u32 size = snapshotMemSize(path);
+    if (size == 0)
+        return;
+    mem_size = size;
+    if (hart_count > 1)
+        printf("WARN: Snapshots hold a single hart; restoring with 1 hart\n");
+    if (!initialize())
+        return;
+    if (!snapshotLoad(*this, path))
+        return;
+    retired_clock = cpu.clock;
+    ready_to_run = true;
+}
+
+
 
+// Set this Emulator up as hart `id` of `hart0`'s machine: it borrows hart 0's
+// RAM and keeps its own decode cache (see smp.h)
+void Emulator::initializeHart(Emulator &hart0, u32 id)
+{
+    if (icache == nullptr || ram_size != hart0.ram_size)
+    {
+        boot = &hart0;
+        ramFree();
+        icache = (DecodedIns **)calloc(hart0.ram_size / RV32_PAGE_SIZE, sizeof(DecodedIns *));
+    }
+    else
+    {
+        for (u32 i = 0; i < ram_size / RV32_PAGE_SIZE; i++)
+        {
+            free(icache[i]);
+            icache[i] = nullptr;
+        }
+    }
+    boot = &hart0;
+    memory = hart0.memory;
+    ram_size = hart0.ram_size;
+    mem_size = hart0.mem_size;
+    wfi_sleep_max = hart0.wfi_sleep_max;
+    debugMode = false;
+    cpu.initHart(hart0.cpu, id);
+}
+
+// Start harts 1..hart_count-1 once hart 0 is set up to boot
+void Emulator::hartsStart()
+{
+#ifndef __EMSCRIPTEN__
+    if (hart_count <= 1)
+        return;
+    if (smp == nullptr)
+        smp = new Smp(*this);
+    smp->start(hart_count);
+#endif
+}
 
 void Emulator::emulate()
 {
@@ -1496,14 +2133,18 @@ void Emulator::emulate()
         u32 phys_pc = cpu.mmuTranslate(&ret, cpu.pc, MMU_ACCESS_FETCH);
         if (!ret.trap.en)
         {
-            ins_word = cpu.memGetWord(phys_pc);
-            ret = insSelect(ins_word);
-
-            if (ret.csr_write && !ret.trap.en)
-                cpu.setCsr(ret.csr_write, ret.csr_val, &ret);
-
-            if (!ret.trap.en && ret.write_reg < 32 && ret.write_reg > 0)
-                cpu.xreg[ret.write_reg] = ret.write_val;
+            DecodedIns *d = icacheFetch(phys_pc);
+            if (d != nullptr)
+            {
+                ins_word = d->ins_word;
+                STATS_INC(cpu.stats.ins[d->entry]);
+                ret = execute(d);
+            }
+            else
+            {
+                ins_word = cpu.memGetWord(phys_pc);
+                ret = insSelect(ins_word);
+            }
         }
     }
     else
@@ -1516,66 +2157,300 @@ void Emulator::emulate()
     if (debugMode)
         print_inst(cpu.pc, ins_word);
 
-    // Handle CLINT MSIP
-    if (cpu.clint.msip)
-        cpu.csr.data[CSR_MIP] |= MIP_MSIP;
+    retire(&ret);
+}
 
-    // Update CLINT mtime from wall-clock — throttled to every 1024 instructions
-    // to avoid a gettimeofday() syscall on every emulated instruction.
-    if ((cpu.clock & 0x3FF) == 0)
+// Run up to `budget` instructions (at least 1) straight from the decoded page
+// cache, polling devices and interrupts once at the end instead of after every
+// instruction. Fall-through and branches that stay on the current page chain
+// directly to the next decoded entry; traps, SYSTEM and fence instructions,
+// device accesses, leaving the page or a store into it end the block.
+//
+// Dispatch is threaded: the common integer instructions (DecodedIns::op) each
+// have a label that writes rd directly and jumps straight on to the next
+// instruction's label. GCC and Clang (Emscripten included) take the label
+// addresses; other compilers get a switch. Everything else goes through
+// execute() and its ins_ret.
+void Emulator::emulateBlock(u32 budget)
+{
+    if (debugMode || (cpu.pc & 0x3) != 0)
     {
-        struct timeval now;
-        gettimeofday(&now, NULL);
-        int64_t elapsed_usec = ((int64_t)now.tv_sec  - cpu.start_time_sec)  * 1000000LL
-                             + ((int64_t)now.tv_usec - cpu.start_time_usec);
-        uint64_t mtime = (uint64_t)elapsed_usec;
-        cpu.clint.mtime_lo = (u32)(mtime & 0xFFFFFFFFu);
-        cpu.clint.mtime_hi = (u32)(mtime >> 32);
+        emulate();
+        return;
     }
 
-    // Set MTIP when mtime >= mtimecmp (guard: don't fire when mtimecmp == 0)
-    if ((cpu.clint.mtimecmp_lo != 0 || cpu.clint.mtimecmp_hi != 0) &&
-        (cpu.clint.mtime_hi > cpu.clint.mtimecmp_hi ||
-         (cpu.clint.mtime_hi == cpu.clint.mtimecmp_hi &&
-          cpu.clint.mtime_lo >= cpu.clint.mtimecmp_lo)))
+    // Stop at the next device event so it is handled on time
+    budget = cpu.schedBudget(budget);
+    ins_ret ret = cpu.insReturnNoop();
+
+    u32 phys_pc = cpu.mmuTranslate(&ret, cpu.pc, MMU_ACCESS_FETCH);
+    DecodedIns *d = ret.trap.en ? nullptr : icacheFetch(phys_pc);
+    if (d == nullptr)
     {
-        cpu.csr.data[CSR_MIP] |= MIP_MTIP;
+        // Fetch fault or code outside RAM
+        emulate();
+        return;
+    }
+
+    DecodedIns *page = d - ((phys_pc >> 2) & (DECODED_PAGE_INS - 1));
+    u8 *flags = &cpu.page_flags[(phys_pc & 0x7FFFFFFFu) >> 12];
+    u32 *x = cpu.xreg;
+    u32 next_pc;
+    cpu.mmio_access = false;
+
+#if defined(__GNUC__)
+#define OP_LABEL(name, ...) &&op_##name,
+    static const void *const dispatch[OP_COUNT] = {
+        &&op_CALL,
+        OPS_R(OP_LABEL) OPS_SHIFT(OP_LABEL) OPS_I(OP_LABEL) OPS_B(OP_LABEL)
+        OPS_LOAD(OP_LABEL) OPS_STORE(OP_LABEL)
+        &&op_lui,
+        &&op_auipc,
+        &&op_jal,
+        &&op_jalr,
+    };
+#undef OP_LABEL
+#define OP_CASE(name) op_##name
+#define DISPATCH()                              \
+    {                                           \
+        STATS_INC(cpu.stats.ins[d->entry]);     \
+        goto *dispatch[d->op];                  \
+    }
+#else
+#define OP_CASE(name) case OP_##name
+#define DISPATCH()                              \
+    {                                           \
+        STATS_INC(cpu.stats.ins[d->entry]);     \
+        goto dispatch;                          \
     }
+#endif
+
+// Write rd; x0 stays zero
+#define SET_RD(val)        \
+    {                      \
+        x[ins.rd] = (val); \
+        x[0] = 0;          \
+    }
+// Go on at `target`, chaining to it while it is on the same, still-decoded
+// page and the budget lasts
+#define NEXT(target)                                                                 \
+    {                                                                                \
+        next_pc = (target);                                                          \
+        if (--budget == 0 || ((next_pc ^ cpu.pc) & ~0xfffu) != 0 ||                  \
+            (next_pc & 0x3) != 0 || (*flags & PAGE_CODE) == 0)                       \
+            goto block_end;                                                          \
+        cpu.pc = next_pc;                                                            \
+        d = page + ((next_pc & 0xfffu) >> 2);                                        \
+        if (d->exec == nullptr)                                                      \
+            decode(cpu.memGetWord((phys_pc & ~0xfffu) | (next_pc & 0xfffu)), d);     \
+        cpu.clock++;                                                                 \
+        DISPATCH();                                                                  \
+    }
+// After a load or store: a device access ends the block
+#define NEXT_MEM()                  \
+    {                               \
+        if (cpu.mmio_access)        \
+        {                           \
+            next_pc = cpu.pc + 4;   \
+            goto block_end;         \
+        }                           \
+        NEXT(cpu.pc + 4)            \
+    }
+
+#define RUN_R(name, expr)                          \
+    OP_CASE(name):                                 \
+    {                                              \
+        const FormatR &ins = d->fmt.as_FormatR;    \
+        u32 a = x[ins.rs1];                        \
+        u32 b = x[ins.rs2];                        \
+        SET_RD(expr)                               \
+        NEXT(cpu.pc + 4)                           \
+    }
+#define RUN_SHIFT(name, expr)                      \
+    OP_CASE(name):                                 \
+    {                                              \
+        const FormatR &ins = d->fmt.as_FormatR;    \
+        u32 a = x[ins.rs1];                        \
+        u32 b = ins.rs2;                           \
+        SET_RD(expr)                               \
+        NEXT(cpu.pc + 4)                           \
+    }
+#define RUN_I(name, expr)                          \
+    OP_CASE(name):                                 \
+    {                                              \
+        const FormatI &ins = d->fmt.as_FormatI;    \
+        u32 a = x[ins.rs1];                        \
+        u32 b = ins.imm;                           \
+        SET_RD(expr)                               \
+        NEXT(cpu.pc + 4)                           \
+    }
+#define RUN_B(name, cond)                           \
+    OP_CASE(name):                                  \
+    {                                               \
+        const FormatB &ins = d->fmt.as_FormatB;     \
+        u32 a = x[ins.rs1];                         \
+        u32 b = x[ins.rs2];                         \
+        bool taken = (cond);                        \
+        STATS_INC(cpu.stats.branches[taken]);       \
+        NEXT(taken ? cpu.pc + ins.imm : cpu.pc + 4) \
+    }
+#define RUN_LOAD(name, size, bits)                                     \
+    OP_CASE(name):                                                     \
+    {                                                                  \
+        const FormatI &ins = d->fmt.as_FormatI;                        \
+        u32 val = cpu.vmRead(&ret, x[ins.rs1] + ins.imm, size);        \
+        if (UNLIKELY(ret.trap.en))                                     \
+            goto block_exit;                                           \
+        SET_RD(loadExtend(val, bits))                                  \
+        NEXT_MEM()                                                     \
+    }
+#define RUN_STORE(name, size)                                          \
+    OP_CASE(name):                                                     \
+    {                                                                  \
+        const FormatS &ins = d->fmt.as_FormatS;                        \
+        cpu.vmWrite(&ret, x[ins.rs1] + ins.imm, x[ins.rs2], size);     \
+        if (UNLIKELY(ret.trap.en))                                     \
+            goto block_exit;                                           \
+        NEXT_MEM()                                                     \
+    }
+
+    cpu.clock++;
+    DISPATCH();
+
+#if !defined(__GNUC__)
+dispatch:
+    switch (d->op)
+    {
+#endif
+    OP_CASE(CALL):
+    {
+        ret = execute(d);
+        if (UNLIKELY(ret.trap.en) || (d->flags & DECODE_BLOCK_END) || cpu.mmio_access)
+            goto block_exit;
+        NEXT(ret.pc_val)
+    }
+
+    OPS_R(RUN_R)
+    OPS_SHIFT(RUN_SHIFT)
+    OPS_I(RUN_I)
+    OPS_B(RUN_B)
+    OPS_LOAD(RUN_LOAD)
+    OPS_STORE(RUN_STORE)
+
+    OP_CASE(lui):
+    {
+        const FormatU &ins = d->fmt.as_FormatU;
+        SET_RD(ins.imm)
+        NEXT(cpu.pc + 4)
+    }
+    OP_CASE(auipc):
+    {
+        const FormatU &ins = d->fmt.as_FormatU;
+        SET_RD(cpu.pc + ins.imm)
+        NEXT(cpu.pc + 4)
+    }
+    OP_CASE(jal):
+    {
+        const FormatJ &ins = d->fmt.as_FormatJ;
+        SET_RD(cpu.pc + 4)
+        NEXT(cpu.pc + ins.imm)
+    }
+    OP_CASE(jalr):
+    {
+        const FormatI &ins = d->fmt.as_FormatI;
+        u32 target = x[ins.rs1] + ins.imm;
+        SET_RD(cpu.pc + 4)
+        NEXT(target)
+    }
+#if !defined(__GNUC__)
+    }
+#endif
+
+#undef RUN_R
+#undef RUN_SHIFT
+#undef RUN_I
+#undef RUN_B
+#undef RUN_LOAD
+#undef RUN_STORE
+#undef NEXT_MEM
+#undef NEXT
+#undef SET_RD
+#undef DISPATCH
+#undef OP_CASE
+
+block_end:
+    // Ended between instructions: the last one retired cleanly
+    ret.pc_val = next_pc;
+block_exit:
+    retire(&ret);
+}
+
+// Run due device events, take pending traps/interrupts and advance the PC
+// after the instruction(s) just executed
+// Instructions retired so far. cpu.clock is 32 bits: each call adds the
+// clock delta since the previous one, so callers that run in blocks and call
+// this at least every 2^32 instructions get a count that doesn't wrap.
+u64 Emulator::retiredCount()
+{
+    retired += (u32)(cpu.clock - retired_clock);
+    retired_clock = cpu.clock;
+    return retired;
+}
 
-    // UART tick + external interrupt
-    cpu.uartTick();
-    u32 cur_mip = cpu.readCsrRaw(CSR_MIP);
-    if (!(cur_mip & MIP_SEIP))
+void Emulator::retire(ins_ret *ret)
+{
+    // Device events (timer, UART, network) whose deadline has passed,
+    // including those device accesses posted (see RV32::scheduleNow)
+    if (__atomic_load_n(&cpu.sched_post, __ATOMIC_RELAXED) != 0)
+        cpu.schedTake();
+    if (cpu.schedDue())
+        cpu.schedRun();
+
+    // WFI with no enabled interrupt pending: sleep the host until one can be
+    if (cpu.wfi)
     {
+        cpu.wfi = false;
+        u32 pending = cpu.csr.data[CSR_MIP];
+        if (__atomic_load_n(&cpu.clint.msip, __ATOMIC_RELAXED))
+            pending |= MIP_MSIP;
+        if (cpu.clint.mtip)
+            pending |= MIP_MTIP;
         if (cpu.uart.interrupting)
-        {
+            pending |= MIP_SEIP;
+        if (wfi_sleep_max != 0 && (pending & cpu.csr.data[CSR_MIE]) == 0)
+            idled |= cpu.idle(wfi_sleep_max);
+    }
+
+    // Another hart wrote our mtimecmp
+    if (__atomic_load_n(&cpu.timer_dirty, __ATOMIC_ACQUIRE))
+        cpu.timerReload();
+
+    // Handle CLINT MSIP / MTIP. MSIP follows msip, which other harts set and
+    // clear for IPIs.
+    if (__atomic_load_n(&cpu.clint.msip, __ATOMIC_ACQUIRE))
+        cpu.csr.data[CSR_MIP] |= MIP_MSIP;
+    else
+        cpu.csr.data[CSR_MIP] &= ~MIP_MSIP;
+    if (cpu.clint.mtip)
+        cpu.csr.data[CSR_MIP] |= MIP_MTIP;
+
+    // UART external interrupt (a one-retire pulse set by uartTick)
+    if (cpu.uart.interrupting)
+    {
+        u32 cur_mip = cpu.readCsrRaw(CSR_MIP);
+        if (!(cur_mip & MIP_SEIP))
             cpu.writeCsrRaw(CSR_MIP, cur_mip | MIP_SEIP);
-        }
-        else if (cpu.net.rx_ready)
-        {
-            // Network RX interrupt (no-op when net not connected)
-            uint8_t *net_data = nullptr;
-            uint32_t net_data_len = 0;
-            if (net_recv(&net_data, &net_data_len))
-            {
-                cpu.writeCsrRaw(CSR_MIP, cur_mip | MIP_SEIP);
-                if (net_data_len > 4096u - sizeof(u32))
-                    net_data_len = 4096u - sizeof(u32);
-                *((u32 *)cpu.net.netrx) = net_data_len;
-                memcpy(cpu.net.netrx + sizeof(u32), net_data, net_data_len);
-                cpu.net.rx_ready = 0;
-                free(net_data);
-            }
-        }
+        cpu.uart.interrupting = false;
     }
 
-    cpu.handleIrqAndTrap(&ret);
+    cpu.handleIrqAndTrap(ret);
 
     // Handle SYSCON poweroff/reboot
     if (cpu.syscon_cmd != 0)
     {
         u32 cmd = cpu.syscon_cmd;
         cpu.syscon_cmd = 0;
+        cpu.console->flush();
         if (cmd == 0x5555)
         {
             printf("INFO: SYSCON POWEROFF\n");
@@ -1591,5 +2466,152 @@ void Emulator::emulate()
     }
 
     // Advance PC (ret.pc_val defaults to pc+4)
-    cpu.pc = ret.pc_val;
-}
\ No newline at end of file
+    cpu.pc = ret->pc_val;
+}
+
+#ifdef RV32_STATS
+///////////////////////////////////////
+// Statistics
+///////////////////////////////////////
+static const char *const stats_exception_names[16] = {
+    "instruction_misaligned", "instruction_access_fault", "illegal_instruction", "breakpoint",
+    "load_misaligned", "load_access_fault", "store_misaligned", "store_access_fault",
+    "ecall_u", "ecall_s", nullptr, "ecall_m",
+    "instruction_page_fault", "load_page_fault", nullptr, "store_page_fault",
+};
+
+static const char *const stats_interrupt_names[16] = {
+    "user_software", "supervisor_software", nullptr, "machine_software",
+    "user_timer", "supervisor_timer", nullptr, "machine_timer",
+    "user_external", "supervisor_external", nullptr, "machine_external",
+};
+
+typedef struct {
+    const char *section;
+    std::string name;
+    u64 count;
+} stats_row;
+
+// Add `count` to the (section, name) row, appending it if there is none
+static void statsAdd(std::vector<stats_row> &rows, const char *section, const std::string &name, u64 count)
+{
+    for (stats_row &r : rows)
+    {
+        if (strcmp(r.section, section) == 0 && r.name == name)
+        {
+            r.count += count;
+            return;
+        }
+    }
+    rows.push_back({section, name, count});
+}
+
+// Nonzero counters of one trap kind, by cause
+static void statsAddCauses(std::vector<stats_row> &rows, const char *section,
+                           const char *const names[16], const u64 counts[16])
+{
+    for (u32 i = 0; i < 16; i++)
+    {
+        if (counts[i] == 0)
+            continue;
+        char cause[16];
+        snprintf(cause, sizeof(cause), "cause_%u", i);
+        statsAdd(rows, section, names[i] ? names[i] : cause, counts[i]);
+    }
+}
+
+bool Emulator::statsWrite(const char *path)
+{
+    // Sum the harts' counters; devices by name, since the CLINT has two windows
+    rv32_stats sum;
+    memset(&sum, 0, sizeof(sum));
+    std::vector<stats_row> mmio_reads, mmio_writes;
+    u32 harts = smp != nullptr ? smp->count : 1;
+    for (u32 h = 0; h < harts; h++)
+    {
+        const RV32 &c = h == 0 ? cpu : *smp->cpu[h];
+        for (u32 i = 0; i < STATS_INS_MAX; i++)
+            sum.ins[i] += c.stats.ins[i];
+        for (u32 i = 0; i < 16; i++)
+        {
+            sum.exceptions[i] += c.stats.exceptions[i];
+            sum.interrupts[i] += c.stats.interrupts[i];
+        }
+        sum.branches[0] += c.stats.branches[0];
+        sum.branches[1] += c.stats.branches[1];
+        sum.page_walks += c.stats.page_walks;
+
+        for (u32 i = 0; i < c.bus.deviceCount(); i++)
+        {
+            const mmio_device *dev = c.bus.device(i);
+            statsAdd(mmio_reads, "mmio_read", dev->name, dev->reads);
+            statsAdd(mmio_writes, "mmio_write", dev->name, dev->writes);
+        }
+        statsAdd(mmio_reads, "mmio_read", "unmapped", c.bus.unmapped_reads);
+        statsAdd(mmio_writes, "mmio_write", "unmapped", c.bus.unmapped_writes);
+    }
+
+    // Instruction mix, most executed first
+    std::vector<u32> order;
+    for (u32 i = 0; i <= DECODE_ENTRIES; i++)
+    {
+        if (sum.ins[i] != 0)
+            order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&sum](u32 a, u32 b) { return sum.ins[a] > sum.ins[b]; });
+
+    std::vector<stats_row> rows;
+    for (u32 i : order)
+    {
+        // Mnemonic from the handler name: fcvt_w_s -> fcvt.w.s
+        std::string name = i < DECODE_ENTRIES ? decode_list[i].name : "illegal";
+        std::replace(name.begin(), name.end(), '_', '.');
+        rows.push_back({"instruction", name, sum.ins[i]});
+    }
+    rows.push_back({"branch", "taken", sum.branches[1]});
+    rows.push_back({"branch", "not_taken", sum.branches[0]});
+    statsAddCauses(rows, "exception", stats_exception_names, sum.exceptions);
+    statsAddCauses(rows, "interrupt", stats_interrupt_names, sum.interrupts);
+    rows.push_back({"mmu", "page_walks", sum.page_walks});
+    rows.insert(rows.end(), mmio_reads.begin(), mmio_reads.end());
+    rows.insert(rows.end(), mmio_writes.begin(), mmio_writes.end());
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "ERRO: stats: cannot write %s\n", path);
+        return false;
+    }
+    size_t len = strlen(path);
+    if (len >= 5 && strcmp(path + len - 5, ".json") == 0)
+    {
+        // {"section": {"name": count, ...}, ...}; a section's rows are adjacent
+        const char *section = nullptr;
+        fprintf(f, "{");
+        for (const stats_row &r : rows)
+        {
+            if (section == nullptr || strcmp(section, r.section) != 0)
+            {
+                fprintf(f, "%s\n  \"%s\": {", section ? "\n  }," : "", r.section);
+                section = r.section;
+            }
+            else
+                fprintf(f, ",");
+            fprintf(f, "\n    \"%s\": %" PRIu64, r.name.c_str(), r.count);
+        }
+        fprintf(f, "%s\n}\n", section ? "\n  }" : "");
+    }
+    else
+    {
+        fprintf(f, "section,name,count\n");
+        for (const stats_row &r : rows)
+            fprintf(f, "%s,%s,%" PRIu64 "\n", r.section, r.name.c_str(), r.count);
+    }
+
+    bool ok = !ferror(f);
+    fclose(f);
+    fprintf(stderr, "INFO: stats: %u hart(s) -> %s\n", harts, path);
+    return ok;
+}
+#endif
@@ -0,0 +1,225 @@
+#include "emu_thread.h"
+#include "emu.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+EmuThread::EmuThread(Emulator &emu) : emu(emu)
+{
+    head = 0;
+    tail = 0;
+    seq = 0;
+    memset(&state, 0, sizeof(state));
+    for (u32 i = 0; i < EMU_FB_WORDS; i++)
+        fb_dirty[i] = 0;
+    next_tick = 0;
+    quit = false;
+    started = false;
+}
+
+EmuThread::~EmuThread()
+{
+    stop();
+}
+
+void EmuThread::start()
+{
+    if (started)
+        return;
+    publish();
+#ifndef __EMSCRIPTEN__
+    quit = false;
+    thread = std::thread(&EmuThread::threadLoop, this);
+    started = true;
+#endif
+}
+
+void EmuThread::stop()
+{
+    if (!started)
+        return;
+    quit = true;
+#ifndef __EMSCRIPTEN__
+    emu.cpu.wake();
+    thread.join();
+#endif
+    started = false;
+}
+
+void EmuThread::threadLoop()
+{
+    while (!quit.load(std::memory_order_relaxed))
+    {
+        // A sleeping guest gives the host back its time inside WFI; a stopped
+        // or throttled one is polled for commands
+        service(10000);
+        if (!emu.running || !emu.ready_to_run || emu.clk_freq_sel != -1)
+            usleep(EMU_THREAD_IDLE_USEC);
+    }
+}
+
+///////////////////////////////////////
+// Commands
+///////////////////////////////////////
+bool EmuThread::push(const emu_cmd &cmd)
+{
+    u32 t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) >= EMU_CMD_RING)
+        return false;
+    ring[t % EMU_CMD_RING] = cmd;
+    tail.store(t + 1, std::memory_order_release);
+    // Cut a WFI sleep short so input is seen right away
+    if (started)
+        emu.cpu.wake();
+    return true;
+}
+
+bool EmuThread::push(emu_cmd_type type, s32 value, bool flag, const char *path)
+{
+    emu_cmd cmd;
+    cmd.type = type;
+    cmd.value = value;
+    cmd.flag = flag;
+    snprintf(cmd.path, sizeof(cmd.path), "%s", path ? path : "");
+    return push(cmd);
+}
+
+void EmuThread::runCommand(const emu_cmd &cmd)
+{
+    switch (cmd.type)
+    {
+    case EMU_CMD_TOGGLE:
+        if (emu.ready_to_run)
+            emu.running = !emu.running;
+        else
+            printf("Not ready to execute. Memory maybe corrupted\n");
+        break;
+    case EMU_CMD_STEP:
+        if (!emu.running && emu.ready_to_run)
+            emu.emulate();
+        else if (!emu.ready_to_run)
+            printf("Not ready to execute. Memory maybe corrupted\n");
+        else
+            printf("Cannot step while running. Please stop the emulator first.\n");
+        break;
+    case EMU_CMD_RESET:
+        emu.running = false;
+        emu.ready_to_run = false;
+        emu.initialize();
+        break;
+    case EMU_CMD_LOAD_ELF:
+        emu.initializeElf(cmd.path);
+        break;
+    case EMU_CMD_LOAD_BIN:
+        emu.initializeBin(cmd.path);
+        break;
+    case EMU_CMD_KEY:
+        emu.cpu.kbdPush((u8)cmd.value, cmd.flag);
+        break;
+    case EMU_CMD_DEBUG:
+        emu.debugMode = cmd.flag;
+        break;
+    case EMU_CMD_CLOCK:
+        emu.clk_freq_sel = cmd.value;
+        next_tick = 0;
+        break;
+    }
+}
+
+///////////////////////////////////////
+// Emulation
+///////////////////////////////////////
+void EmuThread::service(u32 usec)
+{
+    u32 h = head.load(std::memory_order_relaxed);
+    while (h != tail.load(std::memory_order_acquire))
+    {
+        runCommand(ring[h % EMU_CMD_RING]);
+        head.store(++h, std::memory_order_release);
+    }
+
+    double t0 = wallSeconds();
+    if (emu.running && emu.ready_to_run)
+    {
+        if (emu.clk_freq_sel != -1)
+        {
+            // Throttled: one instruction every 1 / clk_freq_sel seconds
+            if (t0 >= next_tick)
+            {
+                emu.emulate();
+                next_tick = t0 + 1.0 / std::max(1, emu.clk_freq_sel);
+            }
+        }
+        else
+        {
+            // Run blocks until the time budget is used up (sampled every 64
+            // blocks) or the guest goes idle
+            u32 blocks = 0;
+            emu.idled = false;
+            while (emu.running && !emu.idled)
+            {
+                emu.emulateBlock(BLOCK_MAX_INS);
+                if ((++blocks & 63) == 0 && (wallSeconds() - t0) * 1e6 >= usec)
+                    break;
+            }
+        }
+    }
+    publish();
+}
+
+///////////////////////////////////////
+// Published state
+///////////////////////////////////////
+void EmuThread::publish()
+{
+    u32 s = seq.load(std::memory_order_relaxed);
+    seq.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    memcpy(state.xreg, emu.cpu.xreg, sizeof(state.xreg));
+    state.pc = emu.cpu.pc;
+    // Only RAM: reading a device register could have side effects
+    state.ins = (emu.cpu.pc & 0x80000000u) && emu.ready_to_run ? emu.cpu.memGetWord(emu.cpu.pc) : 0;
+    state.clock = emu.cpu.clock;
+    state.reservation_addr = emu.cpu.reservation_addr;
+    state.reservation_en = emu.cpu.reservation_en;
+    state.running = emu.running;
+    state.ready_to_run = emu.ready_to_run;
+    state.debug_mode = emu.debugMode;
+    state.memory = emu.memory;
+    state.ram_size = emu.ram_size;
+
+    seq.store(s + 2, std::memory_order_release);
+
+    u64 dirty[EMU_FB_WORDS] = {0};
+    if (emu.ready_to_run && emu.cpu.fbDirty(dirty) != 0)
+    {
+        for (u32 i = 0; i < EMU_FB_WORDS; i++)
+            fb_dirty[i].fetch_or(dirty[i], std::memory_order_release);
+    }
+}
+
+void EmuThread::view(emu_view *out)
+{
+    for (;;)
+    {
+        u32 s0 = seq.load(std::memory_order_acquire);
+        if (s0 & 1)
+            continue;
+        memcpy(out, &state, sizeof(*out));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (seq.load(std::memory_order_relaxed) == s0)
+            return;
+    }
+}
+
+bool EmuThread::fbTake(u64 *bitmap)
+{
+    bool any = false;
+    for (u32 i = 0; i < EMU_FB_WORDS; i++)
+    {
+        bitmap[i] = fb_dirty[i].exchange(0, std::memory_order_acquire);
+        any |= bitmap[i] != 0;
+    }
+    return any;
+}
@@ -0,0 +1,338 @@
+// ISA conformance runner: runs riscv-tests ELFs in parallel, each in its own
+// Emulator, and reports which pass.
+//
+//   rve-isa [-i | -j] [-t <threads>] [--timeout <seconds>] [--json]
+//           [--smp <harts>] [--xfail <test>]... <test or dir>...
+//
+// Tests run in blocks (Emulator::emulateBlock) by default, one instruction at
+// a time with -i, or translated to host code with -j (x86-64 hosts only).
+// With --smp every test runs on a machine of <harts> harts (see smp.h); the
+// mode applies to hart 0, the other harts always run in blocks.
+//
+// A directory stands for every test in it (disassembly *.dump files are
+// skipped). A test passes when it writes 1 to `tohost` or makes the exit
+// ecall with a0 = 0; on failure the riscv-tests environment reports the
+// failing case as tohost = a0 = (TESTNUM << 1) | 1. A test that does neither
+// before it powers off or times out, or hits an unimplemented instruction,
+// fails too.
+//
+// Tests named with --xfail are known failures: they are reported, but only
+// fail the run if they pass, so the list is kept up to date. Exits with
+// status 1 if any other test failed.
+
+#include "emu.h"
+#include "jit.h"
+#include "loader.h"
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <string>
+#include <thread>
+#include <vector>
+
+const double ISA_TIMEOUT_SEC = 10.0;
+
+typedef enum {
+    ISA_PASS,
+    ISA_FAIL,    // The test reported a failing case
+    ISA_FAULT,   // Unimplemented instruction
+    ISA_HALT,    // Powered off without a result
+    ISA_TIMEOUT,
+    ISA_ERROR,   // Could not be loaded
+} isa_result;
+
+static const char *isa_result_name[] = {"pass", "fail", "fault", "halt", "timeout", "error"};
+
+// Execution modes, as in rve-headless
+typedef enum {
+    ISA_MODE_BLOCK,  // Emulator::emulateBlock
+    ISA_MODE_INTERP, // -i: Emulator::emulate
+    ISA_MODE_JIT,    // -j: Jit::run
+} isa_mode;
+
+static const char *isa_mode_name[] = {"block", "interp", "jit"};
+
+typedef struct {
+    std::string path;
+    std::string name;
+    isa_result result;
+    bool xfail;      // Expected to fail (--xfail)
+    u32 test_num;    // Failing case, for ISA_FAIL
+    u64 retired;
+    double seconds;
+} isa_test;
+
+static void addPath(std::vector<isa_test> &tests, const char *path)
+{
+    std::vector<std::string> files;
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        files.push_back(path);
+    else
+    {
+        struct dirent *de;
+        while ((de = readdir(dir)) != NULL)
+        {
+            std::string name = de->d_name;
+            if (name[0] == '.' || (name.size() > 5 && name.compare(name.size() - 5, 5, ".dump") == 0))
+                continue;
+            files.push_back(std::string(path) + "/" + name);
+        }
+        closedir(dir);
+        std::sort(files.begin(), files.end());
+    }
+
+    for (const std::string &file : files)
+    {
+        isa_test t;
+        t.path = file;
+        size_t slash = file.rfind('/');
+        t.name = slash == std::string::npos ? file : file.substr(slash + 1);
+        t.result = ISA_ERROR;
+        t.xfail = false;
+        t.test_num = 0;
+        t.retired = 0;
+        t.seconds = 0;
+        tests.push_back(t);
+    }
+}
+
+///////////////////////////////////////
+// Running a test
+///////////////////////////////////////
+// tohost: 1 on pass, (TESTNUM << 1) | 1 on failure, 0 while running
+static bool tohostResult(u32 tohost, isa_test &t)
+{
+    if (tohost == 0)
+        return false;
+    t.result = tohost == 1 ? ISA_PASS : ISA_FAIL;
+    t.test_num = tohost >> 1;
+    return true;
+}
+
+static void runTest(isa_test &t, int null_fd, double timeout, isa_mode mode, u32 harts)
+{
+    Emulator emu;
+    emu.console_in = -1;
+    emu.console_out = null_fd;
+    emu.exit_on_fault = false;
+    emu.hart_count = harts;
+    emu.initializeElf(t.path.c_str());
+    if (!emu.ready_to_run)
+        return;
+    emu.stop_on_exit = true;
+    emu.running = true;
+
+#ifdef RVE_JIT
+    Jit jit(emu);
+    if (mode == ISA_MODE_JIT && !jit.init())
+        return;
+#endif
+
+    u32 tohost_addr = 0;
+    volatile u32 *tohost = nullptr;
+    if (elfSymbol(t.path.c_str(), "tohost", &tohost_addr) &&
+        (tohost_addr & 0x7FFFFFFF) + sizeof(u32) <= emu.ram_size)
+        tohost = (volatile u32 *)(emu.memory + (tohost_addr & 0x7FFFFFFF));
+
+    double t0 = wallSeconds();
+    bool done = false;
+    while (!done)
+    {
+        if (mode == ISA_MODE_INTERP)
+        {
+            for (u32 i = 0; i < BLOCK_MAX_INS && emu.running; i++)
+                emu.emulate();
+        }
+#ifdef RVE_JIT
+        else if (mode == ISA_MODE_JIT)
+            jit.run(BLOCK_MAX_INS);
+#endif
+        else
+            emu.emulateBlock(BLOCK_MAX_INS);
+        t.retired = emu.retiredCount();
+        t.seconds = wallSeconds() - t0;
+
+        if (tohost != nullptr && tohostResult(*tohost, t))
+            done = true;
+        else if (emu.faulted)
+        {
+            t.result = ISA_FAULT;
+            done = true;
+        }
+        else if (emu.exited)
+        {
+            t.result = emu.exit_status == 0 ? ISA_PASS : ISA_FAIL;
+            t.test_num = emu.exit_status;
+            done = true;
+        }
+        else if (!emu.running)
+        {
+            t.result = ISA_HALT;
+            done = true;
+        }
+        else if (t.seconds >= timeout)
+        {
+            t.result = ISA_TIMEOUT;
+            done = true;
+        }
+    }
+}
+
+///////////////////////////////////////
+// Reporting
+///////////////////////////////////////
+// A test that did not turn out as expected: a failure, or an --xfail pass
+static bool unexpected(const isa_test &t)
+{
+    return (t.result == ISA_PASS) == t.xfail;
+}
+
+static void report(FILE *out, const std::vector<isa_test> &tests, double secs, bool json, isa_mode mode)
+{
+    u32 count[ISA_ERROR + 1] = {0};
+    u32 xfailed = 0;
+    u32 xpassed = 0;
+    for (const isa_test &t : tests)
+    {
+        count[t.result]++;
+        if (t.xfail)
+            (t.result == ISA_PASS ? xpassed : xfailed)++;
+    }
+
+    if (json)
+    {
+        fprintf(out, "{\"mode\": \"%s\", \"tests\": [\n", isa_mode_name[mode]);
+        for (size_t i = 0; i < tests.size(); i++)
+        {
+            const isa_test &t = tests[i];
+            fprintf(out, "  {\"name\": \"%s\", \"result\": \"%s\", \"xfail\": %s, \"test_num\": %u, "
+                         "\"instructions\": %" PRIu64 ", \"seconds\": %.6f}%s\n",
+                    t.name.c_str(), isa_result_name[t.result], t.xfail ? "true" : "false",
+                    t.test_num, t.retired, t.seconds, i + 1 < tests.size() ? "," : "");
+        }
+        fprintf(out, "], \"passed\": %u, \"failed\": %u, \"expected_failures\": %u, "
+                     "\"unexpected_passes\": %u, \"seconds\": %.6f}\n",
+                count[ISA_PASS], (u32)tests.size() - count[ISA_PASS], xfailed, xpassed, secs);
+        return;
+    }
+
+    for (const isa_test &t : tests)
+    {
+        fprintf(out, "%-7s %-24s %10" PRIu64 " ins %8.3f s", isa_result_name[t.result],
+                t.name.c_str(), t.retired, t.seconds);
+        if (t.result == ISA_FAIL)
+            fprintf(out, "  (test %u)", t.test_num);
+        if (t.xfail)
+            fprintf(out, t.result == ISA_PASS ? "  (unexpected pass)" : "  (expected)");
+        fprintf(out, "\n");
+    }
+    fprintf(out, "isa (%s): %u passed, %u failed, %u faulted, %u halted, %u timed out, %u errors of %u in %.2f s\n",
+            isa_mode_name[mode], count[ISA_PASS], count[ISA_FAIL], count[ISA_FAULT], count[ISA_HALT], count[ISA_TIMEOUT],
+            count[ISA_ERROR], (u32)tests.size(), secs);
+    if (xfailed != 0 || xpassed != 0)
+        fprintf(out, "isa (%s): %u expected failures, %u unexpected passes\n",
+                isa_mode_name[mode], xfailed, xpassed);
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<isa_test> tests;
+    u32 threads = 0;
+    u32 harts = 1;
+    double timeout = ISA_TIMEOUT_SEC;
+    bool json = false;
+    bool verbose = false;
+    isa_mode mode = ISA_MODE_BLOCK;
+    std::vector<std::string> xfail;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            threads = (u32)strtoul(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc)
+            timeout = strtod(argv[++i], nullptr);
+        else if (strcmp(argv[i], "--json") == 0)
+            json = true;
+        else if (strcmp(argv[i], "--smp") == 0 && i + 1 < argc)
+            harts = (u32)strtoul(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "-v") == 0)
+            verbose = true;
+        else if (strcmp(argv[i], "-i") == 0)
+            mode = ISA_MODE_INTERP;
+        else if (strcmp(argv[i], "-j") == 0)
+            mode = ISA_MODE_JIT;
+        else if (strcmp(argv[i], "--xfail") == 0 && i + 1 < argc)
+            xfail.push_back(argv[++i]);
+        else if (argv[i][0] != '-')
+            addPath(tests, argv[i]);
+        else
+        {
+            fprintf(stderr, "usage: %s [-i | -j] [-t <threads>] [--timeout <seconds>] [--json] [-v] "
+                            "[--smp <harts>] [--xfail <test>]... <test or dir>...\n", argv[0]);
+            return 2;
+        }
+    }
+    if (tests.empty())
+    {
+        fprintf(stderr, "ERRO: no tests given\n");
+        return 2;
+    }
+    for (isa_test &t : tests)
+        t.xfail = std::find(xfail.begin(), xfail.end(), t.name) != xfail.end();
+#ifndef RVE_JIT
+    if (mode == ISA_MODE_JIT)
+    {
+        fprintf(stderr, "WARN: JIT not available on this host, running blocks\n");
+        mode = ISA_MODE_BLOCK;
+    }
+#endif
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    // Keep the report on stdout and send the emulators' own messages (loader,
+    // exit ecall) to /dev/null unless -v
+    FILE *out = stdout;
+    if (!verbose)
+    {
+        fflush(stdout);
+        out = fdopen(dup(STDOUT_FILENO), "w");
+        dup2(null_fd, STDOUT_FILENO);
+    }
+
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads == 0)
+        threads = 1;
+    if (threads > tests.size())
+        threads = (u32)tests.size();
+
+    // Tests are short and similar in length; workers just take the next one
+    std::atomic<u32> next(0);
+    double t0 = wallSeconds();
+    std::vector<std::thread> pool;
+    for (u32 i = 0; i < threads; i++)
+    {
+        pool.push_back(std::thread([&]() {
+            u32 index;
+            while ((index = next.fetch_add(1)) < tests.size())
+                runTest(tests[index], null_fd, timeout, mode, harts);
+        }));
+    }
+    for (std::thread &t : pool)
+        t.join();
+    double secs = wallSeconds() - t0;
+
+    report(out, tests, secs, json, mode);
+    fflush(out);
+
+    for (const isa_test &t : tests)
+    {
+        if (unexpected(t))
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,694 @@
+#include "jit.h"
+
+#ifdef RVE_JIT
+
+#include <stddef.h>
+
+static_assert(sizeof(host_tlb_entry) == 16, "JIT host TLB probe assumes 16-byte entries");
+
+///////////////////////////////////////
+// x86-64 code emission
+///////////////////////////////////////
+
+// Host registers (low 3 bits of the encoding; r8-r15 need a REX prefix)
+#define EAX 0
+#define ECX 1
+#define EDX 2
+#define EBX 3
+#define ESI 6
+#define EDI 7
+
+// Condition codes (low nibble of Jcc / SETcc)
+#define CC_B  0x2
+#define CC_AE 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+#define CC_A  0x7
+#define CC_S  0x8
+#define CC_L  0xc
+#define CC_GE 0xd
+
+// ALU /digit extensions for 0x81 (reg, imm32)
+#define ALU_ADD 0
+#define ALU_OR  1
+#define ALU_AND 4
+#define ALU_SUB 5
+#define ALU_XOR 6
+#define ALU_CMP 7
+
+// Shift /digit extensions for 0xC1 (imm8) and 0xD3 (cl)
+#define SH_SHL 4
+#define SH_SHR 5
+#define SH_SAR 7
+
+// Register usage inside a block:
+//   rbx = RV32 *cpu, r12 = Jit *jit, r13d = clock value that ends the run.
+// Guest registers live in cpu->xreg; eax/ecx/edx/esi/edi are scratch.
+struct Emit
+{
+    u8 *p;
+
+    void b(u8 v) { *p++ = v; }
+    void d(u32 v) { memcpy(p, &v, 4); p += 4; }
+    void q(u64 v) { memcpy(p, &v, 8); p += 8; }
+
+    // mov r32, [rbx + off]
+    void ld(u32 r, u32 off) { b(0x8b); b(0x80 | (r << 3) | EBX); d(off); }
+    // mov [rbx + off], r32
+    void st(u32 off, u32 r) { b(0x89); b(0x80 | (r << 3) | EBX); d(off); }
+    // mov dword [rbx + off], imm32
+    void stImm(u32 off, u32 imm) { b(0xc7); b(0x80 | EBX); d(off); d(imm); }
+    // add dword [rbx + off], imm32
+    void addMemImm(u32 off, u32 imm) { b(0x81); b(0x80 | EBX); d(off); d(imm); }
+    // <op> r32, [rbx + off]  (op: 03 add, 2b sub, 23 and, 0b or, 33 xor, 3b cmp)
+    void aluMem(u8 op, u32 r, u32 off) { b(op); b(0x80 | (r << 3) | EBX); d(off); }
+    // <ext> r32, imm32
+    void aluImm(u32 ext, u32 r, u32 imm) { b(0x81); b(0xc0 | (ext << 3) | r); d(imm); }
+    // <ext> r32, imm8 / cl
+    void shiftImm(u32 ext, u32 r, u32 n) { b(0xc1); b(0xc0 | (ext << 3) | r); b(n); }
+    void shiftCl(u32 ext, u32 r) { b(0xd3); b(0xc0 | (ext << 3) | r); }
+    // mov dst, src (32-bit)
+    void mov(u32 dst, u32 src) { b(0x89); b(0xc0 | (src << 3) | dst); }
+    // mov r32, imm32
+    void movImm(u32 r, u32 imm) { b(0xb8 + r); d(imm); }
+    // setcc al; movzx eax, al
+    void setcc(u32 cc) { b(0x0f); b(0x90 | cc); b(0xc0); b(0x0f); b(0xb6); b(0xc0); }
+    // jcc / jmp rel32, returning the displacement to patch
+    u8 *jcc(u32 cc) { b(0x0f); b(0x80 | cc); d(0); return p - 4; }
+    u8 *jmp() { b(0xe9); d(0); return p - 4; }
+    void jccTo(u32 cc, u8 *target) { b(0x0f); b(0x80 | cc); d((u32)(target - (p + 4))); }
+    void patch(u8 *rel) { u32 v = (u32)(p - (rel + 4)); memcpy(rel, &v, 4); }
+    // call an absolute address through rax
+    void call(const void *fn) { b(0x48); b(0xb8); q((u64)(uintptr_t)fn); b(0xff); b(0xd0); }
+    // mov rdi, r12 (first argument = Jit *)
+    void argJit() { b(0x4c); b(0x89); b(0xe7); }
+    // mov rsi, imm64
+    void argPtr(const void *ptr) { b(0x48); b(0xbe); q((u64)(uintptr_t)ptr); }
+    // test eax, eax
+    void testEax() { b(0x85); b(0xc0); }
+
+    void prologue()
+    {
+        b(0x53);                         // push rbx
+        b(0x41); b(0x54);                // push r12
+        b(0x41); b(0x55);                // push r13
+        b(0x48); b(0x89); b(0xfb);       // mov rbx, rdi
+        b(0x49); b(0x89); b(0xf4);       // mov r12, rsi
+        b(0x41); b(0x89); b(0xd5);       // mov r13d, edx
+    }
+    void epilogue(u32 status)
+    {
+        movImm(EAX, status);
+        b(0x41); b(0x5d);                // pop r13
+        b(0x41); b(0x5c);                // pop r12
+        b(0x5b);                         // pop rbx
+        b(0xc3);                         // ret
+    }
+};
+
+///////////////////////////////////////
+// Runtime helpers called from translated code
+///////////////////////////////////////
+
+// Run one instruction through the interpreter. Returns non-zero if the block
+// must exit: the instruction trapped, redirected the PC, touched a device, is a
+// SYSTEM/fence instruction, or invalidated the page the block came from.
+static u32 jit_exec(Jit *jit, DecodedIns *d, u32 pc)
+{
+    RV32 &cpu = jit->cpu;
+    cpu.pc = pc;
+    ins_ret ret = jit->emu.execute(d);
+
+    if (ret.trap.en || (d->flags & DECODE_BLOCK_END) || cpu.mmio_access ||
+        ret.pc_val != pc + 4 || (*jit->cur_flags & PAGE_JIT) == 0)
+    {
+        jit->exit_ret = ret;
+        return 1;
+    }
+    return 0;
+}
+
+// Host TLB miss on a load. `op` = rd | funct3 << 8.
+static u32 jit_load(Jit *jit, u32 vaddr, u32 pc, u32 op)
+{
+    RV32 &cpu = jit->cpu;
+    u32 rd = op & 0x1f;
+    u32 funct3 = op >> 8;
+
+    cpu.pc = pc;
+    ins_ret ret = cpu.insReturnNoop();
+    u32 val = cpu.vmReadSlow(&ret, vaddr, 1u << (funct3 & 3));
+    if (ret.trap.en)
+    {
+        jit->exit_ret = ret;
+        return 1;
+    }
+
+    if (funct3 == 0)
+        val = signExtend(val, 8);
+    else if (funct3 == 1)
+        val = signExtend(val, 16);
+    if (rd != 0)
+        cpu.xreg[rd] = val;
+
+    if (cpu.mmio_access)
+    {
+        jit->exit_ret = ret;
+        return 1;
+    }
+    return 0;
+}
+
+// Host TLB miss on a store
+static u32 jit_store(Jit *jit, u32 vaddr, u32 pc, u32 val, u32 size)
+{
+    RV32 &cpu = jit->cpu;
+
+    cpu.pc = pc;
+    ins_ret ret = cpu.insReturnNoop();
+    cpu.vmWriteSlow(&ret, vaddr, val, size);
+
+    if (ret.trap.en || cpu.mmio_access || (*jit->cur_flags & PAGE_JIT) == 0)
+    {
+        jit->exit_ret = ret;
+        return 1;
+    }
+    return 0;
+}
+
+// RV32M division and remainder (funct3 4-7)
+static u32 jit_divrem(u32 a, u32 b, u32 funct3)
+{
+    switch (funct3)
+    {
+    case 4: // div
+        if (b == 0) return 0xFFFFFFFF;
+        if (a == 0x80000000 && b == 0xFFFFFFFF) return a;
+        return (u32)((s32)a / (s32)b);
+    case 5: // divu
+        if (b == 0) return 0xFFFFFFFF;
+        return a / b;
+    case 6: // rem
+        if (b == 0) return a;
+        if (a == 0x80000000 && b == 0xFFFFFFFF) return 0;
+        return (u32)((s32)a % (s32)b);
+    default: // remu
+        if (b == 0) return a;
+        return a % b;
+    }
+}
+
+///////////////////////////////////////
+// Jit Functions
+///////////////////////////////////////
+
+Jit::Jit(Emulator &emu) : emu(emu), cpu(emu.cpu)
+{
+    code_buf = nullptr;
+    code_used = 0;
+    cur_flags = nullptr;
+    pages = nullptr;
+    page_count = 0;
+}
+
+Jit::~Jit()
+{
+    for (u32 i = 0; i < page_count; i++)
+        free(pages[i]);
+    free(pages);
+    if (code_buf != nullptr)
+        munmap(code_buf, JIT_CODE_SIZE);
+}
+
+bool Jit::init()
+{
+    void *buf = mmap(nullptr, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED)
+    {
+        perror("ERRO: jit code cache");
+        return false;
+    }
+    code_buf = (u8 *)buf;
+    code_used = 0;
+    page_count = cpu.mem_size / RV32_PAGE_SIZE;
+    pages = (JitEntry **)calloc(page_count, sizeof(JitEntry *));
+    return true;
+}
+
+// Drop every translation (code cache full)
+void Jit::flush()
+{
+    code_used = 0;
+    for (u32 i = 0; i < page_count; i++)
+        cpu.page_flags[i] &= ~PAGE_JIT;
+}
+
+jit_block Jit::lookup(u32 vpc, u32 phys_pc)
+{
+    u32 phys = phys_pc & 0x7FFFFFFFu;
+    if ((phys_pc & 0x80000000u) == 0 || phys >= cpu.mem_size || (phys >> 12) >= page_count)
+        return nullptr;
+
+    u32 page = phys >> 12;
+    JitEntry *entries = pages[page];
+    if ((cpu.page_flags[page] & PAGE_JIT) == 0)
+    {
+        // First execution from this page, or it was written since translation
+        if (entries == nullptr)
+            entries = pages[page] = (JitEntry *)malloc(DECODED_PAGE_INS * sizeof(JitEntry));
+        memset(entries, 0, DECODED_PAGE_INS * sizeof(JitEntry));
+        cpu.pageSetFlags(phys, PAGE_JIT);
+    }
+    cur_flags = &cpu.page_flags[page];
+
+    JitEntry *e = &entries[(phys >> 2) & (DECODED_PAGE_INS - 1)];
+    if (e->code == nullptr || e->vpc != vpc)
+    {
+        if (JIT_CODE_SIZE - code_used < JIT_BLOCK_MAX_INS * JIT_INS_MAX_CODE)
+        {
+            flush();
+            return lookup(vpc, phys_pc);
+        }
+        e->code = compile(vpc, phys_pc);
+        e->vpc = vpc;
+    }
+    return e->code;
+}
+
+// Translate the straight-line run starting at vpc, up to a control transfer,
+// a SYSTEM/fence instruction, the end of the page or JIT_BLOCK_MAX_INS.
+// ALU, M-extension, integer load/store and control-flow instructions are
+// emitted natively; everything else calls back into the interpreter.
+jit_block Jit::compile(u32 vpc, u32 phys_pc)
+{
+    const u32 off_pc    = (u32)((u8 *)&cpu.pc - (u8 *)&cpu);
+    const u32 off_clock = (u32)((u8 *)&cpu.clock - (u8 *)&cpu);
+    const u32 off_htlb  = (u32)((u8 *)&cpu.htlb[0] - (u8 *)&cpu);
+    const u32 off_x     = (u32)((u8 *)&cpu.xreg[0] - (u8 *)&cpu);
+#define X(r) (off_x + 4 * (r))
+
+    u8 *start = code_buf + code_used;
+    Emit e = {start};
+    e.prologue();
+    u8 *body = e.p;
+
+    u32 pc = vpc;
+    u32 phys = phys_pc;
+    u32 n = 0;      // guest instructions emitted so far
+    u32 synced = 0; // of those, already added to cpu.clock
+
+    // Leave the block with cpu.pc = next (JIT_CONTINUE)
+    auto exitTo = [&](u32 next) {
+        e.stImm(off_pc, next);
+        if (n != synced)
+            e.addMemImm(off_clock, n - synced);
+        e.epilogue(JIT_CONTINUE);
+    };
+    // Leave the block after a helper stored the result in exit_ret (JIT_EXIT)
+    auto exitHelper = [&]() {
+        if (n != synced)
+            e.addMemImm(off_clock, n - synced);
+        e.epilogue(JIT_EXIT);
+    };
+    // Jump to a static target: loop back to the block start while the run
+    // has budget left, otherwise return to the dispatcher
+    auto branchTo = [&](u32 target) {
+        if (target == vpc)
+        {
+            if (n != synced)
+                e.addMemImm(off_clock, n - synced);
+            e.ld(EAX, off_clock);
+            e.b(0x44); e.b(0x29); e.b(0xe8); // sub eax, r13d
+            e.jccTo(CC_S, body);
+            e.stImm(off_pc, target);
+            e.epilogue(JIT_CONTINUE);
+        }
+        else
+            exitTo(target);
+    };
+    // Host TLB probe on the guest address in eax. On a hit rdx holds the host
+    // addend (host = rdx + rax); returns the two jumps to take on a miss.
+    auto probe = [&](u32 tag_off, u32 size, u8 **miss) {
+        e.mov(ECX, EAX);
+        e.shiftImm(SH_SHR, ECX, 12);
+        e.aluImm(ALU_AND, ECX, RV32_TLB_SIZE - 1);
+        e.shiftImm(SH_SHL, ECX, 4); // sizeof(host_tlb_entry)
+        e.mov(EDX, EAX);
+        e.aluImm(ALU_AND, EDX, ~0xfffu);
+        e.b(0x3b); e.b(0x94); e.b(0x0b); e.d(off_htlb + tag_off); // cmp edx, [rbx+rcx+tag]
+        miss[0] = e.jcc(CC_NE);
+        e.mov(EDX, EAX);
+        e.aluImm(ALU_AND, EDX, 0xfffu);
+        e.aluImm(ALU_CMP, EDX, 0x1000u - size);
+        miss[1] = e.jcc(CC_A);
+        e.b(0x48); e.b(0x8b); e.b(0x94); e.b(0x0b); // mov rdx, [rbx+rcx+addend]
+        e.d(off_htlb + offsetof(host_tlb_entry, addend));
+    };
+
+    bool open = true;
+    while (open)
+    {
+        DecodedIns *d = emu.icacheFetch(phys);
+        u32 w = d->ins_word;
+        u32 opcode = w & 0x7f;
+        u32 rd = (w >> 7) & 0x1f;
+        u32 funct3 = (w >> 12) & 0x7;
+        u32 rs1 = (w >> 15) & 0x1f;
+        u32 rs2 = (w >> 20) & 0x1f;
+        u32 funct7 = w >> 25;
+        u32 imm_i = (u32)((s32)w >> 20);
+        n++;
+
+        bool native = true;
+        switch (opcode)
+        {
+        case 0x37: // lui
+            if (rd != 0)
+                e.stImm(X(rd), w & 0xfffff000u);
+            break;
+
+        case 0x17: // auipc
+            if (rd != 0)
+                e.stImm(X(rd), pc + (w & 0xfffff000u));
+            break;
+
+        case 0x13: // OP-IMM
+            if ((funct3 == 1 && funct7 != 0) ||
+                (funct3 == 5 && funct7 != 0 && funct7 != 0x20))
+            {
+                native = false;
+                break;
+            }
+            if (rd == 0)
+                break;
+            e.ld(EAX, X(rs1));
+            switch (funct3)
+            {
+            case 0: e.aluImm(ALU_ADD, EAX, imm_i); break;
+            case 1: e.shiftImm(SH_SHL, EAX, rs2); break;
+            case 2: e.aluImm(ALU_CMP, EAX, imm_i); e.setcc(CC_L); break;
+            case 3: e.aluImm(ALU_CMP, EAX, imm_i); e.setcc(CC_B); break;
+            case 4: e.aluImm(ALU_XOR, EAX, imm_i); break;
+            case 5: e.shiftImm(funct7 ? SH_SAR : SH_SHR, EAX, rs2); break;
+            case 6: e.aluImm(ALU_OR, EAX, imm_i); break;
+            case 7: e.aluImm(ALU_AND, EAX, imm_i); break;
+            }
+            e.st(X(rd), EAX);
+            break;
+
+        case 0x33: // OP
+            if (!(funct7 == 0x00 || funct7 == 0x01 ||
+                  (funct7 == 0x20 && (funct3 == 0 || funct3 == 5))))
+            {
+                native = false;
+                break;
+            }
+            if (rd == 0)
+                break;
+            if (funct7 == 0x01 && funct3 >= 4)
+            {
+                // div / divu / rem / remu
+                e.ld(EDI, X(rs1));
+                e.ld(ESI, X(rs2));
+                e.movImm(EDX, funct3);
+                e.call((const void *)&jit_divrem);
+                e.st(X(rd), EAX);
+                break;
+            }
+            if (funct7 == 0x01 && funct3 != 0)
+            {
+                // mulh / mulhsu / mulhu: 64-bit product, high word
+                if (funct3 == 3)
+                    e.ld(EAX, X(rs1));                                      // mov eax, rs1
+                else
+                { e.b(0x48); e.b(0x63); e.b(0x83); e.d(X(rs1)); }           // movsxd rax, rs1
+                if (funct3 == 1)
+                { e.b(0x48); e.b(0x63); e.b(0x8b); e.d(X(rs2)); }           // movsxd rcx, rs2
+                else
+                    e.ld(ECX, X(rs2));                                      // mov ecx, rs2
+                e.b(0x48); e.b(0x0f); e.b(0xaf); e.b(0xc1);                 // imul rax, rcx
+                e.b(0x48); e.b(0xc1); e.b(0xe8); e.b(0x20);                 // shr rax, 32
+                e.st(X(rd), EAX);
+                break;
+            }
+            e.ld(EAX, X(rs1));
+            if (funct7 == 0x01) // mul
+            {
+                e.b(0x0f); e.b(0xaf); e.b(0x80 | (EAX << 3) | EBX); e.d(X(rs2));
+            }
+            else if (funct7 == 0x20)
+            {
+                if (funct3 == 0)
+                    e.aluMem(0x2b, EAX, X(rs2)); // sub
+                else
+                {
+                    e.ld(ECX, X(rs2));
+                    e.shiftCl(SH_SAR, EAX);      // sra
+                }
+            }
+            else
+            {
+                switch (funct3)
+                {
+                case 0: e.aluMem(0x03, EAX, X(rs2)); break;
+                case 1: e.ld(ECX, X(rs2)); e.shiftCl(SH_SHL, EAX); break;
+                case 2: e.aluMem(0x3b, EAX, X(rs2)); e.setcc(CC_L); break;
+                case 3: e.aluMem(0x3b, EAX, X(rs2)); e.setcc(CC_B); break;
+                case 4: e.aluMem(0x33, EAX, X(rs2)); break;
+                case 5: e.ld(ECX, X(rs2)); e.shiftCl(SH_SHR, EAX); break;
+                case 6: e.aluMem(0x0b, EAX, X(rs2)); break;
+                case 7: e.aluMem(0x23, EAX, X(rs2)); break;
+                }
+            }
+            e.st(X(rd), EAX);
+            break;
+
+        case 0x03: // LOAD
+        {
+            if (funct3 == 3 || funct3 > 5)
+            {
+                native = false;
+                break;
+            }
+            u32 size = 1u << (funct3 & 3);
+            u8 *miss[2];
+            e.ld(EAX, X(rs1));
+            if (imm_i != 0)
+                e.aluImm(ALU_ADD, EAX, imm_i);
+            probe(offsetof(host_tlb_entry, tag_read), size, miss);
+            switch (funct3)
+            {
+            case 0: e.b(0x0f); e.b(0xbe); break; // movsx eax, byte
+            case 1: e.b(0x0f); e.b(0xbf); break; // movsx eax, word
+            case 2: e.b(0x8b); break;            // mov eax, dword
+            case 4: e.b(0x0f); e.b(0xb6); break; // movzx eax, byte
+            case 5: e.b(0x0f); e.b(0xb7); break; // movzx eax, word
+            }
+            e.b(0x04); e.b(0x02);                // [rdx + rax]
+            if (rd != 0)
+                e.st(X(rd), EAX);
+            u8 *done = e.jmp();
+            e.patch(miss[0]);
+            e.patch(miss[1]);
+            e.argJit();
+            e.mov(ESI, EAX);
+            e.movImm(EDX, pc);
+            e.movImm(ECX, rd | (funct3 << 8));
+            e.call((const void *)&jit_load);
+            e.testEax();
+            u8 *ok = e.jcc(CC_E);
+            exitHelper();
+            e.patch(ok);
+            e.patch(done);
+            break;
+        }
+
+        case 0x23: // STORE
+        {
+            if (funct3 > 2)
+            {
+                native = false;
+                break;
+            }
+            u32 size = 1u << funct3;
+            u32 imm_s = (u32)(((s32)w >> 25) << 5) | ((w >> 7) & 0x1f);
+            u8 *miss[2];
+            e.ld(EAX, X(rs1));
+            if (imm_s != 0)
+                e.aluImm(ALU_ADD, EAX, imm_s);
+            probe(offsetof(host_tlb_entry, tag_write), size, miss);
+            e.ld(ESI, X(rs2));
+            switch (funct3)
+            {
+            case 0: e.b(0x40); e.b(0x88); break; // mov byte [..], sil
+            case 1: e.b(0x66); e.b(0x89); break; // mov word [..], si
+            case 2: e.b(0x89); break;            // mov dword [..], esi
+            }
+            e.b(0x34); e.b(0x02);                // [rdx + rax]
+            u8 *done = e.jmp();
+            e.patch(miss[0]);
+            e.patch(miss[1]);
+            e.argJit();
+            e.mov(ESI, EAX);
+            e.movImm(EDX, pc);
+            e.ld(ECX, X(rs2));
+            e.b(0x41); e.b(0xb8); e.d(size);     // mov r8d, size
+            e.call((const void *)&jit_store);
+            e.testEax();
+            u8 *ok = e.jcc(CC_E);
+            exitHelper();
+            e.patch(ok);
+            e.patch(done);
+            break;
+        }
+
+        case 0x63: // BRANCH
+        {
+            static const u8 cc_for[8] = {CC_E, CC_NE, 0, 0, CC_L, CC_GE, CC_B, CC_AE};
+            if (funct3 == 2 || funct3 == 3)
+            {
+                native = false;
+                break;
+            }
+            u32 imm_b = (u32)(((s32)w >> 31) << 12) | ((w << 4) & 0x800) |
+                        ((w >> 20) & 0x7e0) | ((w >> 7) & 0x1e);
+            e.ld(EAX, X(rs1));
+            e.aluMem(0x3b, EAX, X(rs2));
+            u8 *taken = e.jcc(cc_for[funct3]);
+            exitTo(pc + 4);
+            e.patch(taken);
+            branchTo(pc + imm_b);
+            open = false;
+            break;
+        }
+
+        case 0x6f: // jal
+        {
+            u32 imm_j = (u32)(((s32)w >> 31) << 20) | (w & 0xff000) |
+                        ((w >> 9) & 0x800) | ((w >> 20) & 0x7fe);
+            if (rd != 0)
+                e.stImm(X(rd), pc + 4);
+            branchTo(pc + imm_j);
+            open = false;
+            break;
+        }
+
+        case 0x67: // jalr
+            if (funct3 != 0)
+            {
+                native = false;
+                break;
+            }
+            e.ld(EAX, X(rs1));
+            if (imm_i != 0)
+                e.aluImm(ALU_ADD, EAX, imm_i);
+            if (rd != 0)
+                e.stImm(X(rd), pc + 4);
+            e.st(off_pc, EAX);
+            if (n != synced)
+                e.addMemImm(off_clock, n - synced);
+            e.epilogue(JIT_CONTINUE);
+            open = false;
+            break;
+
+        default:
+            native = false;
+            break;
+        }
+
+        if (!native)
+        {
+            // Interpreter fallback; cpu.clock must be current for CSR reads
+            if (n != synced)
+                e.addMemImm(off_clock, n - synced);
+            synced = n;
+            e.argJit();
+            e.argPtr(d);
+            e.movImm(EDX, pc);
+            e.call((const void *)&jit_exec);
+            if (d->flags & DECODE_BLOCK_END)
+            {
+                e.epilogue(JIT_EXIT);
+                open = false;
+            }
+            else
+            {
+                e.testEax();
+                u8 *ok = e.jcc(CC_E);
+                e.epilogue(JIT_EXIT);
+                e.patch(ok);
+            }
+        }
+
+        pc += 4;
+        phys += 4;
+        if (open && ((phys & 0xfffu) == 0 || n >= JIT_BLOCK_MAX_INS))
+        {
+            exitTo(pc);
+            open = false;
+        }
+    }
+#undef X
+
+    code_used += (u32)(e.p - start);
+    return (jit_block)start;
+}
+
+void Jit::run(u32 budget)
+{
+    if (emu.debugMode)
+    {
+        emu.emulate();
+        return;
+    }
+
+    // Stop at the next device event so it is handled on time
+    u32 end_clock = cpu.clock + cpu.schedBudget(budget);
+    ins_ret ret;
+    bool first = true;
+
+    cpu.mmio_access = false;
+    for (;;)
+    {
+        jit_block code = nullptr;
+        if ((cpu.pc & 0x3) == 0)
+        {
+            ins_ret fetch = cpu.insReturnNoop();
+            u32 phys_pc = cpu.mmuTranslate(&fetch, cpu.pc, MMU_ACCESS_FETCH);
+            if (!fetch.trap.en)
+                code = lookup(cpu.pc, phys_pc);
+        }
+
+        if (code == nullptr)
+        {
+            // Misaligned PC, fetch fault or code outside RAM: the interpreter
+            // raises the trap or runs the instruction
+            if (first)
+            {
+                emu.emulate();
+                return;
+            }
+            ret = cpu.insReturnNoop();
+            ret.pc_val = cpu.pc;
+            break;
+        }
+        first = false;
+
+        if (code(&cpu, this, end_clock) == JIT_EXIT)
+        {
+            ret = exit_ret;
+            break;
+        }
+        if ((s32)(cpu.clock - end_clock) >= 0)
+        {
+            ret = cpu.insReturnNoop();
+            ret.pc_val = cpu.pc;
+            break;
+        }
+    }
+
+    emu.retire(&ret);
+}
+
+#endif
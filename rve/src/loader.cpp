@@ -122,6 +122,76 @@ int loadElf(const char *path, uint64_t path_len, uint8_t *data, uint64_t data_le
     return 0;
 }
 
+bool elfSymbol(const char *path, const char *name, uint32_t *addr)
+{
+    std::vector<ElfSymbol> syms;
+    if (!elfSymbols(path, syms))
+        return false;
+    for (const auto &sym : syms)
+    {
+        if (sym.name == name)
+        {
+            *addr = sym.addr;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool elfSymbols(const char *path, std::vector<ElfSymbol> &syms)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    Elf32_Ehdr eh;
+    if (read(fd, &eh, sizeof(eh)) != sizeof(eh) ||
+        memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0 || eh.e_ident[EI_CLASS] != ELFCLASS32 ||
+        eh.e_shentsize != sizeof(Elf32_Shdr))
+    {
+        close(fd);
+        return false;
+    }
+
+    std::vector<Elf32_Shdr> sh_tbl(eh.e_shnum);
+    size_t sh_len = sizeof(Elf32_Shdr) * eh.e_shnum;
+    if (pread(fd, sh_tbl.data(), sh_len, eh.e_shoff) != (ssize_t)sh_len)
+    {
+        close(fd);
+        return false;
+    }
+
+    bool found = false;
+    for (const auto &sh : sh_tbl)
+    {
+        // Symbol names live in the string table the symbol table links to
+        if (sh.sh_type != SHT_SYMTAB || sh.sh_link >= sh_tbl.size())
+            continue;
+        const Elf32_Shdr &strtab = sh_tbl[sh.sh_link];
+        std::vector<Elf32_Sym> tbl(sh.sh_size / sizeof(Elf32_Sym));
+        std::vector<char> strs(strtab.sh_size + 1, 0);
+        size_t sym_len = tbl.size() * sizeof(Elf32_Sym);
+        if (pread(fd, tbl.data(), sym_len, sh.sh_offset) != (ssize_t)sym_len ||
+            pread(fd, strs.data(), strtab.sh_size, strtab.sh_offset) != (ssize_t)strtab.sh_size)
+            break;
+        for (const auto &sym : tbl)
+        {
+            if (sym.st_name == 0 || sym.st_name >= strtab.sh_size)
+                continue;
+            ElfSymbol s;
+            s.addr = sym.st_value;
+            s.size = sym.st_size;
+            s.type = ELF32_ST_TYPE(sym.st_info);
+            s.name = strs.data() + sym.st_name;
+            syms.push_back(s);
+        }
+        found = true;
+        break;
+    }
+    close(fd);
+    return found;
+}
+
 int loadBinary(const char *path, uint64_t path_len, uint8_t *data, uint64_t data_len)
 {
     // Ensure the path is null-terminated
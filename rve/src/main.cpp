@@ -1,9 +1,182 @@
 
 #include "stdio.h"
+#ifdef RVE_HEADLESS
+#include "emu.h"
+#else
 #include "app.h"
+#endif
+#include "jit.h"
+#include "snapshot.h"
+#include "batch.h"
+#include "profiler.h"
 #include <cstring>
+#include <signal.h>
+#include <cinttypes>
 #include <sys/time.h>
+#include <sys/resource.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
+// Host timestamp counter for cycles-per-instruction (0 where there is none)
+static uint64_t hostCycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Run up to `budget` instructions in the selected execution mode
+static void runStep(Emulator &emu, Jit *jit, bool single_step, u32 budget)
+{
+    if (jit)
+    {
+#ifdef RVE_JIT
+        jit->run(budget);
+#endif
+    }
+    else if (single_step)
+        emu.emulate();
+    else
+        emu.emulateBlock(budget);
+}
+
+// Snapshot trigger: SIGUSR1, or once `after` instructions have retired
+static volatile sig_atomic_t snapshot_signal = 0;
+
+static void snapshotSignal(int)
+{
+    snapshot_signal = 1;
+}
+
+typedef struct {
+    const char *path;  // nullptr: snapshots disabled
+    uint64_t after;    // Instruction count to save at (0 = signal only)
+} snapshot_trigger;
+
+static void snapshotPoll(Emulator &emu, snapshot_trigger *t)
+{
+    bool due = t->after != 0 && emu.retiredCount() >= t->after;
+    if (!due && !snapshot_signal)
+        return;
+    if (due)
+        t->after = 0;
+    snapshot_signal = 0;
+    emu.cpu.console->flush();
+    snapshotSave(emu, t->path);
+}
+
+// Report trigger: SIGUSR2 writes the profile and statistics so far
+static volatile sig_atomic_t report_signal = 0;
+
+static void reportSignal(int)
+{
+    report_signal = 1;
+}
+
+// Write the --profile and --stats reports that are enabled
+static void reportWrite(Emulator &emu, Profiler *prof, const char *stats_path)
+{
+    if (prof)
+        prof->write();
+#ifdef RV32_STATS
+    if (stats_path)
+        emu.statsWrite(stats_path);
+#endif
+}
+
+// ALU-only microbenchmark (--bench-alu): a loop of dependent integer register
+// operations with no memory accesses, traps or CSRs, which isolates the cost
+// of instruction dispatch and register writeback
+static const u32 bench_alu_program[] = {
+    0x00000293, //       li   t0, 0
+    0x00100313, //       li   t1, 1
+    0x00300393, //       li   t2, 3
+    0x006282b3, // loop: add  t0, t0, t1
+    0x0053c3b3, //       xor  t2, t2, t0
+    0x00339e13, //       slli t3, t2, 3
+    0x405e0333, //       sub  t1, t3, t0
+    0x0ff37e93, //       andi t4, t1, 255
+    0x01d2e2b3, //       or   t0, t0, t4
+    0x0012df13, //       srli t5, t0, 1
+    0x007f3fb3, //       sltu t6, t5, t2
+    0x01f30333, //       add  t1, t1, t6
+    0x00150513, //       addi a0, a0, 1
+    0xfd9ff06f, //       j    loop
+};
+
+// The loop never ends: instructions it runs for when --bench-alu has no count
+const uint64_t BENCH_ALU_INS = 1000000000;
+
+// Throughput benchmark: run until `limit` instructions have retired (0 = no
+// limit), the guest powers off or (bare-metal ELFs only, since a Linux guest's
+// processes make the same call) an exit ecall, then report on stderr. Guest
+// console output stays on stdout.
+static int runBench(Emulator &emu, Jit *jit, bool single_step, uint64_t limit, bool json)
+{
+    const char *mode = jit ? "jit" : single_step ? "interp" : "block";
+    uint64_t start = emu.retiredCount();
+    uint64_t retired = 0;
+
+    double t0 = wallSeconds();
+    uint64_t c0 = hostCycles();
+    while (emu.running && (limit == 0 || retired < limit))
+    {
+        u32 budget = BLOCK_MAX_INS;
+        if (limit != 0 && limit - retired < budget)
+            budget = (u32)(limit - retired);
+
+        // The JIT can run past its budget (see Jit::run): the last block of a
+        // limited run is interpreted so the count comes out exact
+        if (jit && limit != 0 && limit - retired <= BLOCK_MAX_INS)
+            emu.emulateBlock(budget);
+        else
+            runStep(emu, jit, single_step, budget);
+
+        retired = emu.retiredCount() - start;
+    }
+    uint64_t cycles = hostCycles() - c0;
+    double secs = wallSeconds() - t0;
+    emu.cpu.console->flush();
+
+    bool exited = emu.stop_on_exit && emu.exited;
+    const char *stop = exited ? "exit" : !emu.running ? "poweroff" : "limit";
+    double mips = secs > 0 ? retired / secs / 1e6 : 0;
+    double cpi = retired > 0 ? (double)cycles / retired : 0;
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+    long peak_rss_kb = ru.ru_maxrss / 1024; // bytes on macOS
+#else
+    long peak_rss_kb = ru.ru_maxrss;        // KiB on Linux
+#endif
+
+    if (json)
+    {
+        fprintf(stderr, "{\"mode\": \"%s\", \"stop\": \"%s\", \"exit_status\": %u, "
+                        "\"instructions\": %" PRIu64 ", \"seconds\": %.6f, \"mips\": %.2f, "
+                        "\"host_cycles_per_ins\": %.2f, \"peak_rss_kb\": %ld}\n",
+                mode, stop, emu.exit_status, retired, secs, mips, cpi, peak_rss_kb);
+    }
+    else
+    {
+        fprintf(stderr, "INFO: bench mode:         %s\n", mode);
+        fprintf(stderr, "INFO: bench stopped on:   %s", stop);
+        if (exited)
+            fprintf(stderr, " (status %u)", emu.exit_status);
+        fprintf(stderr, "\n");
+        fprintf(stderr, "INFO: bench instructions: %" PRIu64 "\n", retired);
+        fprintf(stderr, "INFO: bench wall time:    %.3f s\n", secs);
+        fprintf(stderr, "INFO: bench MIPS:         %.2f\n", mips);
+        if (cycles != 0)
+            fprintf(stderr, "INFO: bench host cycles:  %.2f per instruction\n", cpi);
+        fprintf(stderr, "INFO: bench peak RSS:     %ld KiB\n", peak_rss_kb);
+    }
+    return exited ? (int)emu.exit_status : 0;
+}
 
 // Headless emulation loop 
 // The emulator's captureKeyboardInput() (called from Emulator::initialize()) puts the
@@ -13,42 +186,234 @@ static int runHeadless(int argc, char *argv[])
     Emulator emu;
 
     const char *bin_file = nullptr;
+    const char *elf_file = nullptr;
+    const char *restore_file = nullptr;
+    bool single_step = false;
+    bool use_jit = false;
+    bool wfi_sleep = true;
+    bool bench = false;
+    bool bench_json = false;
+    bool bench_alu = false;
+    uint64_t bench_limit = 0;
+    snapshot_trigger snap = {nullptr, 0};
+    Profiler prof;
+    bool profile = false;
+    const char *profile_map = nullptr;
+    const char *stats_path = nullptr;
     for (int i = 1; i < argc; i++)
     {
         if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
             bin_file = argv[++i];
+        else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+            elf_file = argv[++i];
+        else if (strcmp(argv[i], "-i") == 0)
+            single_step = true;
+        else if (strcmp(argv[i], "-j") == 0)
+            use_jit = true;
+        else if (strcmp(argv[i], "-p") == 0)
+            wfi_sleep = false;
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+            emu.mem_size = (u32)strtoul(argv[++i], nullptr, 0) << 20;
+        else if (strcmp(argv[i], "--smp") == 0 && i + 1 < argc)
+            emu.hart_count = (u32)strtoul(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "--bench") == 0)
+        {
+            bench = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                bench_limit = strtoull(argv[++i], nullptr, 0);
+        }
+        else if (strcmp(argv[i], "--bench-alu") == 0)
+        {
+            bench = bench_alu = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-')
+                bench_limit = strtoull(argv[++i], nullptr, 0);
+        }
+        else if (strcmp(argv[i], "--json") == 0)
+            bench_json = true;
+        else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc)
+            restore_file = argv[++i];
+        else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc)
+            snap.path = argv[++i];
+        else if (strcmp(argv[i], "--snapshot-after") == 0 && i + 1 < argc)
+            snap.after = strtoull(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+        {
+            profile = true;
+            prof.prefix = argv[++i];
+        }
+        else if (strcmp(argv[i], "--profile-period") == 0 && i + 1 < argc)
+            prof.period = (u32)strtoul(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "--profile-map") == 0 && i + 1 < argc)
+            profile_map = argv[++i];
+        else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc)
+            stats_path = argv[++i];
     }
 
-    if (!bin_file)
+    if (!bin_file && !elf_file && !restore_file && !bench_alu)
     {
-        fprintf(stderr, "ERRO: headless mode requires -b <image>\n");
+        fprintf(stderr, "ERRO: headless mode requires -b <image>, -e <elf> or --restore <snapshot>\n");
         return 1;
     }
+#ifndef RV32_STATS
+    if (stats_path)
+    {
+        fprintf(stderr, "ERRO: --stats needs a build with statistics (make STATS=1)\n");
+        return 1;
+    }
+#endif
 
-    emu.initializeBin(bin_file);
+    // Before initialization, so other harts pick it up too. A benchmark always
+    // busy-waits: time the guest sleeps in WFI would count as run time.
+    if (!wfi_sleep || bench)
+        emu.wfi_sleep_max = 0;
+    if (bench_alu)
+    {
+        emu.initializeProgram(bench_alu_program, sizeof(bench_alu_program) / sizeof(u32));
+        if (bench_limit == 0)
+            bench_limit = BENCH_ALU_INS;
+    }
+    else if (restore_file)
+        emu.initializeSnapshot(restore_file);
+    else if (elf_file)
+        emu.initializeElf(elf_file);
+    else
+        emu.initializeBin(bin_file);
     if (!emu.ready_to_run)
     {
         fprintf(stderr, "ERRO: failed to load binary image\n");
         return 1;
     }
 
+    emu.stop_on_exit = bench && elf_file != nullptr;
     emu.running = true;
 
+    Jit *jit = nullptr;
+#ifdef RVE_JIT
+    Jit jit_backend(emu);
+    if (use_jit)
+    {
+        if (!jit_backend.init())
+            return 1;
+        jit = &jit_backend;
+    }
+#else
+    if (use_jit)
+        fprintf(stderr, "WARN: JIT not available on this host, interpreting\n");
+#endif
+
+    if (profile)
+    {
+        // Symbols: a System.map for kernel images, else the ELF's own
+        if (profile_map)
+            prof.loadSystemMap(profile_map);
+        else if (elf_file)
+            prof.loadElfSymbols(elf_file);
+        prof.attach(emu.cpu);
+    }
+    if (stats_path && jit)
+        fprintf(stderr, "WARN: stats: instructions run by translated code are not counted\n");
+    Profiler *report_prof = profile ? &prof : nullptr;
+    if (profile || stats_path)
+        signal(SIGUSR2, reportSignal);
+
+    if (bench)
+    {
+        int status = runBench(emu, jit, single_step, bench_limit, bench_json);
+        reportWrite(emu, report_prof, stats_path);
+        return status;
+    }
+
+    if (snap.path)
+        signal(SIGUSR1, snapshotSignal);
+
     // Run as fast as possible
-    // UART output goes to stdout, UART input comes from stdin (raw mode).
+    // UART output goes to the console thread (stdout), UART input comes from stdin (raw mode).
+    // Block mode polls devices once per block; -i polls after every instruction.
     while (emu.running)
-        emu.emulate();
+    {
+        runStep(emu, jit, single_step, BLOCK_MAX_INS);
+        if (snap.path)
+            snapshotPoll(emu, &snap);
+        if (report_signal)
+        {
+            report_signal = 0;
+            emu.cpu.console->flush();
+            reportWrite(emu, report_prof, stats_path);
+        }
+    }
 
+    reportWrite(emu, report_prof, stats_path);
     return 0;
 }
 
 
+// Batch mode: every non-option argument is a machine of its own (see batch.h)
+static int runBatch(int argc, char *argv[])
+{
+    Batch batch;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--batch") == 0)
+            continue;
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            batch.out_dir = argv[++i];
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            batch.threads = (u32)strtoul(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "-j") == 0)
+            batch.use_jit = true;
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+            batch.mem_size = (u32)strtoul(argv[++i], nullptr, 0) << 20;
+        else if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc)
+            batch.limit = strtoull(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "--quantum") == 0 && i + 1 < argc)
+            batch.quantum = (u32)strtoul(argv[++i], nullptr, 0);
+        else if (argv[i][0] != '-')
+            batch.add(argv[i]);
+    }
+    return batch.run();
+}
+
 int main(int argc, char *argv[])
 {
     // -n  : headless / no-GUI mode 
+    // -i  : (headless) execute one instruction per step instead of blocks
+    // -j  : (headless) translate guest code to host code (x86-64 JIT)
+    // -e  : (headless) load an ELF instead of a -b image
+    // -p  : (headless) busy-wait on WFI instead of sleeping the host (always
+    //       on with --bench and --bench-alu)
+    // -m  : (headless) guest RAM in MiB (default 128; a snapshot keeps its own)
+    // --smp N : (headless) run N harts, one host thread each (default 1, max 8)
+    // --bench [N] : (headless) run N instructions (default: until poweroff or
+    //               an exit ecall) and report MIPS; --json for machine output
+    // --bench-alu [N] : (headless) the same on a built-in ALU-only loop instead
+    //                   of an image (default 1e9 instructions)
+    // --snapshot <file>   : (headless) save the machine to <file> on SIGUSR1
+    // --snapshot-after N  : (headless) ... or once N instructions have retired
+    // --restore <file>    : (headless) resume from a snapshot instead of -b/-e
+    // --profile <prefix>  : (headless) sample the guest PC and write
+    //                       <prefix>.flat and <prefix>.folded at exit and on
+    //                       SIGUSR2 (see profiler.h); --profile-period N
+    //                       instructions between samples (default 10007),
+    //                       --profile-map <System.map> for -b kernel images
+    // --stats <file>      : (headless, make STATS=1 builds) write instruction,
+    //                       branch, trap, page-walk and MMIO counts to <file>
+    //                       at exit and on SIGUSR2: JSON for *.json, else CSV
+    // --batch <file>...   : run every <file> (ELF, image or snapshot) as its own
+    //                       machine in this process; -o <dir> for the UART
+    //                       logs, -t <threads>, -j, -m, --limit N, --quantum N
+    // rve-headless (RVE_HEADLESS) has no GUI and is always headless
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--batch") == 0)
+            return runBatch(argc, argv);
+    }
+#ifdef RVE_HEADLESS
+    return runHeadless(argc, argv);
+#else
     for (int i = 1; i < argc; i++)
     {
-        if (strcmp(argv[i], "-n") == 0)
+        if (strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "--bench") == 0 ||
+            strcmp(argv[i], "--bench-alu") == 0 || strcmp(argv[i], "--restore") == 0)
             return runHeadless(argc, argv);
     }
 
@@ -61,4 +426,5 @@ int main(int argc, char *argv[])
     app.destroyUI();
 
     return 0;
+#endif
 }
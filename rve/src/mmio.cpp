@@ -0,0 +1,130 @@
+#include "mmio.h"
+#include <stdio.h>
+
+MmioBus::MmioBus()
+{
+    reset();
+}
+
+void MmioBus::reset()
+{
+    device_count = 0;
+    dir_count = 0;
+#ifdef RV32_STATS
+    unmapped_reads = 0;
+    unmapped_writes = 0;
+#endif
+    memset(dirs, 0, sizeof(dirs));
+    memset(pages, 0, sizeof(pages));
+}
+
+bool MmioBus::map(const char *name, u32 base, u32 size, void *opaque,
+                  mmio_read_fn read, mmio_write_fn write)
+{
+    if (size == 0 || base >= 0x80000000u || size > 0x80000000u - base)
+    {
+        fprintf(stderr, "ERRO: mmio: %s window 0x%08x+0x%x is outside the MMIO space\n",
+                name, base, size);
+        return false;
+    }
+    if (device_count == MMIO_MAX_DEVICES)
+    {
+        fprintf(stderr, "ERRO: mmio: too many devices, cannot map %s\n", name);
+        return false;
+    }
+
+    u8 idx = (u8)(device_count + 1);
+    mmio_device *d = &devices[device_count];
+    d->name = name;
+    d->base = base;
+    d->size = size;
+    d->opaque = opaque;
+    d->read = read;
+    d->write = write;
+    d->shadow = 0;
+#ifdef RV32_STATS
+    d->reads = 0;
+    d->writes = 0;
+#endif
+
+    u32 last = base + size - 1;
+    for (u32 page = base >> MMIO_PAGE_SHIFT; page <= last >> MMIO_PAGE_SHIFT; page++)
+    {
+        u32 region = page >> (MMIO_DIR_SHIFT - MMIO_PAGE_SHIFT);
+        if (dirs[region] == 0)
+        {
+            if (dir_count == MMIO_MAX_DIRS)
+            {
+                fprintf(stderr, "ERRO: mmio: out of page tables, cannot map %s\n", name);
+                return false;
+            }
+            dirs[region] = (u8)(++dir_count);
+        }
+
+        u8 *entry = &pages[dirs[region] - 1][page & (MMIO_DIR_PAGES - 1)];
+        u32 page_base = page << MMIO_PAGE_SHIFT;
+        bool whole_page = base <= page_base && last >= page_base + 0xfffu;
+        if (*entry != 0 && !whole_page)
+        {
+            // Partly covered page: the previous owner answers outside this window
+            if (d->shadow != 0 && d->shadow != *entry)
+            {
+                fprintf(stderr, "ERRO: mmio: %s overlaps more than one device\n", name);
+                return false;
+            }
+            d->shadow = *entry;
+        }
+        *entry = idx;
+    }
+
+    device_count++;
+    return true;
+}
+
+u32 MmioBus::read(u32 addr, u32 size)
+{
+    mmio_device *d = find(addr);
+    if ((addr & (size - 1)) != 0 || (d != nullptr && addr - d->base + size > d->size))
+    {
+        // Misaligned, or running past the end of the window
+        u32 val = 0;
+        for (u32 i = 0; i < size; i++)
+            val |= read(addr + i, 1) << (i * 8);
+        return val;
+    }
+    STATS_INC(d != nullptr ? d->reads : unmapped_reads);
+    if (d == nullptr || d->read == nullptr)
+        return 0; // unmapped MMIO
+    return d->read(d->opaque, addr - d->base, size);
+}
+
+void MmioBus::write(u32 addr, u32 val, u32 size)
+{
+    mmio_device *d = find(addr);
+    if ((addr & (size - 1)) != 0 || (d != nullptr && addr - d->base + size > d->size))
+    {
+        for (u32 i = 0; i < size; i++)
+            write(addr + i, (val >> (i * 8)) & 0xff, 1);
+        return;
+    }
+    STATS_INC(d != nullptr ? d->writes : unmapped_writes);
+    if (d == nullptr || d->write == nullptr)
+        return; // unmapped MMIO write — ignore
+    d->write(d->opaque, addr - d->base, val, size);
+}
+
+u32 mmioReadBuffer(void *opaque, u32 offset, u32 size)
+{
+    const u8 *p = (const u8 *)opaque + offset;
+    u32 val = 0;
+    for (u32 i = 0; i < size; i++)
+        val |= (u32)p[i] << (i * 8);
+    return val;
+}
+
+void mmioWriteBuffer(void *opaque, u32 offset, u32 val, u32 size)
+{
+    u8 *p = (u8 *)opaque + offset;
+    for (u32 i = 0; i < size; i++)
+        p[i] = (u8)(val >> (i * 8));
+}
@@ -0,0 +1,196 @@
+#include "profiler.h"
+#include "rv32.h"
+#include "loader.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <cinttypes>
+#include <map>
+
+///////////////////////////////////////
+// Symbols
+///////////////////////////////////////
+bool Profiler::loadElfSymbols(const char *path)
+{
+    std::vector<ElfSymbol> syms;
+    if (!elfSymbols(path, syms))
+    {
+        fprintf(stderr, "WARN: profiler: no symbol table in %s\n", path);
+        return false;
+    }
+    for (const ElfSymbol &s : syms)
+    {
+        // Functions, and the untyped labels of assembly sources
+        if ((s.type != STT_FUNC && s.type != STT_NOTYPE) || s.addr == 0 || s.name[0] == '$')
+            continue;
+        prof_symbol p;
+        p.addr = s.addr;
+        p.end = s.size != 0 ? s.addr + s.size : 0;
+        p.name = s.name;
+        symbols.push_back(p);
+    }
+    kernel_symbols = false;
+    sortSymbols();
+    fprintf(stderr, "INFO: profiler: %u symbols from %s\n", (u32)symbols.size(), path);
+    return true;
+}
+
+bool Profiler::loadSystemMap(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        fprintf(stderr, "WARN: profiler: cannot read %s\n", path);
+        return false;
+    }
+    // "<address> <type> <name>"; text symbols only, up to _etext
+    char line[512];
+    char name[256];
+    char type;
+    u32 addr;
+    u32 etext = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "%x %c %255s", &addr, &type, name) != 3)
+            continue;
+        if (strcmp(name, "_etext") == 0)
+            etext = addr;
+        if (strchr("tTwW", type) == NULL)
+            continue;
+        prof_symbol p;
+        p.addr = addr;
+        p.end = 0;
+        p.name = name;
+        symbols.push_back(p);
+    }
+    fclose(f);
+    kernel_symbols = true;
+    sortSymbols();
+    if (!symbols.empty() && etext > symbols.back().addr)
+        symbols.back().end = etext;
+    fprintf(stderr, "INFO: profiler: %u symbols from %s\n", (u32)symbols.size(), path);
+    return true;
+}
+
+// Sort by address, keeping the first symbol at each address
+void Profiler::sortSymbols()
+{
+    std::stable_sort(symbols.begin(), symbols.end(),
+                     [](const prof_symbol &a, const prof_symbol &b) { return a.addr < b.addr; });
+    symbols.erase(std::unique(symbols.begin(), symbols.end(),
+                              [](const prof_symbol &a, const prof_symbol &b) { return a.addr == b.addr; }),
+                  symbols.end());
+}
+
+const prof_symbol *Profiler::lookup(u32 pc, u32 priv)
+{
+    if (kernel_symbols && priv == PRIV_USER)
+        return nullptr;
+    auto it = std::upper_bound(symbols.begin(), symbols.end(), pc,
+                               [](u32 v, const prof_symbol &s) { return v < s.addr; });
+    if (it == symbols.begin())
+        return nullptr;
+    const prof_symbol &s = *(it - 1);
+    if (s.end != 0 && pc >= s.end)
+        return nullptr;
+    return &s;
+}
+
+///////////////////////////////////////
+// Sampling
+///////////////////////////////////////
+void Profiler::attach(RV32 &cpu)
+{
+    if (period == 0)
+        period = 1;
+    cpu.prof = this;
+    cpu.schedule(SCHED_PROF, period);
+}
+
+u32 Profiler::sample(u32 pc, u32 priv)
+{
+    hist[(u64)priv << 32 | pc]++;
+    samples++;
+
+    // xorshift32 jitter of up to +/- period / 8
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    u32 spread = period / 4;
+    return period - spread / 2 + (spread ? rng % (spread + 1) : 0);
+}
+
+///////////////////////////////////////
+// Reports
+///////////////////////////////////////
+static const char *privName(u32 priv)
+{
+    switch (priv)
+    {
+    case PRIV_USER: return "user";
+    case PRIV_SUPERVISOR: return "supervisor";
+    case PRIV_MACHINE: return "machine";
+    default: return "?";
+    }
+}
+
+// (mode, function)
+typedef std::pair<u32, std::string> prof_key;
+
+bool Profiler::write()
+{
+    // Samples per function
+    std::map<prof_key, u64> funcs;
+    for (const auto &h : hist)
+    {
+        u32 priv = (u32)(h.first >> 32);
+        u32 pc = (u32)h.first;
+        const prof_symbol *s = lookup(pc, priv);
+        char addr[16];
+        if (s == nullptr)
+            snprintf(addr, sizeof(addr), "0x%08x", pc);
+        funcs[std::make_pair(priv, s ? s->name : std::string(addr))] += h.second;
+    }
+
+    std::string flat_path = prefix + ".flat";
+    std::string folded_path = prefix + ".folded";
+    FILE *flat = fopen(flat_path.c_str(), "w");
+    FILE *folded = fopen(folded_path.c_str(), "w");
+    if (flat == NULL || folded == NULL)
+    {
+        fprintf(stderr, "ERRO: profiler: cannot write %s\n", flat ? folded_path.c_str() : flat_path.c_str());
+        if (flat)
+            fclose(flat);
+        if (folded)
+            fclose(folded);
+        return false;
+    }
+
+    std::vector<std::pair<u64, prof_key>> order;
+    for (const auto &f : funcs)
+    {
+        order.push_back(std::make_pair(f.second, f.first));
+        fprintf(folded, "%s;%s %" PRIu64 "\n", privName(f.first.first), f.first.second.c_str(), f.second);
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [](const std::pair<u64, prof_key> &a, const std::pair<u64, prof_key> &b) {
+                         return a.first > b.first;
+                     });
+
+    fprintf(flat, "# rve profile: %" PRIu64 " samples, one per ~%u instructions\n", samples, period);
+    fprintf(flat, "# %10s %7s %7s  %-10s  %s\n", "samples", "%", "cum %", "mode", "function");
+    u64 cum = 0;
+    for (const auto &o : order)
+    {
+        cum += o.first;
+        fprintf(flat, "  %10" PRIu64 " %6.2f%% %6.2f%%  %-10s  %s\n", o.first,
+                100.0 * o.first / samples, 100.0 * cum / samples,
+                privName(o.second.first), o.second.second.c_str());
+    }
+
+    bool ok = !ferror(flat) && !ferror(folded);
+    fclose(flat);
+    fclose(folded);
+    fprintf(stderr, "INFO: profiler: %" PRIu64 " samples -> %s, %s\n", samples, flat_path.c_str(), folded_path.c_str());
+    return ok;
+}
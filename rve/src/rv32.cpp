@@ -1,18 +1,103 @@
 #include "rv32.h"
 #include "net.h"
-#include <sys/ioctl.h>
+#include "smp.h"
+#include "profiler.h"
+#include <sys/select.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 
 RV32::RV32(/* args */)
 {
+    console = nullptr;
+    clock = 0;
+    mem_size = 0;
+    page_flags = nullptr;
+    net.nettx = nullptr;
+    net.netrx = nullptr;
+    wake_fd[0] = -1;
+    wake_fd[1] = -1;
+    net_reset(&netlink);
+    hart_id = 0;
+    smp = nullptr;
+    dev = this;
+    prof = nullptr;
 }
 
 RV32::~RV32()
 {
+    if (dev == this)
+        delete console;
+    free(page_flags);
+    free(net.nettx);
+    free(net.netrx);
+    net_close(&netlink);
+    if (wake_fd[0] != -1)
+    {
+        close(wake_fd[0]);
+        close(wake_fd[1]);
+    }
 }
 
-bool RV32::init(u8 *memory, u8 *dtb, bool debug_mode, u8 *mtd, u32 mtd_size)
+bool RV32::init(u8 *memory, u32 mem_size, u8 *dtb, bool debug_mode, u8 *mtd, u32 mtd_size)
+{
+    hart_id = 0;
+    dev = this;
+    reset(memory, mem_size, debug_mode);
+    if (console == nullptr)
+        console = new Console();
+
+    this->dtb = dtb;
+    this->mtd = mtd;
+    this->mtd_size = mtd_size;
+
+    uart.rbr_thr_ier_iir = 0;
+    uart.lcr_mcr_lsr_scr = 0x00600000; // LSR THRE|TEMT both set (0x60 at shift 16)
+    uart.thre_ip = false;
+    uart.interrupting = false;
+
+    net.rx_ready = 0;
+    if (net.nettx == nullptr)
+    {
+        net.nettx = (u8 *)malloc(4096);
+        net.netrx = (u8 *)malloc(4096);
+    }
+    memset(net.nettx, 0, 4096);
+    memset(net.netrx, 0, 4096);
+
+    kbd_head = kbd_tail = 0;
+    rtc0 = 0;
+    rtc1 = 0;
+    syscon_cmd = 0;
+
+    busInit();
+    return true;
+}
+
+void RV32::initHart(RV32 &boot, u32 id)
+{
+    dev = &boot;
+    reset(boot.mem, boot.mem_size, boot.debug_single_step);
+    // IPIs from the other harts end this hart's idle sleeps
+    wakeInit();
+    hart_id = id;
+    smp = boot.smp;
+    console = boot.console;
+    dtb = boot.dtb;
+    mtd = boot.mtd;
+    mtd_size = boot.mtd_size;
+    kbd_head = kbd_tail = 0;
+    syscon_cmd = 0;
+    uart.thre_ip = false;
+    uart.interrupting = false;
+    // One mtime for the whole machine
+    start_time_sec = boot.start_time_sec;
+    start_time_usec = boot.start_time_usec;
+    busInit();
+}
+
+// Per-hart state: registers, CSRs, CLINT, MMU, decode flags and scheduler
+void RV32::reset(u8 *memory, u32 mem_size, bool debug_mode)
 {
     // reset clock
     clock = 0;
@@ -24,39 +109,37 @@ bool RV32::init(u8 *memory, u8 *dtb, bool debug_mode, u8 *mtd, u32 mtd_size)
     xreg[0xb] = 0x1020; // For Linux / device tree pointer
     pc = 0x80000000;
     mem = memory;
+    if (page_flags == nullptr || this->mem_size != mem_size)
+    {
+        free(page_flags);
+        page_flags = (u8 *)malloc(mem_size / RV32_PAGE_SIZE);
+    }
+    this->mem_size = mem_size;
     reservation_en = false;
     reservation_addr = 0;
-    kbd_head = kbd_tail = 0;
-
+    reservation_val = 0;
+    mmio_access = false;
+    wfi = false;
+    timer_dirty = false;
+    sched_post = 0;
+    memset(page_flags, 0, mem_size / RV32_PAGE_SIZE);
+#ifdef RV32_STATS
+    memset(&stats, 0, sizeof(stats));
+#endif
     initCSRs();
 
     debug_single_step = debug_mode;
 
-    this->dtb = dtb;
-    this->mtd = mtd;
-    this->mtd_size = mtd_size;
-
     clint.msip = false;
+    clint.mtip = false;
     clint.mtimecmp_lo = 0;
     clint.mtimecmp_hi = 0;
     clint.mtime_lo = 0;
     clint.mtime_hi = 0;
 
-    uart.rbr_thr_ier_iir = 0;
-    uart.lcr_mcr_lsr_scr = 0x00600000; // LSR THRE|TEMT both set (0x60 at shift 16)
-    uart.thre_ip = false;
-    uart.interrupting = false;
-
     mmu.mode = MMU_MODE_OFF;
     mmu.ppn  = 0;
-
-    net.rx_ready = 0;
-    net.nettx = (u8 *)malloc(4096);
-    net.netrx = (u8 *)malloc(4096);
-
-    rtc0 = 0;
-    rtc1 = 0;
-    syscon_cmd = 0;
+    tlbFlush();
 
     // Record wall-clock start time for CLINT mtime
     struct timeval tv;
@@ -64,7 +147,7 @@ bool RV32::init(u8 *memory, u8 *dtb, bool debug_mode, u8 *mtd, u32 mtd_size)
     start_time_sec  = (int64_t)tv.tv_sec;
     start_time_usec = (int32_t)tv.tv_usec;
 
-    return true;
+    schedReset();
 }
 
 void RV32::initCSRs()
@@ -100,14 +183,6 @@ void RV32::tick()
     // emulate(cpu);
 }
 
-ins_ret RV32::insReturnNoop()
-{
-    ins_ret ret;
-    memset(&ret, 0, sizeof(ins_ret));
-    ret.pc_val = pc + 4;
-    return ret;
-}
-
 ///////////////////////////////////////
 // CSR Functions
 ///////////////////////////////////////
@@ -138,9 +213,10 @@ u32 RV32::readCsrRaw(u32 address)
     case CSR_CYCLE:
         return clock;
     case CSR_TIME:
+        clintSync();
         return clint.mtime_lo;
     case CSR_MHARTID:
-        return 0;
+        return hart_id;
     case CSR_SATP:
         return (mmu.mode << 31) | mmu.ppn;
     case CSR_NET_TX_BUF_ADDR:
@@ -184,15 +260,15 @@ void RV32::writeCsrRaw(u32 address, u32 value)
         // ignore writes to time counter
         break;
     case CSR_NET_TX_BUF_SIZE_AND_SEND:
-        net_send(net.nettx, value);
-        break;
     case CSR_NET_RX_BUF_READY:
-        net.rx_ready = value;
+        netCsrWrite(address, value);
         break;
     default:
         csr.data[address] = value;
         break;
     };
+    if (address == CSR_MSTATUS || address == CSR_SSTATUS)
+        tlbSync();
 }
 
 u32 RV32::getCsr(u32 address, ins_ret *ret)
@@ -334,6 +410,7 @@ bool RV32::handleTrap(ins_ret *ret, bool isInterrupt)
 
     // should be handled
     csr.privilege = new_privilege;
+    tlbSync();
 
     u32 csr_epc_addr = new_privilege == PRIV_MACHINE ? CSR_MEPC : (new_privilege == PRIV_SUPERVISOR ? CSR_SEPC : CSR_UEPC);
     u32 csr_cause_addr = new_privilege == PRIV_MACHINE ? CSR_MCAUSE : (new_privilege == PRIV_SUPERVISOR ? CSR_SCAUSE : CSR_UCAUSE);
@@ -403,6 +480,7 @@ void RV32::handleIrqAndTrap(ins_ret *ret)
 
     if (t.en)
     {
+        STATS_INC((irq ? stats.interrupts : stats.exceptions)[t.type & 15]);
         ret->trap = t;
         bool handled = handleTrap(ret, irq);
         if (handled && irq)
@@ -423,110 +501,12 @@ u32 RV32::memGetByte(u32 addr)
     if ((addr & 0x80000000u) == 0)
     {
         // ---- Low-address MMIO ----
-
-        // Device Tree Blob at 0x1020–0x1fff
-        if (dtb != nullptr && addr >= 0x1020u && addr <= 0x1fffu)
-            return dtb[addr - 0x1020u];
-
-        // MTD (initrd / flash) at 0x40000000
-        if (mtd != nullptr && addr >= 0x40000000u && addr < (0x40000000u + mtd_size))
-            return mtd[addr - 0x40000000u];
-
-        // Network RX DMA buffer at 0x11001000–0x11001fff
-        if (addr >= 0x11001000u && addr < 0x11002000u)
-            return net.netrx[addr - 0x11001000u];
-
-        // RTC at 0x03000000–0x030007ff
-        if (addr >= RTC_MMIO_BASE && addr < (RTC_MMIO_BASE + RTC_MMIO_SIZE))
-            return rtcRead(addr - RTC_MMIO_BASE);
-
-        switch (addr)
-        {
-        // CLINT (SiFive 0x02000000 base — used by ELF tests)
-        case 0x02000000u: return clint.msip ? 1 : 0;
-        case 0x02000001u: return 0;
-        case 0x02000002u: return 0;
-        case 0x02000003u: return 0;
-
-        case 0x02004000u: return (clint.mtimecmp_lo >>  0) & 0xFF;
-        case 0x02004001u: return (clint.mtimecmp_lo >>  8) & 0xFF;
-        case 0x02004002u: return (clint.mtimecmp_lo >> 16) & 0xFF;
-        case 0x02004003u: return (clint.mtimecmp_lo >> 24) & 0xFF;
-        case 0x02004004u: return (clint.mtimecmp_hi >>  0) & 0xFF;
-        case 0x02004005u: return (clint.mtimecmp_hi >>  8) & 0xFF;
-        case 0x02004006u: return (clint.mtimecmp_hi >> 16) & 0xFF;
-        case 0x02004007u: return (clint.mtimecmp_hi >> 24) & 0xFF;
-
-        case 0x0200bff8u: return (clint.mtime_lo >>  0) & 0xFF;
-        case 0x0200bff9u: return (clint.mtime_lo >>  8) & 0xFF;
-        case 0x0200bffau: return (clint.mtime_lo >> 16) & 0xFF;
-        case 0x0200bffbu: return (clint.mtime_lo >> 24) & 0xFF;
-        case 0x0200bffcu: return (clint.mtime_hi >>  0) & 0xFF;
-        case 0x0200bffdu: return (clint.mtime_hi >>  8) & 0xFF;
-        case 0x0200bffeu: return (clint.mtime_hi >> 16) & 0xFF;
-        case 0x0200bfffu: return (clint.mtime_hi >> 24) & 0xFF;
-
-        // CLINT ( 0x11000000 base — matches default DTB)
-        case 0x11000000u: return clint.msip ? 1 : 0;
-        case 0x11000001u: return 0;
-        case 0x11000002u: return 0;
-        case 0x11000003u: return 0;
-
-        case 0x11004000u: return (clint.mtimecmp_lo >>  0) & 0xFF;
-        case 0x11004001u: return (clint.mtimecmp_lo >>  8) & 0xFF;
-        case 0x11004002u: return (clint.mtimecmp_lo >> 16) & 0xFF;
-        case 0x11004003u: return (clint.mtimecmp_lo >> 24) & 0xFF;
-        case 0x11004004u: return (clint.mtimecmp_hi >>  0) & 0xFF;
-        case 0x11004005u: return (clint.mtimecmp_hi >>  8) & 0xFF;
-        case 0x11004006u: return (clint.mtimecmp_hi >> 16) & 0xFF;
-        case 0x11004007u: return (clint.mtimecmp_hi >> 24) & 0xFF;
-
-        case 0x1100bff8u: return (clint.mtime_lo >>  0) & 0xFF;
-        case 0x1100bff9u: return (clint.mtime_lo >>  8) & 0xFF;
-        case 0x1100bffau: return (clint.mtime_lo >> 16) & 0xFF;
-        case 0x1100bffbu: return (clint.mtime_lo >> 24) & 0xFF;
-        case 0x1100bffcu: return (clint.mtime_hi >>  0) & 0xFF;
-        case 0x1100bffdu: return (clint.mtime_hi >>  8) & 0xFF;
-        case 0x1100bffeu: return (clint.mtime_hi >> 16) & 0xFF;
-        case 0x1100bfffu: return (clint.mtime_hi >> 24) & 0xFF;
-
-        // UART
-        case 0x10000000u:
-            if ((UART_GET2(LCR) >> 7) == 0)
-            {
-                u32 rbr = UART_GET1(RBR);
-                UART_SET1(RBR, 0);
-                UART_SET2(LSR, (UART_GET2(LSR) & ~LSR_DATA_AVAILABLE));
-                uartUpdateIir();
-                return rbr;
-            }
-            return 0;
-        case 0x10000001u: return UART_GET2(LCR) >> 7 == 0 ? UART_GET1(IER) : 0;
-        case 0x10000002u: return UART_GET1(IIR);
-        case 0x10000003u: return UART_GET2(LCR);
-        case 0x10000004u: return UART_GET2(MCR);
-        case 0x10000005u: return UART_GET2(LSR);
-        case 0x10000007u: return UART_GET2(SCR);
-
-        // MMIO keyboard: KBDSTAT
-        case 0x10001000u:
-            if (kbd_head == kbd_tail) return 0;
-            return 1u | (kbd_buf[kbd_head].release ? 2u : 0u);
-        // MMIO keyboard: KBDDATA (reading clears KBDSTAT.bit0 by consuming entry)
-        case 0x10001001u: {
-            if (kbd_head == kbd_tail) return 0;
-            u8 k = kbd_buf[kbd_head].keycode;
-            kbd_head = (kbd_head + 1) % 64;
-            return k;
-        }
-        }
-
-        return 0; // unmapped MMIO
+        return busRead(addr, 1);
     }
 
     // ---- RAM (bit 31 set) ----
     u32 phys = addr & 0x7FFFFFFFu;
-    if (phys >= (u32)RV32_MEM_SIZE)
+    if (phys >= mem_size)
         return 0;
     return mem[phys];
 }
@@ -537,28 +517,25 @@ u32 RV32::memGetHalfWord(u32 addr)
     if (addr & 0x80000000u)
     {
         u32 phys = addr & 0x7FFFFFFFu;
-        if (phys <= (u32)(RV32_MEM_SIZE - 2))
+        if (phys <= mem_size - 2)
             return ((u32)mem[phys]) | ((u32)mem[phys + 1] << 8);
         return 0;
     }
-    return memGetByte(addr) | ((u32)memGetByte(addr + 1) << 8);
+    return busRead(addr, 2);
 }
 
 u32 RV32::memGetWord(u32 addr)
 {
-    // Fast path: RAM addresses have bit 31 set — skip MMIO dispatch (4x cheaper)
+    // Fast path: RAM addresses have bit 31 set — skip MMIO dispatch
     if (addr & 0x80000000u)
     {
         u32 phys = addr & 0x7FFFFFFFu;
-        if (phys <= (u32)(RV32_MEM_SIZE - 4))
+        if (phys <= mem_size - 4)
             return ((u32)mem[phys]) | ((u32)mem[phys + 1] << 8) |
                    ((u32)mem[phys + 2] << 16) | ((u32)mem[phys + 3] << 24);
         return 0;
     }
-    return memGetByte(addr) |
-           ((u32)memGetByte(addr + 1) << 8) |
-           ((u32)memGetByte(addr + 2) << 16) |
-           ((u32)memGetByte(addr + 3) << 24);
+    return busRead(addr, 4);
 }
 
 void RV32::memSetByte(u32 addr, u32 val)
@@ -566,124 +543,16 @@ void RV32::memSetByte(u32 addr, u32 val)
     if ((addr & 0x80000000u) == 0)
     {
         // ---- Low-address MMIO ----
-
-        // CLINT ( 0x11000000 base) msip — must precede network TX buffer
-        if (addr >= 0x11000000u && addr < 0x11000004u)
-        {
-            if (addr == 0x11000000u) clint.msip = (val & 1) != 0;
-            return;
-        }
-
-        // Network TX DMA buffer at 0x11000004–0x11000fff
-        if (addr >= 0x11000004u && addr < 0x11001000u)
-        {
-            net.nettx[addr - 0x11000000u] = (u8)val;
-            return;
-        }
-
-        // RTC at 0x03000000–0x030007ff
-        if (addr >= RTC_MMIO_BASE && addr < (RTC_MMIO_BASE + RTC_MMIO_SIZE))
-        {
-            rtcWrite(addr - RTC_MMIO_BASE, (u8)val);
-            return;
-        }
-
-        // Writing to mtimecmp clears MTIP/STIP (spec requirement)
-        if ((addr >= 0x02004000u && addr < 0x02004008u) ||
-            (addr >= 0x11004000u && addr < 0x11004008u))
-        {
-            u32 cur_mip = readCsrRaw(CSR_MIP);
-            writeCsrRaw(CSR_MIP, cur_mip & ~(MIP_MTIP | MIP_STIP));
-        }
-
-        switch (addr)
-        {
-        // CLINT
-        case 0x02000000u: clint.msip = (val & 1) != 0; return;
-        case 0x02000001u: return;
-        case 0x02000002u: return;
-        case 0x02000003u: return;
-
-        case 0x02004000u: clint.mtimecmp_lo = (clint.mtimecmp_lo & ~(0xffu << 0))  | ((val & 0xff) << 0);  return;
-        case 0x02004001u: clint.mtimecmp_lo = (clint.mtimecmp_lo & ~(0xffu << 8))  | ((val & 0xff) << 8);  return;
-        case 0x02004002u: clint.mtimecmp_lo = (clint.mtimecmp_lo & ~(0xffu << 16)) | ((val & 0xff) << 16); return;
-        case 0x02004003u: clint.mtimecmp_lo = (clint.mtimecmp_lo & ~(0xffu << 24)) | ((val & 0xff) << 24); return;
-        case 0x02004004u: clint.mtimecmp_hi = (clint.mtimecmp_hi & ~(0xffu << 0))  | ((val & 0xff) << 0);  return;
-        case 0x02004005u: clint.mtimecmp_hi = (clint.mtimecmp_hi & ~(0xffu << 8))  | ((val & 0xff) << 8);  return;
-        case 0x02004006u: clint.mtimecmp_hi = (clint.mtimecmp_hi & ~(0xffu << 16)) | ((val & 0xff) << 16); return;
-        case 0x02004007u: clint.mtimecmp_hi = (clint.mtimecmp_hi & ~(0xffu << 24)) | ((val & 0xff) << 24); return;
-
-        case 0x0200bff8u: clint.mtime_lo = (clint.mtime_lo & ~(0xffu << 0))  | ((val & 0xff) << 0);  return;
-        case 0x0200bff9u: clint.mtime_lo = (clint.mtime_lo & ~(0xffu << 8))  | ((val & 0xff) << 8);  return;
-        case 0x0200bffau: clint.mtime_lo = (clint.mtime_lo & ~(0xffu << 16)) | ((val & 0xff) << 16); return;
-        case 0x0200bffbu: clint.mtime_lo = (clint.mtime_lo & ~(0xffu << 24)) | ((val & 0xff) << 24); return;
-        case 0x0200bffcu: clint.mtime_hi = (clint.mtime_hi & ~(0xffu << 0))  | ((val & 0xff) << 0);  return;
-        case 0x0200bffdu: clint.mtime_hi = (clint.mtime_hi & ~(0xffu << 8))  | ((val & 0xff) << 8);  return;
-        case 0x0200bffeu: clint.mtime_hi = (clint.mtime_hi & ~(0xffu << 16)) | ((val & 0xff) << 16); return;
-        case 0x0200bfffu: clint.mtime_hi = (clint.mtime_hi & ~(0xffu << 24)) | ((val & 0xff) << 24); return;
-
-        // CLINT ( 0x11000000 base — matches default DTB)
-        case 0x11004000u: clint.mtimecmp_lo = (clint.mtimecmp_lo & ~(0xffu << 0))  | ((val & 0xff) << 0);  return;
-        case 0x11004001u: clint.mtimecmp_lo = (clint.mtimecmp_lo & ~(0xffu << 8))  | ((val & 0xff) << 8);  return;
-        case 0x11004002u: clint.mtimecmp_lo = (clint.mtimecmp_lo & ~(0xffu << 16)) | ((val & 0xff) << 16); return;
-        case 0x11004003u: clint.mtimecmp_lo = (clint.mtimecmp_lo & ~(0xffu << 24)) | ((val & 0xff) << 24); return;
-        case 0x11004004u: clint.mtimecmp_hi = (clint.mtimecmp_hi & ~(0xffu << 0))  | ((val & 0xff) << 0);  return;
-        case 0x11004005u: clint.mtimecmp_hi = (clint.mtimecmp_hi & ~(0xffu << 8))  | ((val & 0xff) << 8);  return;
-        case 0x11004006u: clint.mtimecmp_hi = (clint.mtimecmp_hi & ~(0xffu << 16)) | ((val & 0xff) << 16); return;
-        case 0x11004007u: clint.mtimecmp_hi = (clint.mtimecmp_hi & ~(0xffu << 24)) | ((val & 0xff) << 24); return;
-
-        case 0x1100bff8u: clint.mtime_lo = (clint.mtime_lo & ~(0xffu << 0))  | ((val & 0xff) << 0);  return;
-        case 0x1100bff9u: clint.mtime_lo = (clint.mtime_lo & ~(0xffu << 8))  | ((val & 0xff) << 8);  return;
-        case 0x1100bffau: clint.mtime_lo = (clint.mtime_lo & ~(0xffu << 16)) | ((val & 0xff) << 16); return;
-        case 0x1100bffbu: clint.mtime_lo = (clint.mtime_lo & ~(0xffu << 24)) | ((val & 0xff) << 24); return;
-        case 0x1100bffcu: clint.mtime_hi = (clint.mtime_hi & ~(0xffu << 0))  | ((val & 0xff) << 0);  return;
-        case 0x1100bffdu: clint.mtime_hi = (clint.mtime_hi & ~(0xffu << 8))  | ((val & 0xff) << 8);  return;
-        case 0x1100bffeu: clint.mtime_hi = (clint.mtime_hi & ~(0xffu << 16)) | ((val & 0xff) << 16); return;
-        case 0x1100bfffu: clint.mtime_hi = (clint.mtime_hi & ~(0xffu << 24)) | ((val & 0xff) << 24); return;
-
-        // SYSCON at 0x11100000 (poweroff=0x5555, reboot=0x7777)
-        case 0x11100000u:
-            if (val == 0x55) syscon_cmd = 0x5555;
-            else if (val == 0x77) syscon_cmd = 0x7777;
-            return;
-        case 0x11100001u: return;
-        case 0x11100002u: return;
-        case 0x11100003u: return;
-
-        // UART
-        case 0x10000000u:
-            if ((UART_GET2(LCR) >> 7) == 0)
-            {
-                UART_SET1(THR, val);
-                UART_SET2(LSR, (UART_GET2(LSR) & ~LSR_THR_EMPTY));
-                uartUpdateIir();
-            }
-            return;
-        case 0x10000001u:
-            if (UART_GET2(LCR) >> 7 == 0)
-            {
-                if ((UART_GET1(IER) & IER_THREINT_BIT) == 0 &&
-                    (val & IER_THREINT_BIT) != 0 &&
-                    UART_GET1(THR) == 0)
-                {
-                    uart.thre_ip = true;
-                }
-                UART_SET1(IER, val);
-                uartUpdateIir();
-            }
-            return;
-        case 0x10000003u: UART_SET2(LCR, val); return;
-        case 0x10000004u: UART_SET2(MCR, val); return;
-        case 0x10000007u: UART_SET2(SCR, val); return;
-        }
-
-        return; // unmapped MMIO write — ignore
+        busWrite(addr, val & 0xff, 1);
+        return;
     }
 
     // ---- RAM (bit 31 set) ----
     u32 phys = addr & 0x7FFFFFFFu;
-    if (phys >= (u32)RV32_MEM_SIZE)
+    if (phys >= mem_size)
         return;
+    if (page_flags[phys >> 12])
+        pageWritten(phys);
     mem[phys] = (u8)val;
 }
 
@@ -693,25 +562,34 @@ void RV32::memSetHalfWord(u32 addr, u32 val)
     if (addr & 0x80000000u)
     {
         u32 phys = addr & 0x7FFFFFFFu;
-        if (phys <= (u32)(RV32_MEM_SIZE - 2))
+        if (phys <= mem_size - 2)
         {
+            if (page_flags[phys >> 12] | page_flags[(phys + 1) >> 12])
+            {
+                pageWritten(phys);
+                pageWritten(phys + 1);
+            }
             mem[phys]     = (u8)(val);
             mem[phys + 1] = (u8)(val >> 8);
         }
         return;
     }
-    memSetByte(addr, val & 0xFF);
-    memSetByte(addr + 1, (val >> 8) & 0xFF);
+    busWrite(addr, val & 0xFFFF, 2);
 }
 
 void RV32::memSetWord(u32 addr, u32 val)
 {
-    // Fast path: RAM addresses have bit 31 set — skip MMIO dispatch (4x cheaper)
+    // Fast path: RAM addresses have bit 31 set — skip MMIO dispatch
     if (addr & 0x80000000u)
     {
         u32 phys = addr & 0x7FFFFFFFu;
-        if (phys <= (u32)(RV32_MEM_SIZE - 4))
+        if (phys <= mem_size - 4)
         {
+            if (page_flags[phys >> 12] | page_flags[(phys + 3) >> 12])
+            {
+                pageWritten(phys);
+                pageWritten(phys + 3);
+            }
             mem[phys]     = (u8)(val);
             mem[phys + 1] = (u8)(val >> 8);
             mem[phys + 2] = (u8)(val >> 16);
@@ -719,10 +597,407 @@ void RV32::memSetWord(u32 addr, u32 val)
         }
         return;
     }
-    memSetByte(addr, val & 0xFF);
-    memSetByte(addr + 1, (val >> 8) & 0xFF);
-    memSetByte(addr + 2, (val >> 16) & 0xFF);
-    memSetByte(addr + 3, val >> 24);
+    busWrite(addr, val, 4);
+}
+
+// Slow path for stores into a flagged RAM page (phys is a RAM offset).
+// A store into a page with pre-decoded or translated instructions drops
+// PAGE_CODE/PAGE_JIT so the page is re-decoded on its next fetch from it, and
+// a store into a framebuffer page marks it dirty by dropping PAGE_FB_CLEAN.
+void RV32::pageWritten(u32 phys)
+{
+    page_flags[phys >> 12] &= ~(PAGE_CODE | PAGE_JIT | PAGE_FB_CLEAN);
+}
+
+// Set PAGE_* flags on a RAM page. Host TLB write entries for the page are
+// dropped so that its stores reach pageWritten().
+void RV32::pageSetFlags(u32 phys, u8 flags)
+{
+    page_flags[phys >> 12] |= flags;
+    u8 *page = mem + (phys & ~0xfffu);
+    for (u32 i = 0; i < RV32_TLB_SIZE; i++)
+    {
+        host_tlb_entry *e = &htlb[i];
+        if (e->tag_write != TLB_INVALID && (u8 *)(e->addend + e->tag_write) == page)
+            e->tag_write = TLB_INVALID;
+    }
+}
+
+// Set bit i of `bitmap` (FB_PAGES bits, which the caller has cleared) for
+// each framebuffer page i stored to since the last call, and start watching
+// those pages again. Returns the number of dirty pages. Only this hart's
+// stores are tracked: the caller is the GUI (EmuThread::publish), which always
+// runs a single hart, since hart_count is set only by the headless runner.
+u32 RV32::fbDirty(u64 *bitmap)
+{
+    u32 base = FB_RAM_BASE & 0x7FFFFFFFu;
+    if ((u64)base + FB_BYTES > mem_size)
+        return 0;
+    u32 dirty = 0;
+    for (u32 i = 0; i < FB_PAGES; i++)
+    {
+        u8 *flags = &page_flags[(base >> 12) + i];
+        if ((*flags & PAGE_FB_CLEAN) != 0)
+            continue;
+        *flags |= PAGE_FB_CLEAN;
+        bitmap[i / 64] |= 1ull << (i % 64);
+        dirty++;
+    }
+    if (dirty == 0)
+        return 0;
+
+    // Like pageSetFlags(), in one pass over the host TLB for the whole window
+    uintptr_t lo = (uintptr_t)(mem + base);
+    uintptr_t hi = lo + (uintptr_t)FB_PAGES * RV32_PAGE_SIZE;
+    for (u32 i = 0; i < RV32_TLB_SIZE; i++)
+    {
+        host_tlb_entry *e = &htlb[i];
+        uintptr_t page = e->addend + e->tag_write;
+        if (e->tag_write != TLB_INVALID && page >= lo && page < hi)
+            e->tag_write = TLB_INVALID;
+    }
+    return dirty;
+}
+
+// Invalidate every pre-decoded page (fence.i)
+void RV32::codeFlush()
+{
+    for (u32 i = 0; i < mem_size / RV32_PAGE_SIZE; i++)
+        page_flags[i] &= ~(PAGE_CODE | PAGE_JIT);
+}
+
+// Host pointer for an AMO on the word at physical `addr`, or nullptr if it is
+// not an aligned RAM word (the caller then falls back to memGet/memSetWord)
+u32 *RV32::amoWord(u32 addr)
+{
+    u32 phys = addr & 0x7FFFFFFFu;
+    if ((addr & 0x80000000u) == 0 || (addr & 3) != 0 || phys > mem_size - 4)
+        return nullptr;
+    if (page_flags[phys >> 12])
+        pageWritten(phys);
+    return (u32 *)(mem + phys);
+}
+
+// lr.w on physical `addr`: load the word and reserve it
+u32 RV32::loadReserved(u32 addr)
+{
+    u32 phys = addr & 0x7FFFFFFFu;
+    u32 val;
+    if ((addr & 0x80000000u) != 0 && (addr & 3) == 0 && phys <= mem_size - 4)
+    {
+        // Read and reserve as one step for the other harts' sc.w and AMOs
+        AmoGuard guard(smp, addr);
+        val = __atomic_load_n((u32 *)(mem + phys), __ATOMIC_ACQUIRE);
+        reservationSet(addr, val);
+    }
+    else
+    {
+        val = memGetWord(addr);
+        reservationSet(addr, val);
+    }
+    return val;
+}
+
+// Publish a reservation; enabled last, so another hart that sees it enabled
+// also sees its address
+void RV32::reservationSet(u32 addr, u32 val)
+{
+    __atomic_store_n(&reservation_addr, addr, __ATOMIC_RELAXED);
+    __atomic_store_n(&reservation_val, val, __ATOMIC_RELAXED);
+    __atomic_store_n(&reservation_en, true, __ATOMIC_RELEASE);
+}
+
+// sc.w on physical `addr`: store `val` if the reservation still holds, as one
+// compare-and-swap against the value lr.w read. Returns true on success. The
+// check, the store and breaking the other harts' reservations all hold the
+// word's AmoGuard, as do lr.w and AMOs, so no other hart's sc.w or AMO can
+// write the word in between.
+bool RV32::storeConditional(u32 addr, u32 val)
+{
+    AmoGuard guard(smp, addr);
+    if (!__atomic_exchange_n(&reservation_en, false, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&reservation_addr, __ATOMIC_RELAXED) != addr)
+        return false;
+    u32 *word = amoWord(addr);
+    if (word == nullptr)
+        memSetWord(addr, val);
+    else
+    {
+        u32 expected = __atomic_load_n(&reservation_val, __ATOMIC_RELAXED);
+        if (!__atomic_compare_exchange_n(word, &expected, val, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            return false;
+    }
+    reservationBreak(addr);
+    return true;
+}
+
+// Clear the other harts' reservations on `addr` after an sc.w or AMO wrote it,
+// holding the word's AmoGuard, so a value written and then written back (ABA)
+// by sc.w or AMOs still fails their sc.w. Plain stores are only caught by the
+// compare-and-swap, so plain stores that restore the value go unnoticed.
+void RV32::reservationBreak(u32 addr)
+{
+    if (smp == nullptr)
+        return;
+    for (u32 i = 0; i < smp->count; i++)
+    {
+        RV32 *h = smp->cpu[i];
+        if (h != this && __atomic_load_n(&h->reservation_en, __ATOMIC_RELAXED) &&
+            __atomic_load_n(&h->reservation_addr, __ATOMIC_RELAXED) == addr)
+            __atomic_store_n(&h->reservation_en, false, __ATOMIC_RELEASE);
+    }
+}
+
+///////////////////////////////////////
+// MMIO Devices
+///////////////////////////////////////
+// Bus callbacks for the built-in devices; opaque is the RV32
+static u32 clint_read(void *opaque, u32 offset, u32 size)
+{
+    return ((RV32 *)opaque)->clintRead(offset, size);
+}
+
+static void clint_write(void *opaque, u32 offset, u32 val, u32 size)
+{
+    ((RV32 *)opaque)->clintWrite(offset, val, size);
+}
+
+// Devices with byte registers see wider accesses as consecutive bytes
+#define MMIO_BYTEWISE_READ(dev)                                             \
+    static u32 dev##_read(void *opaque, u32 offset, u32 size)               \
+    {                                                                       \
+        u32 val = 0;                                                        \
+        for (u32 i = 0; i < size; i++)                                      \
+            val |= (u32)((RV32 *)opaque)->dev##Read(offset + i) << (i * 8); \
+        return val;                                                         \
+    }
+#define MMIO_BYTEWISE_WRITE(dev)                                            \
+    static void dev##_write(void *opaque, u32 offset, u32 val, u32 size)    \
+    {                                                                       \
+        for (u32 i = 0; i < size; i++)                                      \
+            ((RV32 *)opaque)->dev##Write(offset + i, (u8)(val >> (i * 8))); \
+    }
+
+MMIO_BYTEWISE_READ(uart)
+MMIO_BYTEWISE_WRITE(uart)
+MMIO_BYTEWISE_READ(rtc)
+MMIO_BYTEWISE_WRITE(rtc)
+MMIO_BYTEWISE_READ(kbd)
+MMIO_BYTEWISE_WRITE(syscon)
+
+// Register the built-in devices. Later windows take over the pages they
+// cover, so the network buffers are mapped after the DTB CLINT window they
+// sit in. Every hart reaches hart 0's devices; the CLINT is mapped per hart
+// since it decodes registers relative to the accessing hart.
+void RV32::busInit()
+{
+    bus.reset();
+    if (dtb != nullptr)
+        bus.map("dtb", DTB_MMIO_BASE, DTB_MMIO_SIZE, dtb, mmioReadBuffer, nullptr);
+    bus.map("clint", CLINT_MMIO_BASE, CLINT_MMIO_SIZE, this, clint_read, clint_write);
+    bus.map("rtc", RTC_MMIO_BASE, RTC_MMIO_SIZE, dev, rtc_read, rtc_write);
+    bus.map("uart", UART_MMIO_BASE, UART_MMIO_SIZE, dev, uart_read, uart_write);
+    bus.map("kbd", KBD_MMIO_BASE, KBD_MMIO_SIZE, dev, kbd_read, nullptr);
+    bus.map("clint", CLINT_DTB_MMIO_BASE, CLINT_MMIO_SIZE, this, clint_read, clint_write);
+    bus.map("net-tx", NET_TX_MMIO_BASE, 0x1000u - 4u, dev->net.nettx + 4, nullptr, mmioWriteBuffer);
+    bus.map("net-rx", NET_RX_MMIO_BASE, 0x1000u, dev->net.netrx, mmioReadBuffer, nullptr);
+    bus.map("syscon", SYSCON_MMIO_BASE, 4u, dev, nullptr, syscon_write);
+    if (mtd != nullptr && mtd_size != 0)
+        bus.map("mtd", MTD_MMIO_BASE, mtd_size, mtd, mmioReadBuffer, nullptr);
+}
+
+// Device accesses. On a multi-hart machine they are serialized with the other
+// harts' and with hart 0's device events.
+u32 RV32::busRead(u32 addr, u32 size)
+{
+    mmio_access = true;
+    SmpGuard guard(smp);
+    return bus.read(addr, size);
+}
+
+void RV32::busWrite(u32 addr, u32 val, u32 size)
+{
+    mmio_access = true;
+    {
+        SmpGuard guard(smp);
+        bus.write(addr, val, size);
+    }
+    // The write may have posted a device event to hart 0
+    if (dev != this)
+        dev->wake();
+}
+
+// Hart whose msip/mtimecmp registers are CLINT slot `slot`, or nullptr
+RV32 *RV32::clintHart(u32 slot)
+{
+    if (smp == nullptr)
+        return slot == 0 ? this : nullptr;
+    return slot < smp->count ? smp->cpu[slot] : nullptr;
+}
+
+// CLINT registers: msip of hart h at 0x4 * h, mtimecmp at 0x4000 + 0x8 * h,
+// mtime at 0xbff8. Registers of hart h live in that hart's clint_state.
+#define CLINT_DECODE(reg, h)                                   \
+    if ((reg) < 0x4000u)                                       \
+    {                                                          \
+        h = clintHart((reg) >> 2);                             \
+        reg = 0x0000u;                                         \
+    }                                                          \
+    else if ((reg) < 0xbff8u)                                  \
+    {                                                          \
+        h = clintHart(((reg) - 0x4000u) >> 3);                 \
+        reg = 0x4000u | ((reg) & 4u);                          \
+    }
+
+u32 RV32::clintRead(u32 offset, u32 size)
+{
+    u32 word;
+    u32 reg = offset & ~3u;
+    RV32 *h = this;
+    CLINT_DECODE(reg, h)
+    if (h == nullptr)
+        return 0;
+    switch (reg)
+    {
+    case 0x0000u: word = h->clint.msip ? 1 : 0; break;
+    case 0x4000u: word = h->clint.mtimecmp_lo; break;
+    case 0x4004u: word = h->clint.mtimecmp_hi; break;
+    case 0xbff8u:
+        if ((offset & 3) == 0)
+            clintSync();
+        word = clint.mtime_lo;
+        break;
+    case 0xbffcu:
+        if ((offset & 3) == 0)
+            clintSync();
+        word = clint.mtime_hi;
+        break;
+    default:
+        return 0;
+    }
+    word >>= (offset & 3) * 8;
+    return size == 4 ? word : word & ((1u << (size * 8)) - 1);
+}
+
+void RV32::clintWrite(u32 offset, u32 val, u32 size)
+{
+    u32 shift = (offset & 3) * 8;
+    u32 mask = (size == 4 ? 0xffffffffu : (1u << (size * 8)) - 1) << shift;
+    val <<= shift;
+    u32 reg = offset & ~3u;
+    RV32 *h = this;
+    CLINT_DECODE(reg, h)
+    if (h == nullptr)
+        return;
+    switch (reg)
+    {
+    case 0x0000u:
+        if ((offset & 3) == 0)
+        {
+            __atomic_store_n(&h->clint.msip, (val & 1) != 0, __ATOMIC_RELEASE);
+            if (h != this)
+                h->wake();
+        }
+        return;
+    case 0x4000u: h->clint.mtimecmp_lo = (h->clint.mtimecmp_lo & ~mask) | (val & mask); break;
+    case 0x4004u: h->clint.mtimecmp_hi = (h->clint.mtimecmp_hi & ~mask) | (val & mask); break;
+    case 0xbff8u: clint.mtime_lo = (clint.mtime_lo & ~mask) | (val & mask); return;
+    case 0xbffcu: clint.mtime_hi = (clint.mtime_hi & ~mask) | (val & mask); return;
+    default:
+        return;
+    }
+
+    // Another hart's timer is rescheduled on its own thread
+    if (h != this)
+    {
+        __atomic_store_n(&h->timer_dirty, true, __ATOMIC_RELEASE);
+        h->wake();
+        return;
+    }
+
+    // Writing to mtimecmp clears MTIP/STIP (spec requirement)
+    u32 cur_mip = readCsrRaw(CSR_MIP);
+    writeCsrRaw(CSR_MIP, cur_mip & ~(MIP_MTIP | MIP_STIP));
+    timerSchedule();
+}
+
+u8 RV32::uartRead(u32 offset)
+{
+    switch (offset)
+    {
+    case 0:
+        if ((UART_GET2(LCR) >> 7) == 0)
+        {
+            u32 rbr = UART_GET1(RBR);
+            UART_SET1(RBR, 0);
+            UART_SET2(LSR, (UART_GET2(LSR) & ~LSR_DATA_AVAILABLE));
+            uartUpdateIir();
+            return (u8)rbr;
+        }
+        return 0;
+    case 1: return UART_GET2(LCR) >> 7 == 0 ? UART_GET1(IER) : 0;
+    case 2: return UART_GET1(IIR);
+    case 3: return UART_GET2(LCR);
+    case 4: return UART_GET2(MCR);
+    case 5: return UART_GET2(LSR);
+    case 7: return UART_GET2(SCR);
+    }
+    return 0;
+}
+
+void RV32::uartWrite(u32 offset, u8 data)
+{
+    u32 val = data;
+    switch (offset)
+    {
+    case 0:
+        if ((UART_GET2(LCR) >> 7) == 0)
+        {
+            UART_SET1(THR, val);
+            UART_SET2(LSR, (UART_GET2(LSR) & ~LSR_THR_EMPTY));
+            uartUpdateIir();
+            scheduleNow(SCHED_UART_TX);
+        }
+        return;
+    case 1:
+        if (UART_GET2(LCR) >> 7 == 0)
+        {
+            if ((UART_GET1(IER) & IER_THREINT_BIT) == 0 &&
+                (val & IER_THREINT_BIT) != 0 &&
+                UART_GET1(THR) == 0)
+            {
+                uart.thre_ip = true;
+                scheduleNow(SCHED_UART_TX);
+            }
+            UART_SET1(IER, val);
+            uartUpdateIir();
+        }
+        return;
+    case 3: UART_SET2(LCR, val); return;
+    case 4: UART_SET2(MCR, val); return;
+    case 7: UART_SET2(SCR, val); return;
+    }
+}
+
+// MMIO keyboard: KBDSTAT at 0, KBDDATA at 1 (reading it consumes the entry)
+u8 RV32::kbdRead(u32 offset)
+{
+    if (kbd_head == kbd_tail)
+        return 0;
+    if (offset == 0)
+        return 1u | (kbd_buf[kbd_head].release ? 2u : 0u);
+    u8 k = kbd_buf[kbd_head].keycode;
+    kbd_head = (kbd_head + 1) % 64;
+    return k;
+}
+
+// SYSCON poweroff=0x5555, reboot=0x7777 (only the low byte is decoded)
+void RV32::sysconWrite(u32 offset, u8 data)
+{
+    if (offset != 0)
+        return;
+    if (data == 0x55) syscon_cmd = 0x5555;
+    else if (data == 0x77) syscon_cmd = 0x7777;
 }
 
 ///////////////////////////////////////
@@ -735,38 +1010,30 @@ void RV32::uartUpdateIir()
     UART_SET1(IIR, (rx_ip ? IIR_RD_AVAILABLE : (thre_ip ? IIR_THR_EMPTY : IIR_NO_INTERRUPT)));
 }
 
-void RV32::uartTick()
+void RV32::uartTick(bool poll_input)
 {
     bool rx_ip = false;
 
-    if ((clock % 0x400) == 0 && UART_GET1(RBR) == 0)
+    if (poll_input && UART_GET1(RBR) == 0)
     {
-#ifndef __EMSCRIPTEN__
-        int byteswaiting = 0;
-        ioctl(STDIN_FILENO, FIONREAD, &byteswaiting);
-        if (byteswaiting > 0)
+        u8 c;
+        if (console->get(&c))
         {
-            char c;
-            if (read(STDIN_FILENO, &c, 1) == 1)
+            u32 value = c;
+            UART_SET1(RBR, value);
+            UART_SET2(LSR, (UART_GET2(LSR) | LSR_DATA_AVAILABLE));
+            uartUpdateIir();
+            if ((UART_GET1(IER) & IER_RXINT_BIT) != 0)
             {
-                u32 value = (u8)c;
-                UART_SET1(RBR, value);
-                UART_SET2(LSR, (UART_GET2(LSR) | LSR_DATA_AVAILABLE));
-                uartUpdateIir();
-                if ((UART_GET1(IER) & IER_RXINT_BIT) != 0)
-                {
-                    rx_ip = true;
-                }
+                rx_ip = true;
             }
         }
-#endif
     }
 
     u32 thr = UART_GET1(THR);
     if (thr != 0)
     {
-        printf("%c", (char)thr);
-        fflush(stdout);
+        console->put((u8)thr);
         UART_SET1(THR, 0);
         UART_SET2(LSR, (UART_GET2(LSR) | LSR_THR_EMPTY));
         uartUpdateIir();
@@ -776,15 +1043,12 @@ void RV32::uartTick()
         }
     }
 
+    // Pulse for one retire: Emulator::retire() raises SEIP and clears it
     if (uart.thre_ip || rx_ip)
     {
         uart.interrupting = true;
         uart.thre_ip = false;
     }
-    else
-    {
-        uart.interrupting = false;
-    }
 }
 
 void RV32::kbdPush(u8 keycode, bool release)
@@ -793,6 +1057,368 @@ void RV32::kbdPush(u8 keycode, bool release)
     if (next == kbd_head) return; // drop if buffer full
     kbd_buf[kbd_tail] = {keycode, release};
     kbd_tail = next;
+    wake();
+}
+
+///////////////////////////////////////
+// Network Functions
+///////////////////////////////////////
+// Deliver a received packet once the guest has posted its RX buffer, or poll
+// again later. SEIP is shared with the UART, which takes precedence.
+void RV32::netPoll()
+{
+    if (net.rx_ready == 0)
+        return;
+
+    u32 cur_mip = readCsrRaw(CSR_MIP);
+    if ((cur_mip & MIP_SEIP) == 0 && !uart.interrupting)
+    {
+        uint8_t *net_data = nullptr;
+        uint32_t net_data_len = 0;
+        if (net_recv(&netlink, &net_data, &net_data_len))
+        {
+            writeCsrRaw(CSR_MIP, cur_mip | MIP_SEIP);
+            if (net_data_len > 4096u - sizeof(u32))
+                net_data_len = 4096u - sizeof(u32);
+            *((u32 *)net.netrx) = net_data_len;
+            memcpy(net.netrx + sizeof(u32), net_data, net_data_len);
+            net.rx_ready = 0;
+            free(net_data);
+            return;
+        }
+    }
+    schedule(SCHED_NET_RX, SCHED_POLL_INTERVAL);
+}
+
+// Network CSRs drive hart 0's network device from any hart
+void RV32::netCsrWrite(u32 address, u32 value)
+{
+    SmpGuard guard(smp);
+    if (address == CSR_NET_TX_BUF_SIZE_AND_SEND)
+        net_send(&dev->netlink, dev->net.nettx, value);
+    else
+    {
+        dev->net.rx_ready = value;
+        dev->scheduleNow(SCHED_NET_RX);
+        if (dev != this)
+            dev->wake();
+    }
+}
+
+///////////////////////////////////////
+// CLINT Functions
+///////////////////////////////////////
+// Refresh mtime (microseconds since init) from the wall clock, and re-measure
+// the instruction rate once at least a millisecond has passed
+void RV32::clintSync()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    int64_t elapsed_usec = ((int64_t)now.tv_sec  - start_time_sec)  * 1000000LL
+                         + ((int64_t)now.tv_usec - start_time_usec);
+    uint64_t mtime = (uint64_t)elapsed_usec;
+    clint.mtime_lo = (u32)(mtime & 0xFFFFFFFFu);
+    clint.mtime_hi = (u32)(mtime >> 32);
+
+    if (mtime - rate_usec >= 1000)
+    {
+        u64 rate = ((u64)(clock - rate_clock) << 16) / (mtime - rate_usec);
+        sched_rate = rate > 0xFFFFFFFFu ? 0xFFFFFFFFu : (u32)rate;
+        rate_clock = clock;
+        rate_usec = mtime;
+    }
+}
+
+// Raise MTIP if mtime has reached mtimecmp, otherwise schedule the next check.
+// The remaining wall-clock time is converted at 3/4 of the measured rate, so
+// checks land early rather than late and converge on the deadline.
+void RV32::timerSchedule()
+{
+    unschedule(SCHED_TIMER);
+    clint.mtip = false;
+    // mtimecmp == 0 is the reset value; never fire on it
+    if (clint.mtimecmp_lo == 0 && clint.mtimecmp_hi == 0)
+        return;
+
+    clintSync();
+    u64 mtime = ((u64)clint.mtime_hi << 32) | clint.mtime_lo;
+    u64 mtimecmp = ((u64)clint.mtimecmp_hi << 32) | clint.mtimecmp_lo;
+    if (mtime >= mtimecmp)
+    {
+        clint.mtip = true;
+        return;
+    }
+
+    u64 left_usec = mtimecmp - mtime;
+    if (left_usec > 0xFFFFFFFFu)
+        left_usec = 0xFFFFFFFFu;
+    u64 delay = (left_usec * sched_rate) >> 16;
+    delay -= delay / 4;
+    if (delay > SCHED_MAX_DELAY)
+        delay = SCHED_MAX_DELAY;
+    schedule(SCHED_TIMER, delay ? (u32)delay : 1);
+}
+
+// Pick up an mtimecmp another hart wrote (clears MTIP/STIP like a local write)
+void RV32::timerReload()
+{
+    __atomic_store_n(&timer_dirty, false, __ATOMIC_RELAXED);
+    SmpGuard guard(smp);
+    u32 cur_mip = readCsrRaw(CSR_MIP);
+    writeCsrRaw(CSR_MIP, cur_mip & ~(MIP_MTIP | MIP_STIP));
+    timerSchedule();
+}
+
+///////////////////////////////////////
+// WFI Idle
+///////////////////////////////////////
+// Block the host thread until mtimecmp is reached, UART input or a network
+// packet arrives, wake() is called, or `max_usec` passes. mtime follows the
+// wall clock, so guest time advances across the sleep. Sources that fired are
+// serviced immediately, since their instruction deadlines have not moved.
+// Returns false if no sleep was possible.
+bool RV32::idle(u32 max_usec)
+{
+#ifndef __EMSCRIPTEN__
+    u64 timeout = max_usec;
+    if (clint.mtimecmp_lo != 0 || clint.mtimecmp_hi != 0)
+    {
+        clintSync();
+        u64 mtime = ((u64)clint.mtime_hi << 32) | clint.mtime_lo;
+        u64 mtimecmp = ((u64)clint.mtimecmp_hi << 32) | clint.mtimecmp_lo;
+        if (mtime >= mtimecmp)
+            return false;
+        if (mtimecmp - mtime < timeout)
+            timeout = mtimecmp - mtime;
+    }
+
+    fd_set fds;
+    int nfds = 0;
+    FD_ZERO(&fds);
+#define IDLE_WATCH(fd)          \
+    {                           \
+        FD_SET(fd, &fds);       \
+        if ((fd) >= nfds)       \
+            nfds = (fd) + 1;    \
+    }
+    // Buffered console input wakes us through wake_fd; without the console
+    // I/O thread, wait on the input descriptor directly. Only hart 0 services
+    // the devices.
+    bool devices = dev == this;
+    bool watch_uart = devices && UART_GET1(RBR) == 0;
+    if (watch_uart && console->inputReady())
+        return false;
+    int uart_fd = watch_uart ? console->inputFd() : -1;
+    bool watch_net = devices && net.rx_ready != 0 && netlink.fd_conn != -1;
+    if (wake_fd[0] != -1)
+        IDLE_WATCH(wake_fd[0])
+    if (uart_fd != -1)
+        IDLE_WATCH(uart_fd)
+    if (watch_net)
+        IDLE_WATCH(netlink.fd_conn)
+#undef IDLE_WATCH
+
+    struct timeval tv;
+    tv.tv_sec = (time_t)(timeout / 1000000u);
+    tv.tv_usec = (suseconds_t)(timeout % 1000000u);
+    int n = select(nfds, &fds, NULL, NULL, &tv);
+
+    if (wake_fd[0] != -1 && n > 0 && FD_ISSET(wake_fd[0], &fds))
+    {
+        char buf[64];
+        while (read(wake_fd[0], buf, sizeof(buf)) > 0)
+            ;
+    }
+
+    // No instructions ran while asleep: restart the rate measurement
+    SmpGuard guard(smp);
+    clintSync();
+    rate_clock = clock;
+    rate_usec = ((u64)clint.mtime_hi << 32) | clint.mtime_lo;
+
+    timerSchedule();
+    if (watch_uart && (console->inputReady() || (n > 0 && uart_fd != -1 && FD_ISSET(uart_fd, &fds))))
+        uartTick(true);
+    if (n > 0 && watch_net && FD_ISSET(netlink.fd_conn, &fds))
+        netPoll();
+    return true;
+#else
+    // The browser main loop must not block
+    (void)max_usec;
+    return false;
+#endif
+}
+
+// Create the wake() pipe (no-op if it exists). Without it, idle() sleeps
+// until its timeout. False if the pipe cannot be created.
+bool RV32::wakeInit()
+{
+#ifndef __EMSCRIPTEN__
+    if (wake_fd[0] != -1)
+        return true;
+    if (pipe(wake_fd) != 0)
+    {
+        perror("wake: pipe");
+        return false;
+    }
+    fcntl(wake_fd[0], F_SETFL, fcntl(wake_fd[0], F_GETFL, 0) | O_NONBLOCK);
+    fcntl(wake_fd[1], F_SETFL, fcntl(wake_fd[1], F_GETFL, 0) | O_NONBLOCK);
+#endif
+    return true;
+}
+
+// End an idle() sleep from another thread or a signal handler
+void RV32::wake()
+{
+    if (wake_fd[1] != -1)
+    {
+        char c = 0;
+        if (write(wake_fd[1], &c, 1) < 0)
+            return; // pipe full: a wakeup is already pending
+    }
+}
+
+///////////////////////////////////////
+// Event Scheduler
+///////////////////////////////////////
+// (Re)arm event `id` to fire `delay` instructions from now. Due events run
+// from Emulator::retire() via schedRun().
+void RV32::schedule(u32 id, u32 delay)
+{
+    if (delay > SCHED_MAX_DELAY)
+        delay = SCHED_MAX_DELAY;
+    s32 i = sched_pos[id];
+    if (i < 0)
+    {
+        i = (s32)sched_count++;
+        sched_pos[id] = i;
+    }
+    sched_heap[i].deadline = clock + delay;
+    sched_heap[i].id = id;
+    schedFix((u32)i);
+}
+
+// Arm device event `id` to fire at once. Device handlers run on whichever
+// hart made the access, but only the owning hart touches its scheduler and
+// clock, so on a multi-hart machine the event is posted to sched_post and
+// armed from the owner's next Emulator::retire() (see schedTake).
+void RV32::scheduleNow(u32 id)
+{
+    if (smp == nullptr)
+        schedule(id, 0);
+    else
+        __atomic_fetch_or(&sched_post, 1u << id, __ATOMIC_RELEASE);
+}
+
+// Arm the events other harts posted with scheduleNow
+void RV32::schedTake()
+{
+    u32 ids = __atomic_exchange_n(&sched_post, 0, __ATOMIC_ACQUIRE);
+    for (u32 id = 0; ids != 0; id++, ids >>= 1)
+        if (ids & 1)
+            schedule(id, 0);
+}
+
+void RV32::unschedule(u32 id)
+{
+    s32 i = sched_pos[id];
+    if (i < 0)
+        return;
+    sched_pos[id] = -1;
+    if ((u32)i != --sched_count)
+    {
+        sched_heap[i] = sched_heap[sched_count];
+        sched_pos[sched_heap[i].id] = i;
+        schedFix((u32)i);
+    }
+    sched_next = sched_count ? sched_heap[0].deadline : clock + SCHED_MAX_DELAY;
+}
+
+// Restore heap order around entry `i` after its deadline changed
+void RV32::schedFix(u32 i)
+{
+#define SCHED_BEFORE(a, b) ((s32)(sched_heap[a].deadline - sched_heap[b].deadline) < 0)
+#define SCHED_SWAP(a, b)                                        \
+    {                                                           \
+        sched_event e = sched_heap[a];                          \
+        sched_heap[a] = sched_heap[b];                          \
+        sched_heap[b] = e;                                      \
+        sched_pos[sched_heap[a].id] = (s32)(a);                 \
+        sched_pos[sched_heap[b].id] = (s32)(b);                 \
+    }
+    while (i > 0 && SCHED_BEFORE(i, (i - 1) / 2))
+    {
+        u32 parent = (i - 1) / 2;
+        SCHED_SWAP(i, parent)
+        i = parent;
+    }
+    for (;;)
+    {
+        u32 child = 2 * i + 1;
+        if (child >= sched_count)
+            break;
+        if (child + 1 < sched_count && SCHED_BEFORE(child + 1, child))
+            child++;
+        if (!SCHED_BEFORE(child, i))
+            break;
+        SCHED_SWAP(i, child)
+        i = child;
+    }
+#undef SCHED_SWAP
+#undef SCHED_BEFORE
+    sched_next = sched_heap[0].deadline;
+}
+
+// Empty the event queue; the UART input poll and profiler sampling run for
+// the whole session, across reboots and snapshot restores.
+// The rate starts low so the first timer deadlines err on the early side.
+void RV32::schedReset()
+{
+    sched_count = 0;
+    for (u32 i = 0; i < SCHED_COUNT; i++)
+        sched_pos[i] = -1;
+    sched_next = clock + SCHED_MAX_DELAY;
+    sched_rate = 16u << 16;
+    rate_clock = clock;
+    rate_usec = 0;
+    // Console input is polled by the hart owning the devices
+    if (dev == this)
+        schedule(SCHED_UART_RX, SCHED_POLL_INTERVAL);
+    if (prof != nullptr)
+        schedule(SCHED_PROF, prof->period);
+}
+
+// Run every event whose deadline has passed
+void RV32::schedRun()
+{
+    SmpGuard guard(smp);
+    while (sched_count > 0 && (s32)(clock - sched_heap[0].deadline) >= 0)
+    {
+        u32 id = sched_heap[0].id;
+        unschedule(id);
+        switch (id)
+        {
+        case SCHED_TIMER:
+            timerSchedule();
+            break;
+        case SCHED_UART_TX:
+            uartTick(false);
+            break;
+        case SCHED_UART_RX:
+            uartTick(true);
+            schedule(SCHED_UART_RX, SCHED_POLL_INTERVAL);
+            break;
+        case SCHED_NET_RX:
+            netPoll();
+            break;
+        case SCHED_PROF:
+            // pc is still that of the instruction that just retired
+            schedule(SCHED_PROF, prof->sample(pc, csr.privilege));
+            break;
+        }
+    }
+    if (sched_count == 0)
+        sched_next = clock + SCHED_MAX_DELAY;
 }
 
 ///////////////////////////////////////
@@ -803,6 +1429,79 @@ void RV32::mmuUpdate(u32 satp)
 {
     mmu.mode = (satp >> 31) & 1;
     mmu.ppn  = satp & 0x3fffffu; // bits 21:0 = PPN in Sv32
+    tlbFlush();
+}
+
+void RV32::tlbFlush()
+{
+    for (u32 i = 0; i < RV32_TLB_SIZE; i++)
+    {
+        itlb[i].vpn = TLB_INVALID;
+        dtlb[i].vpn = TLB_INVALID;
+        htlb[i].tag_read  = TLB_INVALID;
+        htlb[i].tag_write = TLB_INVALID;
+    }
+    tlb_ctx = csr.privilege | (csr.data[CSR_MSTATUS] & TLB_MSTATUS_MASK);
+}
+
+// Cached permissions depend on privilege and MPRV/MPP/SUM/MXR; called after
+// anything that may change them (traps, xRET, mstatus/sstatus writes)
+void RV32::tlbSync()
+{
+    if ((csr.privilege | (csr.data[CSR_MSTATUS] & TLB_MSTATUS_MASK)) != tlb_ctx)
+        tlbFlush();
+}
+
+// Enter a translation that just succeeded into the host TLB. Only RAM pages
+// are cached, and pages with PAGE_* flags set are never made writable so their
+// stores keep going through memSet* and pageWritten().
+void RV32::hostFill(u32 vaddr, u32 paddr, u32 mode)
+{
+    u32 phys = paddr & 0x7FFFFFFFu;
+    if ((paddr & 0x80000000u) == 0 || phys >= mem_size)
+        return;
+    if (mode == MMU_ACCESS_WRITE && page_flags[phys >> 12])
+        return;
+
+    u32 vpage = vaddr & ~0xfffu;
+    host_tlb_entry *e = &htlb[(vaddr >> 12) & (RV32_TLB_SIZE - 1)];
+    if (e->tag_read != vpage && e->tag_write != vpage)
+    {
+        e->tag_read  = TLB_INVALID;
+        e->tag_write = TLB_INVALID;
+        e->addend    = (uintptr_t)(mem + (phys & ~0xfffu)) - vpage;
+    }
+    if (mode == MMU_ACCESS_WRITE)
+        e->tag_write = vpage;
+    else
+        e->tag_read = vpage;
+}
+
+u32 RV32::vmReadSlow(ins_ret *ret, u32 vaddr, u32 size)
+{
+    u32 addr = mmuTranslate(ret, vaddr, MMU_ACCESS_READ);
+    if (ret->trap.en)
+        return 0;
+    hostFill(vaddr, addr, MMU_ACCESS_READ);
+    if (size == 1)
+        return memGetByte(addr);
+    if (size == 2)
+        return memGetHalfWord(addr);
+    return memGetWord(addr);
+}
+
+void RV32::vmWriteSlow(ins_ret *ret, u32 vaddr, u32 val, u32 size)
+{
+    u32 addr = mmuTranslate(ret, vaddr, MMU_ACCESS_WRITE);
+    if (ret->trap.en)
+        return;
+    hostFill(vaddr, addr, MMU_ACCESS_WRITE);
+    if (size == 1)
+        memSetByte(addr, val);
+    else if (size == 2)
+        memSetHalfWord(addr, val);
+    else
+        memSetWord(addr, val);
 }
 
 #define MMU_FAULT(ret_ptr, addr_val, mode_val) \
@@ -818,10 +1517,8 @@ u32 RV32::mmuTranslate(ins_ret *ret, u32 addr, u32 mode)
     if (mmu.mode == MMU_MODE_OFF)
         return addr;
 
-    // Determine effective privilege and mstatus flags
-    u32 mstatus = readCsrRaw(CSR_MSTATUS);
-    u32 sum  = (mstatus >> 18) & 1;
-    u32 mxr  = (mstatus >> 19) & 1;
+    // Determine effective privilege
+    u32 mstatus = csr.data[CSR_MSTATUS];
     u32 priv = ((mstatus >> 17) & 1) ? ((mstatus >> 11) & 3) : csr.privilege;
 
     // Machine mode always uses physical addresses;
@@ -830,6 +1527,23 @@ u32 RV32::mmuTranslate(ins_ret *ret, u32 addr, u32 mode)
         (csr.privilege == PRIV_MACHINE && mode == MMU_ACCESS_FETCH))
         return addr;
 
+    u32 vpn = addr >> 12;
+    tlb_entry *e = (mode == MMU_ACCESS_FETCH ? itlb : dtlb) + (vpn & (RV32_TLB_SIZE - 1));
+    if (e->vpn == vpn && ((e->perm >> mode) & 1))
+        return (e->ppn << 12) | (addr & 0xfffu);
+
+    return mmuWalk(ret, addr, mode, priv, e);
+}
+
+// Full Sv32 walk on a TLB miss. Fills `e` with the mapping and the accesses it
+// permits in the current context, then faults if `mode` is not among them.
+u32 RV32::mmuWalk(ins_ret *ret, u32 addr, u32 mode, u32 priv, tlb_entry *e)
+{
+    STATS_INC(stats.page_walks);
+    u32 mstatus = csr.data[CSR_MSTATUS];
+    u32 sum  = (mstatus >> 18) & 1;
+    u32 mxr  = (mstatus >> 19) & 1;
+
     // Two-level Sv32 page-table walk
     bool super = false;
     u32 page_ppn0 = 0, page_ppn1 = 0;
@@ -865,27 +1579,28 @@ u32 RV32::mmuTranslate(ins_ret *ret, u32 addr, u32 mode)
         { MMU_FAULT(ret, addr, mode) } // non-leaf at bottom level
     }
 
-    // Permission check
-    bool perm = (priv == PRIV_MACHINE) ||
-                (priv == PRIV_USER && page_u) ||
-                (priv == PRIV_SUPERVISOR && (!page_u || sum));
-    bool access = (mode == MMU_ACCESS_FETCH && page_x) ||
-                  (mode == MMU_ACCESS_READ  && (page_r || (page_x && mxr))) ||
-                  (mode == MMU_ACCESS_WRITE && page_w);
+    // Privilege check, misaligned superpage check and accessed bit apply to
+    // every access type; dirty bit must also be set for writes
+    bool ok = ((priv == PRIV_USER && page_u) ||
+               (priv == PRIV_SUPERVISOR && (!page_u || sum))) &&
+              !(super && page_ppn0 != 0) && page_a;
 
-    if (!(perm && access)) { MMU_FAULT(ret, addr, mode) }
+    u32 perm = 0;
+    if (ok && page_x)
+        perm |= 1u << MMU_ACCESS_FETCH;
+    if (ok && (page_r || (page_x && mxr)))
+        perm |= 1u << MMU_ACCESS_READ;
+    if (ok && page_w && page_d)
+        perm |= 1u << MMU_ACCESS_WRITE;
 
-    // Misaligned superpage check
-    if (super && page_ppn0 != 0) { MMU_FAULT(ret, addr, mode) }
+    u32 ppn = (page_ppn1 << 10) | (super ? ((addr >> 12) & 0x3ffu) : page_ppn0);
+    e->vpn  = addr >> 12;
+    e->ppn  = ppn;
+    e->perm = perm;
 
-    // Accessed / dirty bits must be set
-    if (!page_a || (mode == MMU_ACCESS_WRITE && !page_d)) { MMU_FAULT(ret, addr, mode) }
+    if (!((perm >> mode) & 1)) { MMU_FAULT(ret, addr, mode) }
 
-    // Build physical address
-    u32 pa = addr & 0xfffu; // page offset
-    pa |= super ? (((addr >> 12) & 0x3ffu) << 12) : (page_ppn0 << 12);
-    pa |= page_ppn1 << 22;
-    return pa;
+    return (ppn << 12) | (addr & 0xfffu);
 }
 #undef MMU_FAULT
 
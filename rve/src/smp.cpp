@@ -0,0 +1,85 @@
+#include "smp.h"
+#include "emu.h"
+#include <unistd.h>
+
+Smp::Smp(Emulator &boot) : boot(boot)
+{
+    count = 1;
+    for (u32 i = 0; i < SMP_HARTS_MAX; i++)
+    {
+        cpu[i] = nullptr;
+        hart[i] = nullptr;
+    }
+    quit = false;
+    started = false;
+}
+
+Smp::~Smp()
+{
+    stop();
+    for (u32 i = 1; i < SMP_HARTS_MAX; i++)
+        delete hart[i];
+}
+
+void Smp::start(u32 n)
+{
+    stop();
+    count = n < 1 ? 1 : n > SMP_HARTS_MAX ? SMP_HARTS_MAX : n;
+    cpu[0] = &boot.cpu;
+    boot.cpu.smp = this;
+
+    // Secondary harts enter the boot image like hart 0, with a0 = mhartid
+    // and a1 = the DTB; the kernel parks them until it brings them online
+    for (u32 i = 1; i < count; i++)
+    {
+        if (hart[i] == nullptr)
+            hart[i] = new Emulator();
+        hart[i]->initializeHart(boot, i);
+        cpu[i] = &hart[i]->cpu;
+    }
+    for (u32 i = 1; i < count; i++)
+    {
+        cpu[i]->smp = this;
+        cpu[i]->pc = boot.cpu.pc;
+        cpu[i]->xreg[10] = i;
+        cpu[i]->xreg[11] = boot.cpu.xreg[11];
+    }
+    printf("INFO: SMP: %u harts\n", count);
+
+#ifndef __EMSCRIPTEN__
+    for (u32 i = 1; i < count; i++)
+        thread[i] = std::thread(&Smp::hartLoop, this, hart[i]);
+    started = true;
+#endif
+}
+
+void Smp::stop()
+{
+    if (!started)
+        return;
+    quit = true;
+#ifndef __EMSCRIPTEN__
+    for (u32 i = 1; i < count; i++)
+    {
+        cpu[i]->wake();
+        if (thread[i].joinable())
+            thread[i].join();
+    }
+#endif
+    quit = false;
+    started = false;
+}
+
+// Run one secondary hart while hart 0's Emulator is running
+void Smp::hartLoop(Emulator *emu)
+{
+    while (!quit.load(std::memory_order_relaxed))
+    {
+        if (!__atomic_load_n(&boot.running, __ATOMIC_RELAXED))
+        {
+            usleep(10000);
+            continue;
+        }
+        emu->emulateBlock(BLOCK_MAX_INS);
+    }
+}
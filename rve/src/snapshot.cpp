@@ -0,0 +1,278 @@
+#include "snapshot.h"
+#include "emu.h"
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+///////////////////////////////////////
+// Helpers
+///////////////////////////////////////
+static bool pageIsZero(const u8 *page)
+{
+    const u64 *p = (const u64 *)page;
+    u64 acc = 0;
+    for (u32 i = 0; i < RV32_PAGE_SIZE / sizeof(u64); i++)
+        acc |= p[i];
+    return acc == 0;
+}
+
+static u64 pageAlign(u64 offset)
+{
+    return (offset + RV32_PAGE_SIZE - 1) & ~(u64)(RV32_PAGE_SIZE - 1);
+}
+
+static void stateSave(RV32 &cpu, snapshot_state *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->clock = cpu.clock;
+    s->pc = cpu.pc;
+    memcpy(s->xreg, cpu.xreg, sizeof(s->xreg));
+    memcpy(s->freg, cpu.freg, sizeof(s->freg));
+    s->csr = cpu.csr;
+    cpu.clintSync();
+    s->clint = cpu.clint;
+    s->mtime = ((u64)cpu.clint.mtime_hi << 32) | cpu.clint.mtime_lo;
+    s->uart = cpu.uart;
+    s->mmu = cpu.mmu;
+    s->net_rx_ready = cpu.net.rx_ready;
+    memcpy(s->net_tx, cpu.net.nettx, sizeof(s->net_tx));
+    memcpy(s->net_rx, cpu.net.netrx, sizeof(s->net_rx));
+    s->rtc0 = cpu.rtc0;
+    s->rtc1 = cpu.rtc1;
+    s->syscon_cmd = cpu.syscon_cmd;
+    s->reservation_en = cpu.reservation_en;
+    s->reservation_addr = cpu.reservation_addr;
+    s->reservation_val = cpu.reservation_val;
+    s->wfi = cpu.wfi;
+    s->kbd_head = (u32)cpu.kbd_head;
+    s->kbd_tail = (u32)cpu.kbd_tail;
+    for (u32 i = 0; i < 64; i++)
+    {
+        s->kbd_keycode[i] = cpu.kbd_buf[i].keycode;
+        s->kbd_release[i] = cpu.kbd_buf[i].release;
+    }
+}
+
+static void stateLoad(RV32 &cpu, const snapshot_state *s)
+{
+    cpu.clock = s->clock;
+    cpu.pc = s->pc;
+    memcpy(cpu.xreg, s->xreg, sizeof(s->xreg));
+    memcpy(cpu.freg, s->freg, sizeof(s->freg));
+    cpu.csr = s->csr;
+    cpu.clint = s->clint;
+    cpu.uart = s->uart;
+    cpu.mmu = s->mmu;
+    cpu.tlbFlush();
+    cpu.net.rx_ready = s->net_rx_ready;
+    memcpy(cpu.net.nettx, s->net_tx, sizeof(s->net_tx));
+    memcpy(cpu.net.netrx, s->net_rx, sizeof(s->net_rx));
+    cpu.rtc0 = s->rtc0;
+    cpu.rtc1 = s->rtc1;
+    cpu.syscon_cmd = s->syscon_cmd;
+    cpu.reservation_en = s->reservation_en != 0;
+    cpu.reservation_addr = s->reservation_addr;
+    cpu.reservation_val = s->reservation_val;
+    cpu.wfi = s->wfi != 0;
+    cpu.kbd_head = (int)(s->kbd_head & 63);
+    cpu.kbd_tail = (int)(s->kbd_tail & 63);
+    for (u32 i = 0; i < 64; i++)
+    {
+        cpu.kbd_buf[i].keycode = s->kbd_keycode[i];
+        cpu.kbd_buf[i].release = s->kbd_release[i] != 0;
+    }
+
+    // Guest time continues from the saved mtime
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    int64_t start_usec = (int64_t)now.tv_sec * 1000000LL + now.tv_usec - (int64_t)s->mtime;
+    cpu.start_time_sec = start_usec / 1000000LL;
+    cpu.start_time_usec = (int32_t)(start_usec % 1000000LL);
+
+    // Device deadlines are relative to the restored clock
+    cpu.schedReset();
+    cpu.rate_usec = s->mtime;
+    cpu.timerSchedule();
+    cpu.schedule(SCHED_UART_TX, 0);
+    if (cpu.net.rx_ready != 0)
+        cpu.schedule(SCHED_NET_RX, 0);
+}
+
+///////////////////////////////////////
+// Snapshot Functions
+///////////////////////////////////////
+bool snapshotSave(Emulator &emu, const char *path)
+{
+    if (emu.smp != nullptr && emu.smp->count > 1)
+    {
+        fprintf(stderr, "ERRO: snapshots of multi-hart machines are not supported\n");
+        return false;
+    }
+    u32 mem_size = emu.ram_size;
+    std::vector<u32> pages;
+    for (u32 page = 0; page < mem_size / RV32_PAGE_SIZE; page++)
+    {
+        if (!pageIsZero(emu.memory + page * RV32_PAGE_SIZE))
+            pages.push_back(page);
+    }
+
+    snapshot_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    h.version = SNAPSHOT_VERSION;
+    h.header_size = sizeof(snapshot_header);
+    h.state_size = sizeof(snapshot_state);
+    h.mem_size = mem_size;
+    h.page_count = (u32)pages.size();
+    h.index_offset = sizeof(snapshot_header) + sizeof(snapshot_state);
+    h.data_offset = pageAlign(h.index_offset + (u64)h.page_count * sizeof(u32));
+    snprintf(h.image_path, sizeof(h.image_path), "%s", emu.bin_file_path.c_str());
+
+    snapshot_state *s = (snapshot_state *)malloc(sizeof(snapshot_state));
+    stateSave(emu.cpu, s);
+
+    // Write next to the target and rename, so readers never see a partial file
+    std::string tmp = std::string(path) + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "ERRO: snapshot: cannot create %s\n", tmp.c_str());
+        free(s);
+        return false;
+    }
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+              fwrite(s, sizeof(*s), 1, f) == 1 &&
+              (pages.empty() || fwrite(pages.data(), sizeof(u32), pages.size(), f) == pages.size());
+    free(s);
+
+    static const u8 zero[RV32_PAGE_SIZE] = {0};
+    u64 pad = h.data_offset - (h.index_offset + (u64)h.page_count * sizeof(u32));
+    if (ok && pad != 0)
+        ok = fwrite(zero, 1, pad, f) == pad;
+    for (size_t i = 0; ok && i < pages.size(); i++)
+        ok = fwrite(emu.memory + pages[i] * RV32_PAGE_SIZE, RV32_PAGE_SIZE, 1, f) == 1;
+
+    if (fclose(f) != 0)
+        ok = false;
+    if (!ok || rename(tmp.c_str(), path) != 0)
+    {
+        fprintf(stderr, "ERRO: snapshot: failed to write %s\n", path);
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    printf("INFO: snapshot: saved %s (%u of %u pages)\n",
+           path, h.page_count, mem_size / RV32_PAGE_SIZE);
+    return true;
+}
+
+u32 snapshotMemSize(const char *path)
+{
+    snapshot_header h;
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "ERRO: snapshot: cannot open %s\n", path);
+        return 0;
+    }
+    bool ok = fread(&h, sizeof(h), 1, f) == 1 &&
+              memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0;
+    fclose(f);
+    if (!ok)
+    {
+        fprintf(stderr, "ERRO: snapshot: %s: not a snapshot file\n", path);
+        return 0;
+    }
+    return h.mem_size;
+}
+
+bool snapshotLoad(Emulator &emu, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "ERRO: snapshot: cannot open %s\n", path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (u64)st.st_size < sizeof(snapshot_header) + sizeof(snapshot_state))
+    {
+        fprintf(stderr, "ERRO: snapshot: %s is truncated\n", path);
+        close(fd);
+        return false;
+    }
+    u64 file_size = (u64)st.st_size;
+    u8 *file = (u8 *)mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == MAP_FAILED)
+    {
+        perror("ERRO: snapshot: mmap");
+        close(fd);
+        return false;
+    }
+
+    const snapshot_header *h = (const snapshot_header *)file;
+    const char *error = nullptr;
+    if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+        error = "not a snapshot file";
+    else if (h->version != SNAPSHOT_VERSION ||
+             h->header_size != sizeof(snapshot_header) ||
+             h->state_size != sizeof(snapshot_state))
+        error = "snapshot was written by a different build";
+    else if (h->mem_size != emu.ram_size)
+        error = "snapshot RAM size does not match the emulator";
+    else if ((u64)h->index_offset + (u64)h->page_count * sizeof(u32) > h->data_offset ||
+             h->data_offset + (u64)h->page_count * RV32_PAGE_SIZE > file_size)
+        error = "snapshot is truncated";
+    if (error != nullptr)
+    {
+        fprintf(stderr, "ERRO: snapshot: %s: %s\n", path, error);
+        munmap(file, file_size);
+        close(fd);
+        return false;
+    }
+
+    const u32 *index = (const u32 *)(file + h->index_offset);
+    const u8 *data = file + h->data_offset;
+    u32 page_total = h->mem_size / RV32_PAGE_SIZE;
+    for (u32 i = 0; i < h->page_count; i++)
+    {
+        if (index[i] >= page_total)
+        {
+            fprintf(stderr, "ERRO: snapshot: %s: bad page index\n", path);
+            munmap(file, file_size);
+            close(fd);
+            return false;
+        }
+    }
+
+    // Map each run of consecutive pages copy-on-write from the file, so
+    // instances restored from one snapshot share its clean pages
+    emu.ramReset();
+    u32 mapped = 0;
+    for (u32 i = 0; i < h->page_count;)
+    {
+        u32 run = 1;
+        while (i + run < h->page_count && index[i + run] == index[i] + run)
+            run++;
+        u64 file_offset = h->data_offset + (u64)i * RV32_PAGE_SIZE;
+        if (emu.ramMapFile(fd, file_offset, index[i] * RV32_PAGE_SIZE, run * RV32_PAGE_SIZE))
+            mapped += run;
+        else
+            memcpy(emu.memory + index[i] * RV32_PAGE_SIZE, data + (u64)i * RV32_PAGE_SIZE,
+                   (size_t)run * RV32_PAGE_SIZE);
+        i += run;
+    }
+    close(fd);
+
+    stateLoad(emu.cpu, (const snapshot_state *)(file + sizeof(snapshot_header)));
+    if (h->image_path[0] != '\0')
+        emu.bin_file_path.assign(h->image_path, strnlen(h->image_path, SNAPSHOT_PATH_MAX));
+
+    printf("INFO: snapshot: restored %s (%u pages, %u mapped)\n", path, h->page_count, mapped);
+    munmap(file, file_size);
+    return true;
+}